@@ -0,0 +1,1074 @@
+#include "blockchain.h"
+#include "blockstore.h"
+#include "codec.h"
+#include "compact.h"
+#include "crypto.h"
+#include "mempool.h"
+#include "merkle.h"
+#include "metrics.h"
+#include "pow.h"
+#include "protocol.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <fstream>
+#include <filesystem>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <new>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+/* p2p_bench - micro-benchmarks for the node's hot paths
+
+   Builds a synthetic chain (wallets, signed transfers, mined blocks) of
+   the requested size, then times each operation one call at a time and
+   prints ops/sec, latency percentiles and heap allocations per call as
+   JSON on stdout. Progress goes to stderr, so the JSON can be piped
+   straight into a file and diffed between builds.
+
+     p2p_bench [--blocks N] [--txs N] [--wallets N] [--scheme ed25519|rsa]
+               [--iterations N] [--mempool-txs N] [--threads N]
+               [--long-blocks N] [--filter substring[,substring...]]
+
+   --long-blocks is the length of the chain the archive vs pruned memory
+   benchmarks replay.
+
+   Read-only paths promise not to touch the heap. A benchmark that goes
+   over its allocation limit is reported on stderr and the run exits 1,
+   which is what the bench_allocs ctest checks.
+*/
+
+/*Allocation counting*/
+
+// Every heap allocation in the process goes through here, so a benchmark
+// can report how many allocations one call costs
+static atomic<uint64_t> allocations(0);
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p)
+    {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+// Keeping the compiler from optimising a result away
+template <typename T>
+static void keep(const T& value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+/*Options*/
+
+struct Options
+{
+    size_t blocks = 50;
+    size_t txs_per_block = 100;
+    size_t wallets = 16;
+    KeyType scheme = KeyType::Ed25519;
+    size_t iterations = 10000;
+    size_t mempool_txs = 1000000;
+    unsigned threads = 0;
+    size_t long_blocks = 1000;
+    string filter;
+};
+
+/*Results*/
+
+struct Result
+{
+    string name;
+    size_t iterations = 0;
+    double seconds = 0.0;
+    vector<double> latencies_ns;
+    double allocs_per_op = 0.0;
+    double max_allocs_per_op = -1.0; // negative: no limit
+    vector<pair<string, double>> extra;
+};
+
+static vector<Result> results;
+static Options options;
+
+// Any of the comma separated substrings in --filter selects a benchmark
+static bool selected(const string& name)
+{
+    if (options.filter.empty())
+    {
+        return true;
+    }
+    size_t start = 0;
+    while (start <= options.filter.size())
+    {
+        size_t end = options.filter.find(',', start);
+        if (end == string::npos)
+        {
+            end = options.filter.size();
+        }
+        if (end > start && name.find(options.filter.substr(start, end - start)) != string::npos)
+        {
+            return true;
+        }
+        start = end + 1;
+    }
+    return false;
+}
+
+static double percentile(vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0.0;
+    }
+    size_t i = min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5));
+    return sorted[i];
+}
+
+// Timing [op] once per iteration. [op] gets the iteration number.
+static Result& measure(const string& name, size_t iterations, const function<void(size_t)>& op)
+{
+    Result result;
+    result.name = name;
+    result.iterations = iterations;
+    result.latencies_ns.reserve(iterations);
+    cerr << "[BENCH] " << name << " x" << iterations << endl;
+
+    uint64_t allocs_before = allocations.load();
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++)
+    {
+        auto t0 = chrono::steady_clock::now();
+        op(i);
+        auto t1 = chrono::steady_clock::now();
+        result.latencies_ns.push_back(chrono::duration<double, nano>(t1 - t0).count());
+    }
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    // The latency vector was reserved up front, so it adds nothing here
+    result.allocs_per_op = iterations ? (double)(allocations.load() - allocs_before) / iterations : 0.0;
+    results.push_back(move(result));
+    return results.back();
+}
+
+static string jsonString(const string& value)
+{
+    string out = "\"";
+    for (char c : value)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out.push_back('\\');
+        }
+        out.push_back(c);
+    }
+    return out + "\"";
+}
+
+static void printJson()
+{
+    cout << setprecision(6) << fixed;
+    cout << "{\n  \"config\": {"
+         << "\"blocks\": " << options.blocks
+         << ", \"txs_per_block\": " << options.txs_per_block
+         << ", \"wallets\": " << options.wallets
+         << ", \"scheme\": " << jsonString(SignatureScheme::forType(options.scheme).name())
+         << ", \"iterations\": " << options.iterations
+         << ", \"mempool_txs\": " << options.mempool_txs
+         << ", \"threads\": " << options.threads
+         << ", \"hardware_threads\": " << thread::hardware_concurrency() << "},\n";
+    cout << "  \"results\": [";
+    for (size_t r = 0; r < results.size(); r++)
+    {
+        Result& result = results[r];
+        vector<double>& lat = result.latencies_ns;
+        sort(lat.begin(), lat.end());
+        double ops = result.seconds > 0.0 ? result.iterations / result.seconds : 0.0;
+        cout << (r ? ",\n    {" : "\n    {")
+             << "\"name\": " << jsonString(result.name)
+             << ", \"iterations\": " << result.iterations
+             << ", \"seconds\": " << result.seconds
+             << ", \"ops_per_sec\": " << ops;
+        if (!lat.empty())
+        {
+            cout << ", \"p50_ns\": " << percentile(lat, 0.50)
+                 << ", \"p90_ns\": " << percentile(lat, 0.90)
+                 << ", \"p99_ns\": " << percentile(lat, 0.99)
+                 << ", \"max_ns\": " << lat.back();
+        }
+        cout << ", \"allocs_per_op\": " << result.allocs_per_op;
+        if (result.max_allocs_per_op >= 0.0)
+        {
+            cout << ", \"max_allocs_per_op\": " << result.max_allocs_per_op;
+        }
+        for (const auto& field : result.extra)
+        {
+            cout << ", " << jsonString(field.first) << ": " << field.second;
+        }
+        cout << "}";
+    }
+    cout << "\n  ]\n}" << endl;
+}
+
+// Every benchmark that went over its allocation limit, on stderr
+static bool withinAllocationLimits()
+{
+    bool ok = true;
+    for (const Result& result : results)
+    {
+        if (result.max_allocs_per_op >= 0.0 && result.allocs_per_op > result.max_allocs_per_op)
+        {
+            cerr << "[BENCH] " << result.name << ": " << result.allocs_per_op
+                 << " allocs/op, expected at most " << result.max_allocs_per_op << endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/*Synthetic data*/
+
+struct Fixture
+{
+    vector<Wallet> wallets;
+    Blockchain chain;
+    vector<Transaction> sample_txs; // signed transfers that are not on the chain
+};
+
+static Transaction makeTransfer(Wallet& from, Wallet& to, double amount, time_t timestamp)
+{
+    Transaction tx;
+    tx.sending_address = from.getPublicKey();
+    tx.receiving_address = to.getAddress();
+    tx.amount = amount;
+    tx.timestamp = timestamp;
+    tx.id = tx.calculate_Hash();
+    tx.signature = from.sign(tx.id.view());
+    return tx;
+}
+
+// One reward block per wallet to fund it, then [blocks] blocks of
+// [txs_per_block] transfers between the wallets
+static void buildFixture(Fixture& fx)
+{
+    cerr << "[BENCH] Generating " << options.wallets << " wallets, " << options.blocks
+         << " blocks x " << options.txs_per_block << " transactions" << endl;
+    fx.wallets.resize(max<size_t>(2, options.wallets));
+    for (auto& wallet : fx.wallets)
+    {
+        wallet.generateKeys(options.scheme);
+    }
+    fx.chain.setMiningThreads(options.threads);
+
+    // Block output would drown the progress lines
+    streambuf* saved = cout.rdbuf();
+    ostringstream discard;
+    cout.rdbuf(discard.rdbuf());
+
+    for (auto& wallet : fx.wallets)
+    {
+        fx.chain.minePendingTransaction(wallet.getAddress());
+    }
+    size_t n = fx.wallets.size();
+    time_t stamp = 1;
+    for (size_t b = 0; b < options.blocks; b++)
+    {
+        for (size_t t = 0; t < options.txs_per_block; t++)
+        {
+            size_t k = b * options.txs_per_block + t;
+            fx.chain.addTransaction(makeTransfer(fx.wallets[k % n], fx.wallets[(k + 1) % n], 0.001, stamp++));
+        }
+        fx.chain.minePendingTransaction(fx.wallets[b % n].getAddress());
+    }
+    for (size_t i = 0; i < 256; i++)
+    {
+        fx.sample_txs.push_back(makeTransfer(fx.wallets[i % n], fx.wallets[(i + 1) % n], 0.5, stamp++));
+    }
+
+    cout.rdbuf(saved);
+}
+
+// The block with the most transactions, for the per-block benchmarks
+static const Block& largestBlock(const ChainSnapshot& snap)
+{
+    const Block* best = snap.blocks.front().get();
+    for (const auto& block : snap.blocks)
+    {
+        if (block->transactionCount() > best->transactionCount())
+        {
+            best = block.get();
+        }
+    }
+    return *best;
+}
+
+/*Benchmarks*/
+
+static void benchHashing()
+{
+    string small(64, 'a');
+    string large(1024, 'b');
+    if (selected("crypto.sha256_64B"))
+    {
+        measure("crypto.sha256_64B", options.iterations * 10, [&](size_t) { keep(Crypto::sha256(small)); });
+    }
+    if (selected("crypto.sha256_1KB"))
+    {
+        measure("crypto.sha256_1KB", options.iterations * 10, [&](size_t) { keep(Crypto::sha256(large)); });
+    }
+}
+
+// What recording a metric costs on the hot path
+static void benchMetrics()
+{
+    Metrics::Counter counter;
+    Metrics::Histogram histogram;
+    if (selected("metrics.counter_add"))
+    {
+        measure("metrics.counter_add", options.iterations, [&](size_t) { counter.add(); });
+    }
+    if (selected("metrics.histogram_observe"))
+    {
+        measure("metrics.histogram_observe", options.iterations, [&](size_t i) { histogram.observe(i * 1e-7); });
+    }
+    if (selected("metrics.timer"))
+    {
+        measure("metrics.timer", options.iterations, [&](size_t) { Metrics::Timer timer(histogram); });
+    }
+}
+
+static void benchPow(const Fixture& fx)
+{
+    auto snap = fx.chain.snapshot();
+    const Block& block = largestBlock(*snap);
+
+    if (selected("pow.kernel_hash"))
+    {
+        PoW::Kernel kernel(block.buildHeader());
+        unsigned char digest[Crypto::HASH_SIZE];
+        measure("pow.kernel_hash", options.iterations * 10, [&](size_t i)
+        {
+            kernel.hash(i, digest);
+            keep(digest);
+        });
+    }
+    // What every nonce used to cost: rebuilding the header as text and
+    // hex encoding the digest
+    if (selected("pow.string_hash_baseline"))
+    {
+        string previous_hash = block.getPreviousHash().toHex();
+        string tx_hashes;
+        for (const auto& tx : block.getTransactions())
+        {
+            tx_hashes += tx.id.toHex();
+        }
+        measure("pow.string_hash_baseline", options.iterations * 10, [&](size_t i)
+        {
+            keep(Crypto::sha256(to_string(block.getIndex()) + to_string(block.getTimestamp())
+                                + previous_hash + tx_hashes + to_string(i)));
+        });
+    }
+    if (selected("pow.mine_block"))
+    {
+        const int difficulty = 4;
+        size_t rounds = max<size_t>(3, options.iterations / 1000);
+        uint64_t hashes = 0;
+        Result& result = measure("pow.mine_block", rounds, [&](size_t i)
+        {
+            Block candidate(block.getIndex(), block.getTimestamp() + (time_t)i, block.getTransactions(),
+                            block.getPreviousHash());
+            streambuf* saved = cout.rdbuf();
+            ostringstream discard;
+            cout.rdbuf(discard.rdbuf());
+            hashes += candidate.mineBlock(difficulty, options.threads).totalHashes();
+            cout.rdbuf(saved);
+        });
+        result.extra.push_back({"difficulty", difficulty});
+        result.extra.push_back({"hashes_per_sec", hashes / result.seconds});
+    }
+}
+
+static void benchCodec(const Fixture& fx)
+{
+    auto snap = fx.chain.snapshot();
+    const Block& block = largestBlock(*snap);
+    string text = block.serialize();
+    string binary = Codec::encode(block);
+    size_t rounds = max<size_t>(10, options.iterations / 10);
+
+    if (selected("codec.block_text_serialize"))
+    {
+        measure("codec.block_text_serialize", rounds, [&](size_t) { keep(block.serialize()); })
+            .extra.push_back({"bytes", (double)text.size()});
+    }
+    if (selected("codec.block_text_deserialize"))
+    {
+        measure("codec.block_text_deserialize", rounds, [&](size_t) { keep(Block::deserialize(text)); });
+    }
+    if (selected("codec.block_binary_encode"))
+    {
+        measure("codec.block_binary_encode", rounds, [&](size_t) { keep(Codec::encode(block)); })
+            .extra.push_back({"bytes", (double)binary.size()});
+    }
+    if (selected("codec.block_binary_decode"))
+    {
+        measure("codec.block_binary_decode", rounds, [&](size_t)
+        {
+            Codec::BlockView view;
+            Codec::decodeBlock(binary, view);
+            keep(view.toBlock());
+        });
+    }
+    // Decoding to views only, as the network handlers do before deciding
+    // whether a block is worth materialising
+    if (selected("codec.block_binary_view"))
+    {
+        Result& result = measure("codec.block_binary_view", rounds, [&](size_t)
+        {
+            Codec::BlockView view;
+            keep(Codec::decodeBlock(binary, view));
+        });
+        result.max_allocs_per_op = 0;
+    }
+    if (selected("codec.chain_binary_encode"))
+    {
+        measure("codec.chain_binary_encode", max<size_t>(3, options.iterations / 1000), [&](size_t)
+        {
+            keep(fx.chain.encode());
+        });
+    }
+}
+
+// Rebuilding the largest block from a mempool holding every transaction
+// of the chain, the way a peer that has seen them all gossiped would
+static void benchCompact(const Fixture& fx)
+{
+    auto snap = fx.chain.snapshot();
+    const Block& block = largestBlock(*snap);
+    string binary = Codec::encode(block);
+    string compact;
+    Codec::encodeCompactBlock(block, binary.size(), compact);
+    size_t rounds = max<size_t>(10, options.iterations / 10);
+
+    if (selected("compact.encode"))
+    {
+        Result& result = measure("compact.encode", rounds, [&](size_t)
+        {
+            string out;
+            Codec::encodeCompactBlock(block, binary.size(), out);
+            keep(out);
+        });
+        result.extra.push_back({"bytes", (double)compact.size()});
+        result.extra.push_back({"full_block_bytes", (double)binary.size()});
+    }
+    if (selected("compact.reconstruct"))
+    {
+        Mempool pool;
+        for (const auto& b : snap->blocks)
+        {
+            for (const auto& tx : b->getTransactions())
+            {
+                if (tx.sending_address != "0")
+                {
+                    pool.add(tx);
+                }
+            }
+        }
+        Result& result = measure("compact.reconstruct", rounds, [&](size_t)
+        {
+            Codec::CompactBlockView view;
+            Compact::PartialBlock partial;
+            if (!Codec::decodeCompactBlock(compact, view) || !partial.init(view))
+            {
+                return;
+            }
+            pool.forEach([&](const Transaction& tx) { partial.offer(tx); });
+            Block rebuilt = partial.build();
+            keep(rebuilt.calculateHash() == block.getHash());
+        });
+        result.extra.push_back({"mempool_txs", (double)pool.size()});
+    }
+}
+
+static void benchChainReads(Fixture& fx)
+{
+    const string address = fx.wallets[0].getAddress();
+    if (selected("chain.get_balance"))
+    {
+        Result& result = measure("chain.get_balance", options.iterations * 10,
+                                 [&](size_t) { keep(fx.chain.getBalance(address)); });
+        result.max_allocs_per_op = 0;
+    }
+    if (selected("chain.snapshot"))
+    {
+        Result& result = measure("chain.snapshot", options.iterations * 10, [&](size_t) { keep(fx.chain.snapshot()); });
+        result.max_allocs_per_op = 0;
+    }
+    if (selected("chain.walk_blocks"))
+    {
+        Result& result = measure("chain.walk_blocks", options.iterations, [&](size_t)
+        {
+            size_t txs = 0;
+            for (const auto& block : fx.chain.snapshot()->blocks)
+            {
+                txs += block->getTransactions().size();
+            }
+            keep(txs);
+        });
+        result.max_allocs_per_op = 0;
+    }
+    if (selected("chain.get_locator"))
+    {
+        measure("chain.get_locator", options.iterations, [&](size_t) { keep(fx.chain.getLocator()); });
+    }
+    if (selected("chain.encode_blocks_after"))
+    {
+        vector<Hash256> locator = { fx.chain.snapshot()->blocks.front()->getHash() };
+        size_t bytes = 0;
+        Result& result = measure("chain.encode_blocks_after", max<size_t>(10, options.iterations / 100), [&](size_t)
+        {
+            string page = fx.chain.encodeBlocksAfter(locator, 500, 8 * 1024 * 1024);
+            bytes = page.size();
+        });
+        result.extra.push_back({"page_bytes", (double)bytes});
+    }
+}
+
+static void benchValidation(const Fixture& fx)
+{
+    unsigned hw = max(1u, thread::hardware_concurrency());
+    size_t rounds = max<size_t>(3, options.iterations / 2000);
+    size_t txs = 0;
+    for (const auto& block : fx.chain.snapshot()->blocks)
+    {
+        txs += block->transactionCount();
+    }
+    // Every signature verified for real, as before the signature cache
+    Transaction::setSignatureCacheCapacity(0);
+    if (selected("chain.validate_1_thread"))
+    {
+        measure("chain.validate_1_thread", rounds, [&](size_t) { keep(fx.chain.validateChain(1)); })
+            .extra.push_back({"transactions", (double)txs});
+    }
+    if (hw > 1 && selected("chain.validate_all_threads"))
+    {
+        Result& result = measure("chain.validate_all_threads", rounds, [&](size_t) { keep(fx.chain.validateChain(hw)); });
+        result.extra.push_back({"transactions", (double)txs});
+        result.extra.push_back({"threads", (double)hw});
+    }
+    Transaction::setSignatureCacheCapacity(1000000);
+    // Every signature already seen, as for a block of mempool transactions
+    if (selected("chain.validate_sigcached"))
+    {
+        fx.chain.validateChain(1);
+        measure("chain.validate_sigcached", rounds, [&](size_t) { keep(fx.chain.validateChain(1)); })
+            .extra.push_back({"transactions", (double)txs});
+    }
+}
+
+static void benchSignatures(Fixture& fx)
+{
+    for (KeyType type : { KeyType::Ed25519, KeyType::RSA2048 })
+    {
+        string scheme = SignatureScheme::forType(type).name();
+        Wallet wallet;
+        wallet.generateKeys(type);
+        string message = Crypto::sha256("benchmark message");
+        string signature = wallet.sign(message);
+        string public_key = wallet.getPublicKey();
+        size_t rounds = max<size_t>(10, options.iterations / (type == KeyType::RSA2048 ? 10 : 1));
+
+        if (selected("crypto.sign_" + scheme))
+        {
+            measure("crypto.sign_" + scheme, rounds, [&](size_t) { keep(wallet.sign(message)); });
+        }
+        // Parsing the public key every time, as before the key cache
+        if (selected("crypto.verify_" + scheme + "_uncached"))
+        {
+            Wallet::setKeyCacheCapacity(0);
+            measure("crypto.verify_" + scheme + "_uncached", rounds, [&](size_t)
+            {
+                keep(Wallet::verify(public_key, message, signature));
+            });
+            Wallet::setKeyCacheCapacity(4096);
+        }
+        if (selected("crypto.verify_" + scheme + "_cached"))
+        {
+            Wallet::verify(public_key, message, signature);
+            measure("crypto.verify_" + scheme + "_cached", rounds, [&](size_t)
+            {
+                keep(Wallet::verify(public_key, message, signature));
+            });
+        }
+    }
+    if (selected("crypto.tx_is_valid"))
+    {
+        Transaction::setSignatureCacheCapacity(0);
+        measure("crypto.tx_is_valid", options.iterations, [&](size_t i)
+        {
+            keep(fx.sample_txs[i % fx.sample_txs.size()].isValid());
+        });
+        Transaction::setSignatureCacheCapacity(1000000);
+    }
+    if (selected("crypto.tx_is_valid_sigcached"))
+    {
+        for (const auto& tx : fx.sample_txs)
+        {
+            tx.isValid();
+        }
+        measure("crypto.tx_is_valid_sigcached", options.iterations, [&](size_t i)
+        {
+            keep(fx.sample_txs[i % fx.sample_txs.size()].isValid());
+        });
+    }
+}
+
+static void benchMerkle(const Fixture& fx)
+{
+    const Block& block = largestBlock(*fx.chain.snapshot());
+    vector<Merkle::Hash> leaves;
+    for (size_t i = 0; i < 4096; i++)
+    {
+        leaves.push_back(Merkle::leafHash(Crypto::sha256Hash(to_string(i))));
+    }
+    if (selected("merkle.tree_append"))
+    {
+        Merkle::Tree tree;
+        measure("merkle.tree_append", options.iterations * 10, [&](size_t i)
+        {
+            tree.append(leaves[i % leaves.size()]);
+            keep(tree.root());
+        });
+    }
+    if (selected("merkle.block_root"))
+    {
+        measure("merkle.block_root", options.iterations, [&](size_t)
+        {
+            Merkle::Tree tree;
+            for (const auto& tx : block.getTransactions())
+            {
+                tree.appendTransaction(tx.id);
+            }
+            keep(tree.root());
+        });
+    }
+    Merkle::Hash root = Merkle::root(leaves);
+    if (selected("merkle.proof_build_4096"))
+    {
+        measure("merkle.proof_build_4096", max<size_t>(10, options.iterations / 100), [&](size_t i)
+        {
+            Merkle::Proof proof;
+            Merkle::buildProof(leaves, i % leaves.size(), proof);
+            keep(proof);
+        });
+    }
+    if (selected("merkle.proof_verify_4096"))
+    {
+        vector<Merkle::Proof> proofs(64);
+        for (size_t i = 0; i < proofs.size(); i++)
+        {
+            Merkle::buildProof(leaves, i * 61 % leaves.size(), proofs[i]);
+        }
+        measure("merkle.proof_verify_4096", options.iterations, [&](size_t i)
+        {
+            const Merkle::Proof& proof = proofs[i % proofs.size()];
+            keep(Merkle::verifyProof(leaves[proof.index], proof, root));
+        });
+    }
+}
+
+// Pushing far more transactions at the pool than it holds, with a
+// duplicate every third one, the way a gossip flood would
+static void benchMempool()
+{
+    if (!selected("mempool.flood"))
+    {
+        return;
+    }
+    Mempool pool(100000, 64 * 1024 * 1024);
+    vector<Transaction> txs(1024);
+    for (size_t i = 0; i < txs.size(); i++)
+    {
+        txs[i].sending_address = "sender" + to_string(i % 64);
+        txs[i].receiving_address = "receiver";
+        txs[i].signature = string(88, 's');
+    }
+    Result& result = measure("mempool.flood", options.mempool_txs, [&](size_t i)
+    {
+        size_t n = i % 3 == 2 ? i - 1 : i;
+        Transaction& tx = txs[i % txs.size()];
+        tx.amount = (double)(n * 7919 % 1000 + 1);
+        tx.id = Hash256();
+        memcpy(tx.id.data(), &n, sizeof(n));
+        keep(pool.add(tx));
+    });
+    MempoolStats stats = pool.stats();
+    result.extra.push_back({"final_count", (double)stats.count});
+    result.extra.push_back({"evicted", (double)stats.evicted});
+    result.extra.push_back({"duplicates", (double)stats.duplicates});
+
+    if (selected("mempool.select_block"))
+    {
+        measure("mempool.select_block", max<size_t>(10, options.iterations / 100), [&](size_t)
+        {
+            keep(pool.select(4096, 4 * 1024 * 1024));
+        });
+    }
+}
+
+static void benchFraming()
+{
+    if (!selected("protocol.frame_reassembly"))
+    {
+        return;
+    }
+    // 1 KB messages arriving in 1500 byte reads, so most straddle a read
+    string payload(1024, 'x');
+    string stream;
+    for (int i = 0; i < 64; i++)
+    {
+        stream += Protocol::frame(Protocol::MessageType::Tx, payload);
+    }
+    size_t messages = 0;
+    Result& result = measure("protocol.frame_reassembly", max<size_t>(10, options.iterations / 10), [&](size_t)
+    {
+        Protocol::FrameReader reader;
+        Protocol::Message message;
+        for (size_t pos = 0; pos < stream.size(); pos += 1500)
+        {
+            reader.append(stream.data() + pos, min<size_t>(1500, stream.size() - pos));
+            while (reader.next(message) == Protocol::FrameReader::Status::Message)
+            {
+                messages++;
+            }
+        }
+    });
+    result.extra.push_back({"messages_per_op", (double)messages / result.iterations});
+    result.extra.push_back({"bytes_per_op", (double)stream.size()});
+}
+
+static void benchStore(const Fixture& fx)
+{
+    if (!selected("store.append") && !selected("store.read_block") && !selected("store.reopen")
+        && !selected("store.open_chain") && !selected("state.load"))
+    {
+        return;
+    }
+    string dir = (filesystem::temp_directory_path() / ("p2p_bench_store_" + to_string(getpid()))).string();
+    filesystem::remove_all(dir);
+    auto snap = fx.chain.snapshot();
+    {
+        BlockStore store;
+        store.open(dir);
+        if (selected("store.append"))
+        {
+            measure("store.append", snap->blocks.size(), [&](size_t i) { keep(store.append(*snap->blocks[i])); });
+        }
+        else
+        {
+            for (const auto& block : snap->blocks)
+            {
+                store.append(*block);
+            }
+        }
+        store.flush();
+        if (selected("store.read_block"))
+        {
+            measure("store.read_block", options.iterations, [&](size_t i)
+            {
+                keep(store.blockData(i % store.height()));
+            });
+        }
+    }
+    if (selected("store.reopen"))
+    {
+        measure("store.reopen", 10, [&](size_t)
+        {
+            BlockStore store;
+            keep(store.open(dir));
+        });
+    }
+    // Starting a node: from the tip checkpoint, replaying the stored chain
+    // (no checkpoint, as after a crash) and loading a state snapshot
+    if (selected("store.open_chain"))
+    {
+        {
+            Blockchain chain;
+            chain.openStore(dir); // leaves a tip checkpoint behind
+        }
+        measure("store.open_chain", 10, [&](size_t)
+        {
+            Blockchain chain;
+            keep(chain.openStore(dir));
+        });
+        measure("store.open_chain_replay", 10, [&](size_t)
+        {
+            filesystem::remove(dir + "/tip.dat");
+            Blockchain chain;
+            keep(chain.openStore(dir));
+        });
+    }
+    if (selected("state.load"))
+    {
+        string path = dir + "_state.dat";
+        fx.chain.saveState(path);
+        Result& result = measure("state.load", 10, [&](size_t)
+        {
+            Blockchain chain;
+            keep(chain.loadState(path));
+        });
+        result.extra.push_back({"file_bytes", (double)filesystem::file_size(path)});
+        filesystem::remove(path);
+    }
+    filesystem::remove_all(dir);
+}
+
+// Readers hammering snapshot queries while the writer mines and connects
+// blocks; the reader rate shows whether reads ever wait on the writer
+static void benchConcurrency(Fixture& fx)
+{
+    if (!selected("stress.reads_while_mining"))
+    {
+        return;
+    }
+    cerr << "[BENCH] stress.reads_while_mining" << endl;
+    unsigned readers = max(2u, min(4u, thread::hardware_concurrency()));
+    atomic<bool> stop(false);
+    atomic<uint64_t> reads(0);
+    const string address = fx.wallets[0].getAddress();
+
+    streambuf* saved = cout.rdbuf();
+    ostringstream discard;
+    cout.rdbuf(discard.rdbuf());
+
+    vector<thread> threads;
+    for (unsigned r = 0; r < readers; r++)
+    {
+        threads.emplace_back([&]()
+        {
+            uint64_t local = 0;
+            while (!stop.load(memory_order_relaxed))
+            {
+                keep(fx.chain.getBalance(address));
+                keep(fx.chain.height());
+                local++;
+            }
+            reads += local;
+        });
+    }
+    size_t mined = max<size_t>(3, options.blocks / 10);
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < mined; i++)
+    {
+        fx.chain.minePendingTransaction(address);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stop = true;
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+    cout.rdbuf(saved);
+
+    Result result;
+    result.name = "stress.reads_while_mining";
+    result.iterations = reads.load();
+    result.seconds = seconds;
+    result.extra.push_back({"reader_threads", (double)readers});
+    result.extra.push_back({"blocks_mined", (double)mined});
+    results.push_back(move(result));
+}
+
+static bool parseArgs(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            cerr << "Missing value for " << arg << endl;
+            return false;
+        }
+        string value = argv[++i];
+        if (arg == "--blocks") options.blocks = stoul(value);
+        else if (arg == "--txs") options.txs_per_block = min<size_t>(4095, stoul(value));
+        else if (arg == "--wallets") options.wallets = stoul(value);
+        else if (arg == "--iterations") options.iterations = max<size_t>(1, stoul(value));
+        else if (arg == "--mempool-txs") options.mempool_txs = stoul(value);
+        else if (arg == "--threads") options.threads = stoul(value);
+        else if (arg == "--long-blocks") options.long_blocks = stoul(value);
+        else if (arg == "--filter") options.filter = value;
+        else if (arg == "--scheme")
+        {
+            const SignatureScheme* scheme = SignatureScheme::byName(value);
+            if (!scheme)
+            {
+                cerr << "Unknown signature scheme: " << value << endl;
+                return false;
+            }
+            options.scheme = scheme->type();
+        }
+        else
+        {
+            cerr << "Unknown option " << arg << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t residentBytes()
+{
+    ifstream statm("/proc/self/statm");
+    size_t pages = 0;
+    size_t resident = 0;
+    statm >> pages >> resident;
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Replaying a long chain into an archive node and into a pruned one. Each
+// runs in a child process, so memory one of them freed can't make the
+// other's growth look smaller.
+static void benchPruning(Fixture& fx)
+{
+    if (!selected("memory.archive") && !selected("memory.pruned"))
+    {
+        return;
+    }
+    size_t txs = max<size_t>(1, options.txs_per_block / 4);
+    cerr << "[BENCH] Mining a " << options.long_blocks << " block chain x " << txs << " transactions" << endl;
+    streambuf* saved = cout.rdbuf();
+    ostringstream discard;
+    cout.rdbuf(discard.rdbuf());
+
+    Blockchain source;
+    source.setMiningThreads(options.threads);
+    size_t n = fx.wallets.size();
+    for (auto& wallet : fx.wallets)
+    {
+        source.minePendingTransaction(wallet.getAddress());
+    }
+    time_t stamp = 1;
+    while (source.height() < options.long_blocks)
+    {
+        for (size_t t = 0; t < txs; t++)
+        {
+            size_t k = stamp;
+            source.addTransaction(makeTransfer(fx.wallets[k % n], fx.wallets[(k + 1) % n], 0.001, stamp++));
+        }
+        source.minePendingTransaction(fx.wallets[stamp % n].getAddress());
+    }
+    cout.rdbuf(saved);
+    auto source_snap = source.snapshot();
+    const BlockList& blocks = source_snap->blocks;
+
+    for (bool pruned : {false, true})
+    {
+        string name = pruned ? "memory.pruned" : "memory.archive";
+        if (!selected(name))
+        {
+            continue;
+        }
+        cerr << "[BENCH] " << name << endl;
+        // seconds, resident growth, block bytes held, blocks held
+        double values[4] = {};
+        int fds[2];
+        if (pipe(fds) != 0)
+        {
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(fds[0]);
+            size_t before = residentBytes();
+            Blockchain node;
+            if (pruned)
+            {
+                node.setPruning(Blockchain::MIN_PRUNE_BLOCKS, 0);
+            }
+            auto start = chrono::steady_clock::now();
+            for (size_t i = 1; i < blocks.size(); i++)
+            {
+                node.acceptBlock(*blocks[i]);
+            }
+            values[0] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            values[1] = (double)residentBytes() - (double)before;
+            auto snap = node.snapshot();
+            values[2] = (double)snap->block_bytes;
+            values[3] = (double)snap->blocks.size();
+            ssize_t written = write(fds[1], values, sizeof(values));
+            _exit(written == (ssize_t)sizeof(values) ? 0 : 1);
+        }
+        close(fds[1]);
+        bool ok = pid > 0 && read(fds[0], values, sizeof(values)) == (ssize_t)sizeof(values);
+        close(fds[0]);
+        if (pid > 0)
+        {
+            waitpid(pid, nullptr, 0);
+        }
+        if (!ok)
+        {
+            cerr << "[BENCH] " << name << " failed" << endl;
+            continue;
+        }
+
+        Result result;
+        result.name = name;
+        result.iterations = blocks.size() - 1;
+        result.seconds = values[0];
+        result.extra.push_back({"rss_growth_bytes", values[1]});
+        result.extra.push_back({"block_bytes", values[2]});
+        result.extra.push_back({"blocks_held", values[3]});
+        results.push_back(move(result));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (!parseArgs(argc, argv))
+    {
+        cerr << "Usage: " << argv[0] << " [--blocks N] [--txs N] [--wallets N] [--scheme ed25519|rsa]"
+             << " [--iterations N] [--mempool-txs N] [--threads N] [--long-blocks N] [--filter substring[,substring...]]" << endl;
+        return 1;
+    }
+
+    benchHashing();
+    benchMetrics();
+    benchMempool();
+    benchFraming();
+
+    Fixture fx;
+    buildFixture(fx);
+    benchSignatures(fx);
+    benchPow(fx);
+    benchCodec(fx);
+    benchCompact(fx);
+    benchMerkle(fx);
+    benchChainReads(fx);
+    benchValidation(fx);
+    benchStore(fx);
+    benchConcurrency(fx);
+    benchPruning(fx);
+
+    printJson();
+    return withinAllocationLimits() ? 0 : 1;
+}
@@ -1,16 +1,148 @@
 #include "blockchain.h"
+#include "codec.h"
+#include "blockstore.h"
+#include "mempool.h"
+#include "compact.h"
+#include "metrics.h"
+#include "rollingset.h"
 #include <iostream>
 #include <sstream> 
+#include <iomanip>
+#include <limits>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <climits>
+#include <algorithm>
+#include <unordered_set>
+#include <array>
+#include <fstream>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
 /*Transaction*/
-string Transaction::calculate_Hash() const
+Hash256 Transaction::calculate_Hash() const
 {
-    return Crypto::sha256(sending_address + receiving_address +
+    return Crypto::sha256Hash(sending_address + receiving_address +
          to_string(amount) + to_string(timestamp));
 }
 
+// The address funds are taken from. Senders sign with their public key, and
+// a wallet's address is the hash of that key, so that's what gets debited.
+string Transaction::senderAddress() const
+{
+    if (sending_address == "0")
+    {
+        return "0";
+    }
+    return Crypto::sha256(sending_address);
+}
+
+/* Signature result cache
+   A transaction's signature is checked when it enters the mempool, again
+   when the block holding it arrives, and again on every full chain
+   validation. Signatures that verified once are remembered by
+   SHA-256(transaction hash | signature), so the later checks are a lookup.
+   Only successes are kept; failures cost nothing to make, and caching
+   them would let anyone flush out the good entries.
+
+   The keys are split over SHARDS independently locked RollingHashSets by
+   their first byte, so the validateChain workers (and the ingest
+   verifiers) hitting the cache at once rarely wait on each other. A hit
+   in a shard's older generation is moved into its current one, so
+   entries still in use survive the next swap.
+*/
+namespace
+{
+    class SignatureCache
+    {
+    public:
+        static const size_t SHARDS = 16;
+
+        SignatureCache()
+        {
+            setCapacity(200000);
+        }
+
+        bool contains(const Hash256& key)
+        {
+            Shard& shard = shardFor(key);
+            lock_guard<mutex> guard(shard.lock);
+            if (!shard.entries.contains(key))
+            {
+                misses.fetch_add(1, memory_order_relaxed);
+                return false;
+            }
+            shard.entries.insert(key);
+            hits.fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+
+        void insert(const Hash256& key)
+        {
+            Shard& shard = shardFor(key);
+            lock_guard<mutex> guard(shard.lock);
+            shard.entries.insert(key);
+        }
+
+        SignatureCacheStats stats()
+        {
+            SignatureCacheStats result;
+            result.hits = hits;
+            result.misses = misses;
+            result.capacity = capacity;
+            for (auto& shard : shards)
+            {
+                lock_guard<mutex> guard(shard.lock);
+                result.size += shard.entries.size();
+            }
+            return result;
+        }
+
+        // Each shard keeps two generations of capacity/(2*SHARDS)
+        void setCapacity(size_t new_capacity)
+        {
+            capacity = new_capacity;
+            size_t generation = capacity == 0 ? 0 : max<size_t>(1, capacity / (2 * SHARDS));
+            for (auto& shard : shards)
+            {
+                lock_guard<mutex> guard(shard.lock);
+                shard.entries.reset(generation);
+            }
+        }
+
+    private:
+        struct Shard
+        {
+            mutex lock;
+            RollingHashSet entries{0};
+        };
+
+        // The keys are SHA-256 digests, so any byte spreads them evenly
+        Shard& shardFor(const Hash256& key)
+        {
+            return shards[key.data()[0] % SHARDS];
+        }
+
+        array<Shard, SHARDS> shards;
+        atomic<size_t> capacity{0};
+        atomic<uint64_t> hits{0};
+        atomic<uint64_t> misses{0};
+    };
+
+    SignatureCache& signatureCache()
+    {
+        static SignatureCache cache;
+        return cache;
+    }
+}
+
 // A transaction is only valid if its signature can be 
 // verified with the sender's [public key].
 bool Transaction::isValid() const
@@ -25,8 +157,37 @@ bool Transaction::isValid() const
         return false;
     }
 
-    // Verifying the signature against the transaction's hash
-    return Wallet::verify(sending_address, this->calculate_Hash(), signature);
+    // Verifying the signature against the transaction's hash, unless this
+    // exact hash and signature already passed
+    Hash256 hash = calculate_Hash();
+    string entry(hash.view());
+    entry += signature;
+    Hash256 key = Crypto::sha256Hash(entry);
+    if (signatureCache().contains(key))
+    {
+        return true;
+    }
+    bool verified;
+    {
+        Metrics::Timer timer(Metrics::signature_verify);
+        verified = Wallet::verify(sending_address, hash.view(), signature);
+    }
+    if (!verified)
+    {
+        return false;
+    }
+    signatureCache().insert(key);
+    return true;
+}
+
+SignatureCacheStats Transaction::signatureCacheStats()
+{
+    return signatureCache().stats();
+}
+
+void Transaction::setSignatureCacheCapacity(size_t capacity)
+{
+    signatureCache().setCapacity(capacity);
 }
 
 
@@ -34,7 +195,8 @@ bool Transaction::isValid() const
 string Transaction::serializer() const
 {
     stringstream ss;
-    ss << id << "," << sending_address << "," << receiving_address 
+    ss << setprecision(numeric_limits<double>::max_digits10);
+    ss << id.toHex() << "," << sending_address << "," << receiving_address 
     << "," << amount << "," << timestamp << "," << signature;
     return ss.str();
 }
@@ -45,7 +207,8 @@ Transaction Transaction::deserializer(const string& data)
     stringstream ss(data);
     string item;
     Transaction tx;
-    getline(ss, tx.id, ',');
+    getline(ss, item, ',');
+    tx.id = Hash256::fromHex(item);
     getline(ss, tx.sending_address, ',');
     getline(ss, tx.receiving_address, ',');
     getline(ss, item, ',');
@@ -56,50 +219,256 @@ Transaction Transaction::deserializer(const string& data)
     return tx;
 }
 
+/*Mining stats*/
+
+uint64_t MiningStats::totalHashes() const
+{
+    uint64_t total = 0;
+    for (uint64_t h : hashes_per_thread)
+    {
+        total += h;
+    }
+    return total;
+}
+
+double MiningStats::hashRate(unsigned thread) const
+{
+    if (thread >= hashes_per_thread.size() || seconds <= 0.0)
+    {
+        return 0.0;
+    }
+    return hashes_per_thread[thread] / seconds;
+}
+
+double MiningStats::totalHashRate() const
+{
+    return seconds > 0.0 ? totalHashes() / seconds : 0.0;
+}
+
 /*Block Implementation*/
 
-Block::Block(int index, time_t timestamp, vector<Transaction> transactions, string previous_hash) 
-: timestamp(timestamp), transactions(transactions), previous_hash(previous_hash), nonce(0)
+static Merkle::Hash transactionRoot(const vector<Transaction>& transactions)
+{
+    Merkle::Tree tree;
+    for (const auto& tx : transactions)
+    {
+        tree.appendTransaction(tx.id);
+    }
+    return tree.root();
+}
+
+Block::Block(int index, time_t timestamp, vector<Transaction> transactions, const Hash256& previous_hash) 
+: index(index), timestamp(timestamp), transactions(move(transactions)), previous_hash(previous_hash), nonce(0),
+  merkle_root(transactionRoot(this->transactions))
 {
     hash = calculateHash(); 
 }
 
+Block::Block(int index, time_t timestamp, vector<Transaction> transactions, const Hash256& previous_hash,
+             uint64_t nonce, const Hash256& hash)
+: index(index), timestamp(timestamp), transactions(move(transactions)), previous_hash(previous_hash),
+  hash(hash), nonce(nonce), merkle_root(transactionRoot(this->transactions))
+{
+}
+
+Block::Block(int index, time_t timestamp, vector<Transaction> transactions, const Hash256& previous_hash,
+             const Merkle::Hash& merkle_root)
+: index(index), timestamp(timestamp), transactions(move(transactions)), previous_hash(previous_hash),
+  nonce(0), merkle_root(merkle_root)
+{
+    hash = calculateHash();
+}
+
+Block::Block(int index, time_t timestamp, const Hash256& previous_hash, uint64_t nonce, const Hash256& hash,
+             const Merkle::Hash& merkle_root, size_t transaction_count, size_t footprint,
+             function<vector<Transaction>()> load)
+: index(index), timestamp(timestamp), previous_hash(previous_hash), hash(hash), nonce(nonce),
+  merkle_root(merkle_root), stored(make_shared<StoredTransactions>())
+{
+    stored->count = transaction_count;
+    stored->footprint = footprint;
+    stored->load = move(load);
+}
+
+const vector<Transaction>& Block::storedTransactions() const
+{
+    call_once(stored->loaded, [this]()
+    {
+        stored->transactions = stored->load();
+        stored->load = nullptr;
+    });
+    return stored->transactions;
+}
+
+size_t Block::footprint() const
+{
+    if (stored)
+    {
+        return stored->footprint;
+    }
+    size_t bytes = sizeof(Block);
+    for (const auto& tx : transactions)
+    {
+        bytes += sizeof(Transaction) + Mempool::transactionSize(tx);
+    }
+    return bytes;
+}
+
+bool Block::merkleProof(const Hash256& tx_id, Merkle::Proof& proof) const
+{
+    const vector<Transaction>& txs = getTransactions();
+    vector<Merkle::Hash> leaves;
+    leaves.reserve(txs.size());
+    size_t found = txs.size();
+    for (size_t i = 0; i < txs.size(); i++)
+    {
+        if (found == txs.size() && txs[i].id == tx_id)
+        {
+            found = i;
+        }
+        leaves.push_back(Merkle::leafHash(txs[i].id));
+    }
+    return Merkle::buildProof(leaves, found, proof);
+}
+
+void BlockTemplate::addTransaction(const Transaction& tx)
+{
+    transactions.push_back(tx);
+    tree.appendTransaction(tx.id);
+}
+
+Block BlockTemplate::build(time_t timestamp)
+{
+    Merkle::Hash root = tree.root();
+    tree = Merkle::Tree();
+    return Block(index, timestamp, move(transactions), previous_hash, root);
+}
+
+static void putInt64(unsigned char* out, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+// Laying the block out as the fixed binary header the PoW kernel hashes.
+// The transactions are committed to through one hash of all their ids.
+PoW::Header Block::buildHeader() const
+{
+    PoW::Header header;
+    putInt64(header.bytes, (uint64_t)(int64_t)index);
+    putInt64(header.bytes + 8, (uint64_t)(int64_t)timestamp);
+    memcpy(header.bytes + 16, previous_hash.data(), Crypto::HASH_SIZE);
+    memcpy(header.bytes + 48, merkle_root.data(), Crypto::HASH_SIZE);
+    header.setNonce(nonce);
+    return header;
+}
+
 // The block's hashed info is all of the data from this 
 // a block and previous blocks. This is what forms the 
 // blockchain as it's a hash of all linked blocks [blockchain]
-string Block::calculateHash() const
+Hash256 Block::calculateHash() const
 {
-    string tx_hashes;
-    for (const auto& tx : transactions) 
-    {
-        tx_hashes += tx.id;
-    }
-    return Crypto::sha256(to_string(index) + previous_hash + to_string(timestamp) 
-    + tx_hashes + to_string(nonce));
+    PoW::Header header = buildHeader();
+    Hash256 digest;
+    Crypto::sha256Raw(header.bytes, PoW::HEADER_SIZE, digest.data());
+    return digest;
 }
 
 // Proof of Work (Mining) algorithm
-void Block::mineBlock(int difficulty) 
+// The nonce space is handed out in batches to every worker thread. The first
+// worker to hit the target raises the [found] flag and the others stop at
+// their next check. All workers share one PoW kernel, so the header is only
+// laid out and midstate-hashed once per run.
+MiningStats Block::mineBlock(int difficulty, unsigned thread_count) 
 {
-    // Starting the hash with a string of zeros
-    string target(difficulty, '0');
-    // Recalcuting the hash until it meets the target
-    while (hash.substr(0, difficulty) != target) 
+    if (thread_count == 0)
+    {
+        thread_count = max(1u, thread::hardware_concurrency());
+    }
+
+    const PoW::Kernel kernel(buildHeader());
+    const uint64_t batch_size = 1 << 16;
+
+    MiningStats stats;
+    stats.threads = thread_count;
+    stats.hashes_per_thread.assign(thread_count, 0);
+
+    atomic<uint64_t> next_nonce(0);
+    atomic<bool> found(false);
+    uint64_t winning_nonce = 0;
+    unsigned char winning_hash[Crypto::HASH_SIZE];
+
+    auto worker = [&](unsigned id)
     {
-        nonce++;
-        hash = calculateHash();
+        uint64_t hashes = 0;
+        uint64_t candidate_nonce;
+        unsigned char candidate_hash[Crypto::HASH_SIZE];
+        while (!found.load(memory_order_relaxed))
+        {
+            uint64_t start = next_nonce.fetch_add(batch_size, memory_order_relaxed);
+            uint64_t tried = 0;
+            bool hit = kernel.search(start, batch_size, difficulty, found, candidate_nonce, candidate_hash, tried);
+            hashes += tried;
+            if (hit)
+            {
+                bool expected = false;
+                if (found.compare_exchange_strong(expected, true))
+                {
+                    winning_nonce = candidate_nonce;
+                    memcpy(winning_hash, candidate_hash, Crypto::HASH_SIZE);
+                }
+                break;
+            }
+        }
+        stats.hashes_per_thread[id] = hashes;
+    };
+
+    auto started = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (unsigned i = 1; i < thread_count; i++)
+    {
+        workers.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto& t : workers)
+    {
+        t.join();
     }
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+    nonce = winning_nonce;
+    hash = Hash256::fromBytes(winning_hash);
+
     cout << "Block mined: " << hash << endl;
+    for (unsigned i = 0; i < thread_count; i++)
+    {
+        cout << "  [MINER] thread " << i << ": " << stats.hashes_per_thread[i] << " hashes, "
+        << (uint64_t)stats.hashRate(i) << " H/s" << endl;
+    }
+    cout << "  [MINER] total: " << (uint64_t)stats.totalHashRate() << " H/s on " 
+    << thread_count << " thread(s) in " << stats.seconds << "s" << endl;
+    return stats;
 }
 
 // Validating all transactions within the Block
 bool Block::isValidTransaction() const
 {
-    for(const auto& tx : transactions)
+    return isValidTransaction(0, transactionCount());
+}
+
+// Validating the transactions in [first, last), so one block's signatures
+// can be split between validation workers
+bool Block::isValidTransaction(size_t first, size_t last) const
+{
+    const vector<Transaction>& txs = getTransactions();
+    last = min(last, txs.size());
+    for (size_t i = first; i < last; i++)
     {
-        if (!tx.isValid()) 
+        if (!txs[i].isValid()) 
         {
-            cout << "Invalid transaction: " << tx.id << endl;
+            cout << "Invalid transaction: " << txs[i].id << endl;
             return false;
         }
     }
@@ -110,10 +479,11 @@ bool Block::isValidTransaction() const
 // Converting a block to a string to be sent over network
  string Block::serialize() const
  {
+    const vector<Transaction>& txs = getTransactions();
     stringstream ss;
     ss << index << "|" << timestamp << "|" << previous_hash << "|" << nonce << "|"
-     << hash << "|" << transactions.size() << "|";
-    for (const auto& tx : transactions)
+     << hash << "|" << txs.size() << "|";
+    for (const auto& tx : txs)
     {
         ss << tx.serializer() << ";";
     }
@@ -132,11 +502,11 @@ bool Block::isValidTransaction() const
     getline(ss, item, '|'); 
     time_t timestamp = stoll(item);
     getline(ss, item, '|'); 
-    string prev_hash = item;
+    Hash256 prev_hash = Hash256::fromHex(item);
     getline(ss, item, '|');
-    int nonce_i = stoi(item);
+    uint64_t nonce_i = stoull(item);
     getline(ss, item, '|');
-    string hash_i = item;
+    Hash256 hash_i = Hash256::fromHex(item);
     getline(ss, item, '|');
     int tx_count = stoi(item);
 
@@ -147,28 +517,50 @@ bool Block::isValidTransaction() const
         transactions.push_back(Transaction::deserializer(item));
     }
 
-    Block block(index, timestamp, transactions, prev_hash);
-    block.nonce =  nonce_i;
-    block.hash = hash_i;
-    return block;
+    return Block(index, timestamp, move(transactions), prev_hash, nonce_i, hash_i);
  }
 
 
 /* Blockchain Implementation*/
 
+double ChainSnapshot::balance(const string& address) const
+{
+    const double* found = balances.find(address);
+    return found ? *found : 0.0;
+}
+
+shared_ptr<const ChainSnapshot> Blockchain::snapshot() const
+{
+    return atomic_load(&current);
+}
 
+// Handing readers a fresh view of the chain once a change is complete.
+// The snapshot shares the blocks and balances with [chain] and [balances]
+// rather than copying them. Called with [write_mutex] held.
+void Blockchain::publish()
+{
+    auto snap = make_shared<ChainSnapshot>();
+    snap->blocks = chain.share();
+    snap->base = base_height;
+    snap->balances = balances.share();
+    snap->work = chain_work.back();
+    snap->side_blocks = side_blocks.size();
+    snap->block_bytes = chain_bytes;
+    atomic_store(&current, shared_ptr<const ChainSnapshot>(move(snap)));
+}
 
 //  Serializing the entire blockchain into a single string.
 //  [block_count] | [serialized_block_1] | [serialized_block_2] || ... 
 string Blockchain::block_serialize() const
 {
+    auto snap = snapshot();
     stringstream ss;
 
-    ss << chain.size() << "|";
+    ss << snap->blocks.size() << "|";
 
-    for (const auto& block : chain)
+    for (const auto& block : snap->blocks)
     {
-        ss << block.serialize() << "||";
+        ss << block->serialize() << "||";
     }
 
     return ss.str();
@@ -188,170 +580,1384 @@ void Blockchain::deserialize(const string& data)
         chain_size = stoi(item);
     }
 
-    vector<Block> new_chain;
+    BlockList new_chain;
 
     for (int i = 0; i < chain_size; i++)
     {
         getline(ss, item, '|');
         getline(ss, item, '|');
 
-        new_chain.push_back(Block::deserialize(item));
+        new_chain.push_back(make_shared<const Block>(Block::deserialize(item)));
     }
 
-    this->chain = new_chain;
+    lock_guard<mutex> lock(write_mutex);
+    replaceChain(move(new_chain));
 }
 
-// Creating the first block in the chain by using the constructor 
-// "Genesis Block"
-Blockchain::Blockchain() : difficulty(4), mining_reward(100.0)
+string Blockchain::encode() const
 {
-    vector<Transaction> genesis_txs;
-    chain.emplace_back(0, time(nullptr), genesis_txs, "0");
+    string out;
+    Codec::encodeChain(snapshot()->blocks, out);
+    return out;
 }
 
-Block Blockchain::getLatestBlock() const
+// Rebuilding the chain from its binary form. The current chain is
+// left alone if the data is malformed.
+bool Blockchain::decode(string_view data)
 {
-    return chain.back();
-}
+    Codec::ChainView view;
+    if (!Codec::decodeChain(data, view))
+    {
+        return false;
+    }
+
+    BlockList new_chain;
+    Codec::BlockCursor cursor = view.blocks();
+    Codec::BlockView block;
+    while (cursor.next(block))
+    {
+        new_chain.push_back(make_shared<const Block>(block.toBlock()));
+    }
+    if (new_chain.size() != view.block_count || new_chain.empty())
+    {
+        return false;
+    }
 
+    lock_guard<mutex> lock(write_mutex);
+    replaceChain(move(new_chain));
+    return true;
+}
 
-// Getter method for grabbing the chain
-vector<Block> Blockchain::getChain() const
+// Swapping in a whole new chain (loading, not syncing). Called with
+// [write_mutex] held.
+void Blockchain::replaceChain(BlockList new_chain)
 {
-    return chain;
+    clearBase();
+    chain = move(new_chain);
+    rebuildBalances();
+    rewriteStore();
+    publish();
 }
 
-// Adding a pre-mined block to the chain. This will be used
-// when adding a block from the network.
+// Creating the first block in the chain by using the constructor 
+// "Genesis Block". The timestamp is fixed so every node starts from the
+// same block and range sync always has a common ancestor.
+static const time_t GENESIS_TIMESTAMP = 1700000000;
 
-/* Whats happening is a race condition. Both systems that are mining the
-   block aren't adopting the same block. 
+Blockchain::Blockchain()
+: mempool(make_unique<Mempool>()), difficulty(4), mining_reward(100.0), mining_threads(0), validation_threads(0)
+{
+    chain.push_back(make_shared<const Block>(0, GENESIS_TIMESTAMP, vector<Transaction>(), Hash256()));
+    applyBlock(*chain.back());
+    publish();
+}
 
-   In order to fix you would need to just update to the longest block.
-*/
-void Blockchain::addBlock(const Block& new_block)
+// Checkpointing the tip on the way out, so the next start has nothing to replay
+Blockchain::~Blockchain()
 {
-    if(new_block.getPreviousHash() != getLatestBlock().getHash())
-    {
-        throw runtime_error("Cannot add block: Previous hash doesn't match.");
-    }
-    else
+    lock_guard<mutex> lock(write_mutex);
+    if (tip_saved_height != base_height + chain.size() - 1)
     {
-        throw runtime_error("Cannot add block: Invalid block index.");
+        saveTip();
     }
-    chain.push_back(new_block);
 }
 
-/* Creating a new block with all pending transactions and then will mine it*/
-void Blockchain::minePendingTransaction(const string& miner_address)
+static void addToBalances(BalanceMap& balances, const Block& block, double sign)
 {
-    //Creating the reward transaction for the miner of the block
-    Transaction reward_tx;
-    reward_tx.sending_address = "0"; // system generated reward
-    reward_tx.receiving_address = miner_address;
-    reward_tx.amount = mining_reward;
-    reward_tx.id = reward_tx.calculate_Hash();
-    pending_transactions.push_back(reward_tx);
-
-    //Creating a newer block to mine
-    int new_index = getLatestBlock().getIndex() + 1;
-    Block new_block(new_index, time(nullptr), pending_transactions, getLatestBlock().getHash());
-    new_block.mineBlock(difficulty);
-    chain.push_back(new_block);
-
-    //Clearing each pending transaction
-    pending_transactions.clear();
+    for (const auto& tx : block.getTransactions())
+    {
+        balances[tx.receiving_address] += sign * tx.amount;
+        if (tx.sending_address != "0")
+        {
+            balances[tx.senderAddress()] -= sign * tx.amount;
+        }
+    }
 }
 
-
-// Validating a transaction before adding it the pending pool
-void Blockchain::addTransaction(const Transaction& tx)
+// Writing to a temporary file first, so a crash never leaves half a file.
+// The data is synced before the rename and the directory after it, so
+// after a power cut the file is either the old one or the whole new one.
+static bool writeFileAtomically(const string& path, const string& data)
 {
-    if (tx.sending_address.empty() || tx.receiving_address.empty())
+    string temp_path = path + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
     {
-        throw runtime_error("Transaction must include sender and receiver address.");
+        return false;
     }
-    if (!tx.isValid())
+    bool written = write(fd, data.data(), data.size()) == (ssize_t)data.size() && fsync(fd) == 0;
+    ::close(fd);
+    if (!written || rename(temp_path.c_str(), path.c_str()) != 0)
     {
-        throw runtime_error("Cannot add invalid transaction to chain.");
+        return false;
     }
-    if (tx.amount < 0 && !hasSufficientFunds(tx.sending_address, tx.amount))
+
+    size_t slash = path.rfind('/');
+    string directory = slash == string::npos ? "." : path.substr(0, max<size_t>(slash, 1));
+    int dir_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0)
     {
-        throw runtime_error("Insufficient funds for transaction.");
+        return false;
     }
-    pending_transactions.push_back(tx);
+    bool synced = fsync(dir_fd) == 0;
+    ::close(dir_fd);
+    return synced;
 }
 
-// Calculating a wallet's balance by summing up all transactions within each block
-double Blockchain::getBalance(const string& address)
+// Kept beside the block store when the chain starts at a state snapshot
+static const char* STATE_FILE = "state.dat";
+// The balances at our tip (same format), so reopening the store doesn't
+// replay the chain. Rewritten every TIP_INTERVAL blocks and on shutdown;
+// after a crash only the blocks since the last one are replayed.
+static const char* TIP_FILE = "tip.dat";
+static const size_t TIP_INTERVAL = 256;
+
+// A block reopened from the store: just the header from its index record,
+// with the transactions read from its segment the first time they're needed
+static shared_ptr<const Block> storedBlock(const BlockStore::Entry& entry, const shared_ptr<const string>& directory)
 {
-    if (address.empty())
+    BlockStore::Location location = entry.location;
+    Hash256 hash = entry.hash;
+    auto load = [directory, location, hash]()
     {
-        return 0.0;
+        string data;
+        Codec::BlockView view;
+        if (!BlockStore::readBlock(*directory, location, data) || !Codec::decodeBlock(data, view) || view.hash != hash)
+        {
+            throw runtime_error("Block " + hash.toHex() + " is no longer in the block store");
+        }
+        vector<Transaction> txs;
+        txs.reserve(view.tx_count);
+        Codec::TransactionCursor cursor = view.transactions();
+        Codec::TransactionView tx;
+        while (cursor.next(tx))
+        {
+            txs.push_back(tx.toTransaction());
+        }
+        return txs;
+    };
+    return make_shared<const Block>((int)entry.index, (time_t)entry.timestamp, entry.previous_hash, entry.nonce,
+                                    entry.hash, entry.merkle_root, entry.tx_count, (size_t)entry.footprint, move(load));
+}
+
+bool Blockchain::openStore(const string& directory)
+{
+    auto opened = make_unique<BlockStore>();
+    if (!opened->open(directory))
+    {
+        return false;
     }
 
-    double balance = 0.0;
-    for (const auto& block : chain)
+    lock_guard<mutex> lock(write_mutex);
+    store_directory = directory;
+    string state_data;
+    Codec::ChainStateView state;
+    bool has_state = readStateFile(directory + "/" + STATE_FILE, state_data, state);
+    if (opened->height() == 0 && !has_state)
     {
-        for (const auto& tx : block.getTransactions())
         {
-            if (tx.receiving_address == address)
-            {
-                balance += tx.amount;
-            }
+            lock_guard<mutex> store_lock(store_mutex);
+            store = move(opened);
+        }
+        rewriteStore();
+        return true;
+    }
 
-            if (tx.sending_address == address)
+    // A chain from a state snapshot, or a pruned one, starts at the state
+    // file's block. The state file is written before the store, so after
+    // a crash the store may not have caught up with it yet.
+    long first = has_state ? opened->findHeight(state.tip.hash) : (long)opened->firstHeight();
+
+    // Only the index is read: every block comes back as its header, and
+    // the segments are left alone until something needs its transactions.
+    // These blocks were checked before they were stored, so they aren't
+    // re-validated.
+    vector<shared_ptr<const Block>> loaded;
+    if (first >= 0)
+    {
+        auto source = make_shared<const string>(directory);
+        loaded.reserve(opened->height() - first);
+        for (size_t h = first; h < opened->height(); h++)
+        {
+            BlockStore::Entry entry;
+            if (!opened->entry(h, entry) || (!loaded.empty() && entry.previous_hash != loaded.back()->getHash()))
             {
-                balance -= tx.amount;
+                cerr << "[STORE] Block " << h << " is unreadable; keeping the first " << h << " blocks" << endl;
+                opened->truncate(h);
+                break;
             }
+            loaded.push_back(storedBlock(entry, source));
         }
     }
 
-    return balance;
-}
-
-bool Blockchain::hasSufficientFunds(const string & sending_address, double amount)
-{
-    return getBalance(sending_address) >= amount;
-}
-
-// Verifying the integrity of the chain
-bool Blockchain::isChainValid()
-{
-    for (size_t i = 1; i < chain.size(); i++)
+    bool rewrite = false;
+    if (has_state && loaded.empty())
     {
-        const Block& current_block = chain[i];
-        const Block& previous_block = chain[i - 1];
-
-       if (!current_block.isValidTransaction())
-       {
-        return false;
-       } 
-
-       if (current_block.getHash() != current_block.calculateHash())
-       {
-        return false;
-       }
+        loaded.assign(1, make_shared<const Block>(state.tip.toBlock()));
+        rewrite = true;
+    }
+    else if (!has_state && !loaded.empty() && loaded[0]->getIndex() != 0)
+    {
+        cerr << "[STORE] The block store starts at height " << loaded[0]->getIndex()
+             << " but its state file is missing; starting again from genesis" << endl;
+        loaded.clear();
+        rewrite = true;
+    }
+    {
+        lock_guard<mutex> store_lock(store_mutex);
+        store = move(opened);
+    }
+    if (loaded.empty())
+    {
+        rewriteStore();
+        return true;
+    }
 
-       if (current_block.getPreviousHash() != previous_block.getHash())
-       {
-        return false;
-       }
-       if (current_block.getIndex() != previous_block.getIndex() + 1)
-       {
-        return false;
-       }
+    if (has_state)
+    {
+        setBase(state);
+    }
+    chain = BlockList(loaded.begin(), loaded.end());
+    string tip_data;
+    Codec::ChainStateView tip_state;
+    bool has_tip = readStateFile(directory + "/" + TIP_FILE, tip_data, tip_state);
+    rebuildBalances(has_tip ? &tip_state : nullptr);
+    if (has_tip && tip_state.tip.hash == chain.back()->getHash())
+    {
+        tip_saved_height = base_height + chain.size() - 1;
+    }
+    if (rewrite)
+    {
+        rewriteStore();
+    }
+    else
+    {
+        lock_guard<mutex> store_lock(store_mutex);
+        stored_from = base_height - first;
+    }
+    pruneChain();
+    if (tip_saved_height != base_height + chain.size() - 1)
+    {
+        saveTip();
     }
+    publish();
     return true;
 }
 
-
-// If a peer sends a longer or valid chain then adopt it
-void Blockchain::replaceChain(const vector<Block>& new_chain)
+// Checkpointing the balances at our tip. The store is flushed first, so
+// the file never refers to a block that a crash could still take back.
+// Called with [write_mutex] held.
+void Blockchain::saveTip()
 {
-    if (new_chain.size() > chain.size())
+    if (store_directory.empty())
     {
-        cout << "Longer chain detected. Replacing current chain" << endl;
-        chain = new_chain;
+        return;
     }
-}
\ No newline at end of file
+    {
+        lock_guard<mutex> lock(store_mutex);
+        if (!store || !store->flush())
+        {
+            return;
+        }
+    }
+    string data;
+    Codec::encodeChainState(*chain.back(), chain_work.back(), balances, data);
+    if (!writeFileAtomically(store_directory + "/" + TIP_FILE, data))
+    {
+        cerr << "[STORE] Failed to write " << TIP_FILE << endl;
+        return;
+    }
+    tip_saved_height = base_height + chain.size() - 1;
+}
+
+// Reading and checking a state file. [state] points into [data].
+bool Blockchain::readStateFile(const string& path, string& data, Codec::ChainStateView& state) const
+{
+    ifstream in(path, ios::binary);
+    if (!in)
+    {
+        return false;
+    }
+    data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    if (!Codec::decodeChainState(data, state))
+    {
+        cerr << "[STORE] " << path << " isn't a readable state snapshot" << endl;
+        return false;
+    }
+    Block tip = state.tip.toBlock();
+    if (tip.calculateHash() != tip.getHash() || !PoW::meetsTarget(tip.getHash().data(), difficulty))
+    {
+        cerr << "[STORE] " << path << " holds an invalid block" << endl;
+        return false;
+    }
+    return true;
+}
+
+void Blockchain::setBase(const Codec::ChainStateView& state)
+{
+    base_height = (size_t)state.tip.index;
+    base_work = state.work;
+    base_balances.clear();
+    for (const auto& entry : state.balances)
+    {
+        base_balances[string(entry.first)] = entry.second;
+    }
+}
+
+// Back to a chain that starts at genesis
+void Blockchain::clearBase()
+{
+    if (base_height > 0 && !store_directory.empty())
+    {
+        remove((store_directory + "/" + STATE_FILE).c_str());
+    }
+    base_height = 0;
+    base_work = 0;
+    base_balances.clear();
+}
+
+bool Blockchain::saveState(const string& path) const
+{
+    auto snap = snapshot();
+    string data;
+    Codec::encodeChainState(snap->tip(), snap->work, snap->balances, data);
+    if (!writeFileAtomically(path, data))
+    {
+        cerr << "[STORE] Failed to write " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+bool Blockchain::loadState(const string& path)
+{
+    string data;
+    Codec::ChainStateView state;
+    if (!readStateFile(path, data, state))
+    {
+        return false;
+    }
+
+    lock_guard<mutex> lock(write_mutex);
+    size_t our_height = base_height + chain.size() - 1;
+    if ((size_t)state.tip.index <= our_height)
+    {
+        cerr << "[STORE] The state snapshot is at height " << state.tip.index
+             << ", not ahead of our chain at " << our_height << "; not loaded" << endl;
+        return false;
+    }
+    if (!store_directory.empty() && !writeFileAtomically(store_directory + "/" + STATE_FILE, data))
+    {
+        cerr << "[STORE] Failed to copy the state snapshot into " << store_directory << endl;
+        return false;
+    }
+
+    setBase(state);
+    chain.clear();
+    chain.push_back(make_shared<const Block>(state.tip.toBlock()));
+    rebuildBalances();
+    {
+        // Checked against balances we no longer have
+        lock_guard<mutex> mempool_lock(mempool_mutex);
+        mempool->clear();
+    }
+    rewriteStore();
+    pruneChain();
+    publish();
+    return true;
+}
+
+void Blockchain::setPruning(size_t keep_blocks, size_t keep_bytes)
+{
+    lock_guard<mutex> lock(write_mutex);
+    prune_blocks = keep_blocks == 0 || keep_blocks > MIN_PRUNE_BLOCKS ? keep_blocks : MIN_PRUNE_BLOCKS;
+    prune_bytes = keep_bytes;
+    pruneChain();
+    publish();
+}
+
+// Pruning in batches, so the state file isn't rewritten for every block
+static const size_t PRUNE_BATCH = 16;
+
+// Folding the oldest blocks into the base once the chain is past the
+// pruning limits. Called with [write_mutex] held.
+void Blockchain::pruneChain()
+{
+    if (prune_blocks == 0 && prune_bytes == 0)
+    {
+        return;
+    }
+    // The store only deletes whole segments, never the one being written,
+    // so they are sized to a quarter of what we keep: it then holds about
+    // 1.25x that at most, instead of at least one full 128MB segment
+    size_t keep_bytes = prune_bytes;
+    if (prune_blocks > 0)
+    {
+        size_t by_blocks = chain_bytes / chain.size() * prune_blocks;
+        keep_bytes = keep_bytes == 0 ? by_blocks : min(keep_bytes, by_blocks);
+    }
+    {
+        lock_guard<mutex> lock(store_mutex);
+        if (store)
+        {
+            store->setSegmentLimit(keep_bytes / 4);
+        }
+    }
+
+    size_t droppable = chain.size() > MIN_PRUNE_BLOCKS ? chain.size() - MIN_PRUNE_BLOCKS : 0;
+    size_t bytes = chain_bytes;
+    size_t drop = 0;
+    while (drop < droppable && ((prune_blocks > 0 && chain.size() - drop > prune_blocks)
+                                || (prune_bytes > 0 && bytes > prune_bytes)))
+    {
+        bytes -= chain[drop]->footprint();
+        drop++;
+    }
+    if (drop < PRUNE_BATCH)
+    {
+        return;
+    }
+
+    // chain[drop] becomes the base, with the balances right after it
+    for (size_t i = 1; i <= drop; i++)
+    {
+        addToBalances(base_balances, *chain[i], 1.0);
+    }
+    base_work = chain_work[drop];
+    base_height += drop;
+    chain_bytes = bytes;
+    {
+        lock_guard<mutex> lock(index_mutex);
+        for (size_t i = 0; i < drop; i++)
+        {
+            height_by_hash.erase(chain[i]->getHash());
+        }
+    }
+    chain.dropFront(drop);
+    chain_work.erase(chain_work.begin(), chain_work.begin() + drop);
+
+    // Side branches that left the chain below the new base can't come back
+    for (auto it = side_blocks.begin(); it != side_blocks.end();)
+    {
+        Hash256 cursor = it->second.block->getPreviousHash();
+        while (side_blocks.count(cursor))
+        {
+            cursor = side_blocks.at(cursor).block->getPreviousHash();
+        }
+        if (height_by_hash.count(cursor))
+        {
+            ++it;
+        }
+        else
+        {
+            it = side_blocks.erase(it);
+        }
+    }
+
+    if (store_directory.empty())
+    {
+        return;
+    }
+    string data;
+    Codec::encodeChainState(*chain[0], base_work, base_balances, data);
+    if (!writeFileAtomically(store_directory + "/" + STATE_FILE, data))
+    {
+        cerr << "[STORE] Failed to write the state file; not pruning the block store" << endl;
+        return;
+    }
+    lock_guard<mutex> lock(store_mutex);
+    if (store && !store->prune(base_height - stored_from))
+    {
+        cerr << "[STORE] Failed to prune the block store below height " << base_height << endl;
+    }
+}
+
+void Blockchain::setAssumeValid(size_t height, const Hash256& hash)
+{
+    lock_guard<mutex> lock(write_mutex);
+    assume_valid_height = height;
+    assume_valid_hash = hash;
+}
+
+// Writing chain[position..] to the store, replacing whatever it held from
+// [position] on. The store holds [chain] from its base block, plus
+// whatever pruned blocks below it haven't been deleted yet.
+void Blockchain::persistFrom(size_t position)
+{
+    lock_guard<mutex> lock(store_mutex);
+    if (!store)
+    {
+        return;
+    }
+    size_t below = base_height - stored_from;
+    if (store->height() < below)
+    {
+        cerr << "[STORE] The block store is missing blocks below height " << base_height << endl;
+        return;
+    }
+    if (store->height() > below + position && !store->truncate(below + position))
+    {
+        cerr << "[STORE] Failed to rewind the block store to height " << base_height + position << endl;
+        return;
+    }
+    for (size_t i = store->height() - below; i < chain.size(); i++)
+    {
+        if (!store->append(*chain[i]))
+        {
+            cerr << "[STORE] Failed to write block " << base_height + i << endl;
+            return;
+        }
+    }
+}
+
+// Checkpointing the tip every TIP_INTERVAL blocks as the chain grows
+void Blockchain::saveTipEvery()
+{
+    if (base_height + chain.size() - 1 >= tip_saved_height + TIP_INTERVAL)
+    {
+        saveTip();
+    }
+}
+
+void Blockchain::rewriteStore()
+{
+    {
+        lock_guard<mutex> lock(store_mutex);
+        stored_from = base_height;
+    }
+    persistFrom(0);
+}
+
+/* Balance index
+   Every block that joins the chain is applied to [balances] once, and
+   every block that leaves it (on a chain swap) is unapplied, so a lookup
+   never has to walk the chain. Blocks are applied and unapplied at the
+   tip, so [chain_work] is a stack alongside them.
+*/
+void Blockchain::applyBlock(const Block& block)
+{
+    indexBlock(block);
+    addToBalances(balances, block, 1.0);
+}
+
+// Everything applyBlock does but the balances, which only needs the header
+void Blockchain::indexBlock(const Block& block)
+{
+    {
+        lock_guard<mutex> lock(index_mutex);
+        height_by_hash[block.getHash()] = block.getIndex();
+    }
+    chain_work.push_back((chain_work.empty() ? 0 : chain_work.back()) + blockWork());
+    chain_bytes += block.footprint();
+}
+
+void Blockchain::unapplyBlock(const Block& block)
+{
+    {
+        lock_guard<mutex> lock(index_mutex);
+        height_by_hash.erase(block.getHash());
+    }
+    chain_work.pop_back();
+    chain_bytes -= block.footprint();
+    addToBalances(balances, block, -1.0);
+}
+
+// A [checkpoint] holding the balances right after one of the blocks on
+// [chain] saves replaying up to it: those blocks are only indexed, so a
+// chain reopened from the store never has to load their transactions.
+void Blockchain::rebuildBalances(const Codec::ChainStateView* checkpoint)
+{
+    // Only called when the whole chain was swapped out, so side branches
+    // off the old one mean nothing any more
+    balances.clear();
+    {
+        lock_guard<mutex> lock(index_mutex);
+        height_by_hash.clear();
+    }
+    chain_work.clear();
+    chain_bytes = 0;
+    side_blocks.clear();
+    size_t first = 0;
+    if (base_height > 0)
+    {
+        // The base block's own transactions are already in [base_balances]
+        balances = base_balances.share();
+        {
+            lock_guard<mutex> lock(index_mutex);
+            height_by_hash[chain[0]->getHash()] = base_height;
+        }
+        chain_work.push_back(base_work);
+        chain_bytes = chain[0]->footprint();
+        first = 1;
+    }
+
+    size_t replay_from = first;
+    for (size_t i = chain.size(); checkpoint && i-- > first;)
+    {
+        if (chain[i]->getHash() != checkpoint->tip.hash)
+        {
+            continue;
+        }
+        for (size_t j = first; j <= i; j++)
+        {
+            indexBlock(*chain[j]);
+        }
+        if (chain_work.back() == checkpoint->work)
+        {
+            balances.clear();
+            for (const auto& entry : checkpoint->balances)
+            {
+                balances[string(entry.first)] = entry.second;
+            }
+        }
+        else
+        {
+            cerr << "[STORE] The tip checkpoint doesn't match the chain; replaying it" << endl;
+            for (size_t j = first; j <= i; j++)
+            {
+                addToBalances(balances, *chain[j], 1.0);
+            }
+        }
+        replay_from = i + 1;
+        break;
+    }
+    for (size_t i = replay_from; i < chain.size(); i++)
+    {
+        applyBlock(*chain[i]);
+    }
+}
+
+// Dropping pending transactions that a block has already confirmed
+void Blockchain::removePending(const Block& block)
+{
+    lock_guard<mutex> lock(mempool_mutex);
+    mempool->removeConfirmed(block);
+}
+
+// Adding a pre-mined block to the chain. This will be used
+// when adding a block from the network.
+void Blockchain::addBlock(const Block& new_block)
+{
+    lock_guard<mutex> lock(write_mutex);
+    checkBlock(new_block, *chain.back());
+    connectBlock(make_shared<const Block>(new_block));
+    publish();
+}
+
+// Putting a checked block on top of the chain
+void Blockchain::connectBlock(shared_ptr<const Block> block)
+{
+    chain.push_back(move(block));
+    applyBlock(*chain.back());
+    removePending(*chain.back());
+    persistFrom(chain.size() - 1);
+    saveTipEvery();
+    pruneChain();
+}
+
+// Everything about a block that can be checked knowing only its parent
+// A NaN would slip past "amount <= 0" and every funds check after it
+static bool validAmount(double amount)
+{
+    return isfinite(amount) && amount > 0;
+}
+
+void Blockchain::checkBlock(const Block& block, const Block& parent) const
+{
+    Metrics::Timer timer(Metrics::block_check);
+    if (block.getPreviousHash() != parent.getHash())
+    {
+        throw runtime_error("Cannot add block: Previous hash doesn't match.");
+    }
+    if (block.getIndex() != parent.getIndex() + 1)
+    {
+        throw runtime_error("Cannot add block: Invalid block index.");
+    }
+    if (block.getHash() != block.calculateHash())
+    {
+        throw runtime_error("Cannot add block: Hash doesn't match contents.");
+    }
+    if (!PoW::meetsTarget(block.getHash().data(), difficulty))
+    {
+        throw runtime_error("Cannot add block: Hash doesn't meet the difficulty target.");
+    }
+    size_t height = (size_t)block.getIndex();
+    if (!assume_valid_hash.isZero() && height == assume_valid_height && block.getHash() != assume_valid_hash)
+    {
+        throw runtime_error("Cannot add block: Doesn't match the assume-valid block at this height.");
+    }
+    // Amounts come straight off the wire; cheap enough to check even below
+    // the assume-valid block
+    for (const auto& tx : block.getTransactions())
+    {
+        if (!validAmount(tx.amount))
+        {
+            throw runtime_error("Cannot add block: Contains a transaction with an invalid amount.");
+        }
+    }
+    bool assumed_valid = !assume_valid_hash.isZero() && height <= assume_valid_height;
+    if (!assumed_valid && !block.isValidTransaction())
+    {
+        throw runtime_error("Cannot add block: Contains an invalid transaction.");
+    }
+}
+
+// Most a mined block takes from the mempool
+static const size_t MAX_BLOCK_TRANSACTIONS = 4096;
+static const size_t MAX_BLOCK_TX_BYTES = 4 * 1024 * 1024;
+
+/* Creating a new block from the pending transactions and then will mine it.
+   The template is built from a snapshot and the nonce search runs without
+   any lock held, so blocks and transactions from peers keep flowing in
+   while we mine.
+*/
+Blockchain::AcceptResult Blockchain::minePendingTransaction(const string& miner_address)
+{
+    //Creating the reward transaction for the miner of the block
+    Transaction reward_tx;
+    reward_tx.sending_address = "0"; // system generated reward
+    reward_tx.receiving_address = miner_address;
+    reward_tx.amount = mining_reward;
+    reward_tx.timestamp = time(nullptr);
+    reward_tx.id = reward_tx.calculate_Hash();
+
+    //Filling the block from the mempool, best paying transactions first.
+    //Whatever doesn't fit stays pending for the next block. The tip and
+    //the mempool are read under the writer lock so the selection was
+    //checked against the very block we build on.
+    vector<Transaction> selected;
+    Hash256 mined_on;
+    int next_index;
+    {
+        lock_guard<mutex> lock(write_mutex);
+        mined_on = chain.back()->getHash();
+        next_index = chain.back()->getIndex() + 1;
+        lock_guard<mutex> pool_lock(mempool_mutex);
+        selected = mempool->select(MAX_BLOCK_TRANSACTIONS - 1, MAX_BLOCK_TX_BYTES);
+    }
+    BlockTemplate block_template(next_index, mined_on);
+    for (const auto& tx : selected)
+    {
+        block_template.addTransaction(tx);
+    }
+    block_template.addTransaction(reward_tx);
+
+    //Creating a newer block to mine
+    auto new_block = make_shared<Block>(block_template.build(time(nullptr)));
+    MiningStats stats = new_block->mineBlock(difficulty, mining_threads);
+    {
+        lock_guard<mutex> lock(stats_mutex);
+        mining_totals.blocks++;
+        mining_totals.hashes += stats.totalHashes();
+        mining_totals.seconds += stats.seconds;
+        last_mining_stats = move(stats);
+    }
+
+    // Every transaction in it came from our own mempool, so the signatures
+    // were checked on the way in. That only holds while the tip is still
+    // the block we mined on; if another block (or a reorg) got there first,
+    // the mempool may have changed under us and the block is checked in full.
+    lock_guard<mutex> lock(write_mutex);
+    bool unchanged = chain.back()->getHash() == mined_on;
+    return acceptLocked(move(new_block), unchanged);
+}
+
+MiningStats Blockchain::getLastMiningStats() const
+{
+    lock_guard<mutex> lock(stats_mutex);
+    return last_mining_stats;
+}
+
+MiningTotals Blockchain::getMiningTotals() const
+{
+    lock_guard<mutex> lock(stats_mutex);
+    return mining_totals;
+}
+
+
+// Validating a transaction before adding it the pending pool.
+// Spends already waiting in the pool count against the sender.
+// The checks that don't depend on chain state (the signature above all)
+// run before the writer lock is taken.
+void Blockchain::addTransaction(const Transaction& tx)
+{
+    verifyTransaction(tx);
+    addVerifiedTransaction(tx);
+}
+
+// Everything that doesn't depend on balances, so it can run on any thread
+void Blockchain::verifyTransaction(const Transaction& tx) const
+{
+    if (tx.sending_address.empty() || tx.receiving_address.empty())
+    {
+        throw runtime_error("Transaction must include sender and receiver address.");
+    }
+    if (!validAmount(tx.amount))
+    {
+        throw runtime_error("Transaction amount must be positive.");
+    }
+    // The id is what peers deduplicate on, so it has to be the real one
+    if (tx.id != tx.calculate_Hash())
+    {
+        throw runtime_error("Transaction id doesn't match its contents.");
+    }
+    {
+        lock_guard<mutex> lock(mempool_mutex);
+        if (mempool->contains(tx.id))
+        {
+            throw runtime_error("Transaction is already pending.");
+        }
+    }
+    if (!tx.isValid())
+    {
+        throw runtime_error("Cannot add invalid transaction to chain.");
+    }
+}
+
+void Blockchain::addVerifiedTransaction(const Transaction& tx)
+{
+    lock_guard<mutex> lock(write_mutex);
+    addTransactionLocked(tx);
+}
+
+void Blockchain::addTransactionLocked(const Transaction& tx)
+{
+    string sender = tx.senderAddress();
+    const double* confirmed = balances.find(sender);
+    double balance = confirmed ? *confirmed : 0.0;
+
+    lock_guard<mutex> lock(mempool_mutex);
+    if (balance < mempool->pendingSpends(sender) + tx.amount)
+    {
+        throw runtime_error("Insufficient funds for transaction.");
+    }
+    switch (mempool->add(tx))
+    {
+        case Mempool::AddResult::Duplicate:
+            throw runtime_error("Transaction is already pending.");
+        case Mempool::AddResult::Full:
+            throw runtime_error("Mempool is full and the transaction pays too little to displace anything.");
+        default:
+            break;
+    }
+}
+
+void Blockchain::setMempoolLimits(size_t max_count, size_t max_bytes)
+{
+    lock_guard<mutex> lock(mempool_mutex);
+    mempool->setLimits(max_count, max_bytes);
+}
+
+MempoolStats Blockchain::mempoolStats() const
+{
+    lock_guard<mutex> lock(mempool_mutex);
+    return mempool->stats();
+}
+
+// Looking a wallet's balance up in the balance index
+double Blockchain::getBalance(const string& address) const
+{
+    return snapshot()->balance(address);
+}
+
+double Blockchain::getPendingSpends(const string& address) const
+{
+    lock_guard<mutex> lock(mempool_mutex);
+    return mempool->pendingSpends(address);
+}
+
+bool Blockchain::hasPendingTransaction(const Hash256& id) const
+{
+    lock_guard<mutex> lock(mempool_mutex);
+    return mempool->contains(id);
+}
+
+void Blockchain::fillFromMempool(Compact::PartialBlock& partial) const
+{
+    lock_guard<mutex> lock(mempool_mutex);
+    mempool->forEach([&](const Transaction& tx) { partial.offer(tx); });
+}
+
+bool Blockchain::findPendingTransaction(const Hash256& id, Transaction& tx) const
+{
+    lock_guard<mutex> lock(mempool_mutex);
+    const Transaction* found = mempool->find(id);
+    if (!found)
+    {
+        return false;
+    }
+    tx = *found;
+    return true;
+}
+
+bool Blockchain::hasSufficientFunds(const string & sending_address, double amount) const
+{
+    return getBalance(sending_address) >= amount;
+}
+
+// Verifying the integrity of the chain
+bool Blockchain::isChainValid()
+{
+    return validateChain().valid;
+}
+
+ValidationResult Blockchain::validateChain(unsigned thread_count) const
+{
+    Metrics::Timer timer(Metrics::chain_validation);
+    auto snap = snapshot();
+    vector<const Block*> blocks;
+    blocks.reserve(snap->blocks.size());
+    for (const auto& block : snap->blocks)
+    {
+        blocks.push_back(block.get());
+    }
+    // Only when this chain holds the assume-valid block itself
+    size_t checked_above = 0;
+    if (!assume_valid_hash.isZero() && assume_valid_height >= snap->base && assume_valid_height <= snap->height()
+        && snap->at(assume_valid_height).getHash() == assume_valid_hash)
+    {
+        checked_above = assume_valid_height;
+    }
+    return validateSequence(blocks, thread_count, checked_above);
+}
+
+/* Parallel chain validation
+   [blocks][0] is trusted and only serves as the parent of [blocks][1], so
+   the same code checks the whole chain or just a branch off a fork point.
+   The blocks are cut into work items of at most [TX_PER_ITEM] transactions.
+   The first item of every block also checks the block's index, linkage and
+   hash. Workers pull items from a shared counter; once a block fails, items
+   from later blocks are skipped, but earlier ones still run so the result
+   always names the lowest invalid block. Signatures are only checked in
+   blocks above height [signatures_checked_above] (see setAssumeValid).
+*/
+ValidationResult Blockchain::validateSequence(const vector<const Block*>& blocks, unsigned thread_count,
+                                              size_t signatures_checked_above) const
+{
+    const size_t TX_PER_ITEM = 64;
+
+    struct WorkItem
+    {
+        size_t block;
+        size_t first_tx;
+        size_t last_tx;
+    };
+
+    vector<WorkItem> items;
+    for (size_t i = 1; i < blocks.size(); i++)
+    {
+        size_t tx_count = blocks[i]->transactionCount();
+        size_t first = 0;
+        do
+        {
+            items.push_back({i, first, first + TX_PER_ITEM});
+            first += TX_PER_ITEM;
+        } while (first < tx_count);
+    }
+
+    if (thread_count == 0)
+    {
+        thread_count = validation_threads;
+    }
+    if (thread_count == 0)
+    {
+        thread_count = max(1u, thread::hardware_concurrency());
+    }
+    thread_count = (unsigned)min<size_t>(thread_count, max<size_t>(1, items.size()));
+
+    atomic<size_t> next_item(0);
+    atomic<long> first_bad(LONG_MAX);
+    mutex result_mutex;
+    ValidationResult result;
+
+    auto fail = [&](size_t block, const string& reason)
+    {
+        lock_guard<mutex> lock(result_mutex);
+        if ((long)block < first_bad.load())
+        {
+            first_bad.store((long)block);
+            result.valid = false;
+            result.first_invalid_block = blocks[block]->getIndex();
+            result.reason = reason;
+        }
+    };
+
+    auto worker = [&]()
+    {
+        while (true)
+        {
+            size_t n = next_item.fetch_add(1);
+            if (n >= items.size())
+            {
+                return;
+            }
+            const WorkItem& item = items[n];
+            if ((long)item.block > first_bad.load(memory_order_relaxed))
+            {
+                continue;
+            }
+
+            const Block& current_block = *blocks[item.block];
+            if (item.first_tx == 0)
+            {
+                const Block& previous_block = *blocks[item.block - 1];
+                if (current_block.getIndex() != previous_block.getIndex() + 1)
+                {
+                    fail(item.block, "index doesn't follow the previous block");
+                    continue;
+                }
+                if (current_block.getPreviousHash() != previous_block.getHash())
+                {
+                    fail(item.block, "previous hash doesn't match");
+                    continue;
+                }
+                if (current_block.getHash() != current_block.calculateHash())
+                {
+                    fail(item.block, "hash doesn't match contents");
+                    continue;
+                }
+            }
+            if ((size_t)current_block.getIndex() > signatures_checked_above
+                && !current_block.isValidTransaction(item.first_tx, item.last_tx))
+            {
+                fail(item.block, "invalid transaction signature");
+            }
+        }
+    };
+
+    vector<thread> workers;
+    for (unsigned i = 1; i < thread_count; i++)
+    {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : workers)
+    {
+        t.join();
+    }
+    return result;
+}
+
+
+
+
+/* Range sync */
+
+// Our block hashes from the tip back: the last ten one by one, then
+// doubling the step each time, always ending with the oldest block we
+// have (genesis, unless we started from a state snapshot)
+vector<Hash256> Blockchain::getLocator() const
+{
+    auto snap = snapshot();
+    vector<Hash256> locator;
+    size_t step = 1;
+    size_t h = snap->height();
+    while (true)
+    {
+        locator.push_back(snap->at(h).getHash());
+        if (h == snap->base)
+        {
+            break;
+        }
+        if (locator.size() >= 10)
+        {
+            step *= 2;
+        }
+        h = h > snap->base + step ? h - step : snap->base;
+    }
+    return locator;
+}
+
+bool Blockchain::hasBlock(const Hash256& hash) const
+{
+    lock_guard<mutex> lock(index_mutex);
+    return height_by_hash.count(hash) > 0;
+}
+
+// Height in [snap] of the newest locator hash on it, -1 if none are. The
+// index may already be ahead of the snapshot, so every hit is checked
+// against the snapshot's own block at that height.
+long Blockchain::findForkPoint(const ChainSnapshot& snap, const vector<Hash256>& locator) const
+{
+    for (const auto& hash : locator)
+    {
+        long h = heightOf(snap, hash);
+        if (h >= 0)
+        {
+            return h;
+        }
+    }
+    return -1;
+}
+
+// Height of [hash] in [snap], -1 if it isn't on that chain
+long Blockchain::heightOf(const ChainSnapshot& snap, const Hash256& hash) const
+{
+    size_t h;
+    {
+        lock_guard<mutex> lock(index_mutex);
+        auto it = height_by_hash.find(hash);
+        if (it == height_by_hash.end())
+        {
+            return -1;
+        }
+        h = it->second;
+    }
+    return h >= snap.base && h <= snap.height() && snap.at(h).getHash() == hash ? (long)h : -1;
+}
+
+// Stored blocks are already encoded, so they are copied as they are, as
+// long as the store still holds this snapshot's block
+string Blockchain::encodedBlock(const ChainSnapshot& snap, size_t height) const
+{
+    const Block& block = snap.at(height);
+    {
+        lock_guard<mutex> lock(store_mutex);
+        long position = store ? store->findHeight(block.getHash()) : -1;
+        if (position >= 0)
+        {
+            return string(store->blockData((size_t)position));
+        }
+    }
+    return Codec::encode(block);
+}
+
+string Blockchain::encodeBlock(const Hash256& hash) const
+{
+    auto snap = snapshot();
+    long h = heightOf(*snap, hash);
+    return h < 0 ? string() : encodedBlock(*snap, (size_t)h);
+}
+
+// The full block's size goes along for the receiver's stats; stored blocks
+// already know theirs
+string Blockchain::encodeCompactBlock(const Hash256& hash) const
+{
+    auto snap = snapshot();
+    long h = heightOf(*snap, hash);
+    if (h < 0)
+    {
+        return string();
+    }
+    const Block& block = snap->at((size_t)h);
+    size_t block_size = 0;
+    {
+        lock_guard<mutex> lock(store_mutex);
+        long position = store ? store->findHeight(hash) : -1;
+        if (position >= 0)
+        {
+            block_size = store->blockData((size_t)position).size();
+        }
+    }
+    if (block_size == 0)
+    {
+        block_size = Codec::encode(block).size();
+    }
+    string out;
+    Codec::encodeCompactBlock(block, block_size, out);
+    return out;
+}
+
+string Blockchain::encodeBlocksAfter(const vector<Hash256>& locator, size_t max_blocks, size_t max_bytes) const
+{
+    auto snap = snapshot();
+    long fork = findForkPoint(*snap, locator);
+    string page;
+    if (fork < 0 && snap->base > 0)
+    {
+        // The peer shares nothing we still have, and we don't have the
+        // blocks it needs from genesis
+        Codec::encodeBlocksPage(0, false, vector<string>(), page);
+        return page;
+    }
+    size_t start_height = (size_t)(fork + 1);
+
+    vector<string> encoded;
+    size_t bytes = 0;
+    size_t h = start_height;
+    while (h <= snap->height() && encoded.size() < max_blocks && bytes < max_bytes)
+    {
+        encoded.push_back(encodedBlock(*snap, h));
+        bytes += encoded.back().size();
+        h++;
+    }
+    Codec::encodeBlocksPage(start_height, h <= snap->height(), encoded, page);
+    return page;
+}
+
+/* Block tree */
+
+// Expected hashes to find a block at our difficulty (4 bits per hex zero)
+uint64_t Blockchain::blockWork() const
+{
+    return 1ULL << (4 * min(difficulty, 15));
+}
+
+Blockchain::AcceptResult Blockchain::acceptBlock(const Block& block)
+{
+    lock_guard<mutex> lock(write_mutex);
+    return acceptLocked(make_shared<const Block>(block), false);
+}
+
+// [checked] skips the checks for a block we built and mined ourselves
+Blockchain::AcceptResult Blockchain::acceptLocked(shared_ptr<const Block> block, bool checked)
+{
+    const Hash256& hash = block->getHash();
+    if (height_by_hash.count(hash) || side_blocks.count(hash))
+    {
+        return AcceptResult::Duplicate;
+    }
+    const Hash256& parent_hash = block->getPreviousHash();
+    if (parent_hash == chain.back()->getHash())
+    {
+        if (!checked)
+        {
+            checkBlock(*block, *chain.back());
+        }
+        connectBlock(move(block));
+        publish();
+        return AcceptResult::Extended;
+    }
+
+    const Block* parent;
+    uint64_t parent_work;
+    auto on_chain = height_by_hash.find(parent_hash);
+    auto on_side = side_blocks.find(parent_hash);
+    if (on_chain != height_by_hash.end())
+    {
+        parent = chain[on_chain->second - base_height].get();
+        parent_work = chain_work[on_chain->second - base_height];
+    }
+    else if (on_side != side_blocks.end())
+    {
+        parent = on_side->second.block.get();
+        parent_work = on_side->second.work;
+    }
+    else
+    {
+        return AcceptResult::Orphan;
+    }
+
+    if (!checked)
+    {
+        checkBlock(*block, *parent);
+    }
+    uint64_t work = parent_work + blockWork();
+    side_blocks.emplace(hash, SideBlock{block, work});
+    if (work <= chain_work.back())
+    {
+        pruneSideBlocks();
+        publish();
+        return AcceptResult::SideBranch;
+    }
+
+    // Walking the side branch back to where it leaves our chain
+    vector<Hash256> branch;
+    Hash256 cursor = block->getHash();
+    while (!height_by_hash.count(cursor))
+    {
+        branch.push_back(cursor);
+        cursor = side_blocks.at(cursor).block->getPreviousHash();
+    }
+    reverse(branch.begin(), branch.end());
+    reorganize(height_by_hash.at(cursor), branch);
+    pruneSideBlocks();
+    pruneChain();
+    publish();
+    return AcceptResult::Reorganized;
+}
+
+// Swapping the blocks above [fork_height] for the side blocks in [branch].
+// Every branch block was checked against its parent when it was accepted,
+// so only the blocks past the fork are touched, and [chain] and [balances]
+// copy just the paths to what changes: the cost follows the depth of the
+// fork, not the length of the chain. The blocks we drop become a side
+// branch themselves, and their transactions go back to pending unless the
+// new branch confirms them too.
+void Blockchain::reorganize(size_t fork_height, const vector<Hash256>& branch)
+{
+    size_t fork = fork_height - base_height;
+    cout << "Chain with more work detected. Replacing " << chain.size() - fork - 1
+         << " block(s) above height " << fork_height << " with " << branch.size() << endl;
+
+    vector<shared_ptr<const Block>> dropped;
+    for (size_t i = chain.size(); i > fork + 1; i--)
+    {
+        shared_ptr<const Block> block = chain[i - 1];
+        uint64_t work = chain_work[i - 1];
+        unapplyBlock(*block);
+        side_blocks.emplace(block->getHash(), SideBlock{block, work});
+        dropped.push_back(move(block));
+        chain.pop_back();
+    }
+    // Kept oldest first, so a spend that depends on an earlier one still
+    // fits when they go back to pending
+    vector<Transaction> disconnected;
+    for (auto it = dropped.rbegin(); it != dropped.rend(); ++it)
+    {
+        for (const auto& tx : (*it)->getTransactions())
+        {
+            if (tx.sending_address != "0")
+            {
+                disconnected.push_back(tx);
+            }
+        }
+    }
+
+    unordered_set<Hash256> confirmed;
+    for (const auto& hash : branch)
+    {
+        auto node = side_blocks.find(hash);
+        shared_ptr<const Block> block = move(node->second.block);
+        side_blocks.erase(node);
+        chain.push_back(block);
+        applyBlock(*block);
+        removePending(*block);
+        for (const auto& tx : block->getTransactions())
+        {
+            confirmed.insert(tx.id);
+        }
+    }
+
+    // These were in blocks, so their signatures have been checked
+    for (const auto& tx : disconnected)
+    {
+        if (confirmed.count(tx.id))
+        {
+            continue;
+        }
+        try
+        {
+            addTransactionLocked(tx);
+        }
+        catch (const runtime_error&)
+        {
+            // No longer spendable on the new chain
+        }
+    }
+    persistFrom(fork + 1);
+    saveTipEvery();
+}
+
+// Forgetting side blocks too far below our tip to ever take over again
+void Blockchain::pruneSideBlocks()
+{
+    const size_t KEEP_DEPTH = 1000;
+    size_t tip_height = base_height + chain.size() - 1;
+    if (tip_height < KEEP_DEPTH)
+    {
+        return;
+    }
+    size_t floor = tip_height - KEEP_DEPTH;
+    for (auto it = side_blocks.begin(); it != side_blocks.end();)
+    {
+        if ((size_t)it->second.block->getIndex() < floor)
+        {
+            it = side_blocks.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
@@ -2,76 +2,417 @@
 #define BLOCKCHAIN_H
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
 #include <ctime>
+#include <cstdint>
 #include "crypto.h"
-#include <string>
+#include "pow.h"
+#include "merkle.h"
+#include "persistent.h"
 
 using namespace std;
 
+// Counters for the cache of signatures already verified, see Transaction::isValid
+struct SignatureCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t size = 0;
+    size_t capacity = 0;
+};
+
 /* Transaction*/
 struct Transaction
 {
-    string id; 
+    Hash256 id;
     string sending_address;
     string receiving_address;
     double amount;
     string file_metadata; // For file transfers
     time_t timestamp;
     string signature;
-    string calculate_Hash() const;
+    Hash256 calculate_Hash() const;
+    string senderAddress() const;
     string serializer() const;
     static Transaction deserializer(const string& data);
     bool isValid() const;
+
+    static SignatureCacheStats signatureCacheStats();
+    // 0 turns the cache off
+    static void setSignatureCacheCapacity(size_t capacity);
+};
+
+// What a mining run did: how many hashes each worker thread tried and
+// how long the whole search took. Used for hashes/sec reporting.
+struct MiningStats
+{
+    unsigned threads = 0;
+    vector<uint64_t> hashes_per_thread;
+    double seconds = 0.0;
+    uint64_t totalHashes() const;
+    double hashRate(unsigned thread) const;
+    double totalHashRate() const;
+};
+
+// Everything this node has mined since it started
+struct MiningTotals
+{
+    uint64_t blocks = 0;
+    uint64_t hashes = 0;
+    double seconds = 0.0;
 };
 
 // Class - [Block] for representation of a block within a blockchain
 class Block {
 public: 
-    Block(int index, time_t timestamp, vector<Transaction> transactions, string previous_hash);
+    Block(int index, time_t timestamp, vector<Transaction> transactions, const Hash256& previous_hash);
+    // Restoring a block exactly as it was received, without rehashing it
+    Block(int index, time_t timestamp, vector<Transaction> transactions, const Hash256& previous_hash,
+          uint64_t nonce, const Hash256& hash);
+    // For a BlockTemplate that has already built the Merkle root
+    Block(int index, time_t timestamp, vector<Transaction> transactions, const Hash256& previous_hash,
+          const Merkle::Hash& merkle_root);
+    // A block whose transactions are still on disk (see Blockchain::openStore).
+    // Only the header is in memory; [load] is called, once, the first time
+    // anything asks for the transactions, and throws if they're gone.
+    Block(int index, time_t timestamp, const Hash256& previous_hash, uint64_t nonce, const Hash256& hash,
+          const Merkle::Hash& merkle_root, size_t transaction_count, size_t footprint,
+          function<vector<Transaction>()> load);
 
     int getIndex() const {return index; }
-    string getHash() const {return hash;}
-    string calculateHash() const;
-    string getPreviousHash() const {return previous_hash;}
-    vector<Transaction> getTransactions() const { return transactions;}
-    void mineBlock(int difficulty);
+    time_t getTimestamp() const { return timestamp; }
+    const Hash256& getHash() const {return hash;}
+    Hash256 calculateHash() const;
+    const Hash256& getPreviousHash() const {return previous_hash;}
+    PoW::Header buildHeader() const;
+    const Merkle::Hash& getMerkleRoot() const { return merkle_root; }
+    // Inclusion proof for the transaction with [tx_id]; false if it isn't here
+    bool merkleProof(const Hash256& tx_id, Merkle::Proof& proof) const;
+    const vector<Transaction>& getTransactions() const { return stored ? storedTransactions() : transactions; }
+    uint64_t getNonce() const { return nonce; }
+    // thread_count == 0 uses every hardware thread
+    MiningStats mineBlock(int difficulty, unsigned thread_count = 0);
+    size_t transactionCount() const { return stored ? stored->count : transactions.size(); }
+    // What the block takes up in memory with its transactions, near enough
+    size_t footprint() const;
     bool isValidTransaction() const;
+    bool isValidTransaction(size_t first, size_t last) const;
     string serialize() const;
     static Block deserialize(const string& data);
 private:
     int index;
     time_t timestamp;
     vector<Transaction> transactions;
-    string previous_hash;
-    string hash;
-    int nonce;
-    //string calculateHash();
+    Hash256 previous_hash;
+    Hash256 hash;
+    uint64_t nonce;
+    Merkle::Hash merkle_root;
+
+    // Transactions that are only read from disk when first needed. Shared
+    // by copies of the block, so they're loaded at most once between them.
+    struct StoredTransactions
+    {
+        once_flag loaded;
+        size_t count;
+        size_t footprint;
+        function<vector<Transaction>()> load;
+        vector<Transaction> transactions;
+    };
+    shared_ptr<StoredTransactions> stored;
+    const vector<Transaction>& storedTransactions() const;
+};
+
+// A block being filled before it is mined. The Merkle root grows with the
+// transaction list, so adding one costs O(log n) rather than rehashing
+// every id already in.
+class BlockTemplate
+{
+public:
+    BlockTemplate(int index, const Hash256& previous_hash) : index(index), previous_hash(previous_hash) {}
+    void addTransaction(const Transaction& tx);
+    size_t transactionCount() const { return transactions.size(); }
+    Merkle::Hash merkleRoot() const { return tree.root(); }
+    // Handing the transactions over to an unmined block
+    Block build(time_t timestamp);
+private:
+    int index;
+    Hash256 previous_hash;
+    vector<Transaction> transactions;
+    Merkle::Tree tree;
+};
+
+// Outcome of a full chain validation. When the chain is invalid,
+// [first_invalid_block] is the lowest block index that failed.
+struct ValidationResult
+{
+    bool valid = true;
+    long first_invalid_block = -1;
+    string reason;
+};
+
+class BlockStore;
+class Mempool;
+struct MempoolStats;
+namespace Compact { class PartialBlock; }
+namespace Codec { struct ChainStateView; }
+
+// The chain's blocks and its balances (address -> confirmed balance), in
+// the persistent containers the writer shares with its snapshots
+using BlockList = PersistentVector<shared_ptr<const Block>>;
+using BalanceMap = PersistentMap<string, double>;
+
+/* Read-only view of the chain at one moment. A snapshot is never changed
+   once published, so readers can hold on to one for as long as they like
+   while the writer carries on. Blocks and balances are shared with the
+   writer and the other snapshots (see persistent.h): publishing one
+   copies nothing, and the writer's next change copies only what it touches.
+*/
+struct ChainSnapshot
+{
+    BlockList blocks;
+    size_t base = 0;         // height of blocks[0], see Blockchain::loadState
+    BalanceMap balances;
+    uint64_t work = 0;       // cumulative work of the whole chain
+    size_t side_blocks = 0;
+    size_t block_bytes = 0;  // rough in-memory size of [blocks]
+
+    size_t height() const { return base + blocks.size() - 1; }
+    const Block& at(size_t height) const { return *blocks[height - base]; }
+    const Block& tip() const { return *blocks.back(); }
+    double balance(const string& address) const;
 };
 
-// Class - [Blockchain] represents the entire blockchain
+/* Class - [Blockchain] represents the entire blockchain
+
+   Threading: every change (blocks, transactions, loading) goes through a
+   single writer lock. After each change the writer publishes a new
+   ChainSnapshot, and all read-only queries are answered from the latest
+   one without touching the writer lock, so a balance lookup or a sync
+   request never waits behind block validation. Mining runs outside the
+   lock entirely and only takes it to connect the block it found.
+*/
 class Blockchain {
 public: 
     Blockchain();
+    ~Blockchain();
+
+    // Keeping the chain in an on-disk block store. An existing store is
+    // loaded in place of the in-memory chain; an empty one is seeded with it.
+    // Reopening only reads the store's index and the balances checkpointed
+    // at (or near) the tip; old blocks load their transactions on demand.
+    bool openStore(const string& directory);
     void addBlock(const Block& new_block);
-    Block getLatestBlock() const;
+    shared_ptr<const ChainSnapshot> snapshot() const;
+    shared_ptr<const Block> getLatestBlock() const { return snapshot()->blocks.back(); }
     bool isChainValid();
-    void minePendingTransaction(const string& miner_addr);
+    // thread_count == 0 uses the configured validation thread count
+    ValidationResult validateChain(unsigned thread_count = 0) const;
     void addTransaction(const Transaction& tx);
-    double getBalance(const string& addr);
-    bool hasSufficientFunds(const string& sender_address, double amount);
+    // addTransaction in two steps: the stateless checks (signature
+    // included), which are safe to run on several threads at once, and
+    // the funds check and mempool insert, which take the write lock
+    void verifyTransaction(const Transaction& tx) const;
+    void addVerifiedTransaction(const Transaction& tx);
+    double getBalance(const string& addr) const;
+    double getPendingSpends(const string& addr) const;
+    bool hasPendingTransaction(const Hash256& id) const;
+    // Copying the pending transaction with [id] into [tx]; false if there is none
+    bool findPendingTransaction(const Hash256& id, Transaction& tx) const;
+    // Offering every pending transaction to a block rebuilt from a compact block
+    void fillFromMempool(Compact::PartialBlock& partial) const;
+    bool hasSufficientFunds(const string& sender_address, double amount) const;
+
+    void setMiningThreads(unsigned threads) { mining_threads = threads; }
+    unsigned getMiningThreads() const { return mining_threads; }
+    MiningStats getLastMiningStats() const;
+    MiningTotals getMiningTotals() const;
+    void setValidationThreads(unsigned threads) { validation_threads = threads; }
+    MempoolStats mempoolStats() const;
+    void setMempoolLimits(size_t max_count, size_t max_bytes);
+
+    /* State snapshots
+       A state file holds our tip block and the balances right after it
+       (see Codec::encodeChainState). Loading one starts the chain at that
+       block instead of genesis, so a new node can answer queries and
+       follow the network without downloading and replaying the history
+       first. The file is trusted the way assume-valid is: nothing below
+       its block is ever checked. A copy is kept beside the block store so
+       the node comes back up from it after a restart.
+    */
+    bool saveState(const string& path) const;
+    // Only loaded if it is ahead of our chain, which it then replaces
+    bool loadState(const string& path);
+    size_t baseHeight() const { return snapshot()->base; }
+
+    /* Assume-valid
+       A block known to be on the real chain. Signatures in blocks at or
+       below its height aren't checked while syncing or validating the
+       chain, and a block at that height with any other hash is refused.
+       Any branch that skipped checks below it has to pass through it to
+       get further, so it can't outlast the real chain. Set before the
+       node starts taking blocks.
+    */
+    void setAssumeValid(size_t height, const Hash256& hash);
+
+    /* Pruning
+       A pruned node only keeps the most recent blocks, in memory and in
+       the block store. Older ones are folded into the chain's base the
+       same way a state snapshot is loaded: the balances after them are
+       kept (and written to the state file), the blocks themselves are
+       dropped. Segment files that only hold pruned blocks are deleted.
+       New blocks are still fully checked, and peers can still sync the
+       blocks we kept; reorgs deeper than them are no longer possible.
+    */
+    static const size_t MIN_PRUNE_BLOCKS = 100;
+    // Keeping at least the last [keep_blocks] blocks, and no more than
+    // [keep_bytes] of block data; 0 leaves that limit off, both 0 turns
+    // pruning off. Never fewer than MIN_PRUNE_BLOCKS.
+    void setPruning(size_t keep_blocks, size_t keep_bytes);
 
     void deserialize(const string& data);
     string block_serialize() const;
+    // Binary form of the whole chain (see codec.h)
+    string encode() const;
+    bool decode(string_view data);
+
+    /* Range sync
+       A locator is a list of our block hashes, newest first, getting
+       exponentially sparser towards genesis. A peer answers with the
+       blocks after the newest locator hash it also has, a page at a time.
+    */
+    size_t height() const { return snapshot()->height(); }
+    vector<Hash256> getLocator() const;
+    bool hasBlock(const Hash256& hash) const;
+    // Up to [max_blocks] encoded blocks after the newest [locator] hash on
+    // our chain, stopping early once the page passes [max_bytes]
+    string encodeBlocksAfter(const vector<Hash256>& locator, size_t max_blocks, size_t max_bytes) const;
+    // The encoded block with [hash] on our chain, empty if it isn't on it
+    string encodeBlock(const Hash256& hash) const;
+    // The same block as a compact block (see compact.h), empty if it isn't on our chain
+    string encodeCompactBlock(const Hash256& hash) const;
+
+    /* Block tree
+       Blocks that don't extend our tip but do connect to a block we know
+       are kept as side branches. Whichever tip has the most cumulative
+       work is the active chain; when a side branch overtakes it, only the
+       blocks past the fork point are undone and redone, and the rest of the
+       chain and balances stay shared with the last snapshot, so a reorg
+       costs the depth of the fork whatever the length of the chain.
+    */
+    enum class AcceptResult
+    {
+        Extended,     // added on top of our tip
+        SideBranch,   // stored, but our chain still has more work
+        Reorganized,  // its branch now has the most work and is active
+        Duplicate,    // already known
+        Orphan,       // parent unknown; the caller should sync with the sender
+    };
+    // Throws runtime_error when the block itself is invalid
+    AcceptResult acceptBlock(const Block& block);
+    size_t sideBlockCount() const { return snapshot()->side_blocks; }
+    uint64_t chainWork() const { return snapshot()->work; }
 
-    vector<Block> getChain() const;
-    void replaceChain(const vector<Block>& new_chain);
+    // Mining a block on top of the current tip. If another block arrives
+    // first, the mined one is accepted like any other competing block.
+    AcceptResult minePendingTransaction(const string& miner_addr);
 private:
-    vector<Block> chain;
-    vector<Transaction> pending_transactions;
-    int difficulty;
-    double mining_reward;
+    // Everything below [write_mutex] is only changed by whoever holds it
+    mutable mutex write_mutex;
+    BlockList chain;
+
+    // address -> confirmed balance, kept in step with [chain]
+    BalanceMap balances;
+    // cumulative work up to and including each block on [chain]
+    vector<uint64_t> chain_work;
+
+    struct SideBlock
+    {
+        shared_ptr<const Block> block;
+        uint64_t work; // cumulative, like chain_work
+    };
+    // block hash -> block, for known blocks that aren't on [chain]
+    unordered_map<Hash256, SideBlock> side_blocks;
+
+    // block hash -> height, for every block on [chain]. Readers look
+    // heights up here and then confirm them against their snapshot.
+    mutable mutex index_mutex;
+    unordered_map<Hash256, size_t> height_by_hash;
+
+    mutable mutex mempool_mutex;
+    unique_ptr<Mempool> mempool;
+
+    // Readers copy pages of encoded blocks out of the store
+    mutable mutex store_mutex;
+    unique_ptr<BlockStore> store;
+
+    // Where the chain starts when it was loaded from a state snapshot:
+    // [chain][0] is at [base_height], and [base_balances] and [base_work]
+    // are the state right after it. All zero/empty for a chain from genesis.
+    size_t base_height = 0;
+    BalanceMap base_balances;
+    uint64_t base_work = 0;
+    string store_directory;
+    // Height of the block store's first block. Below [base_height] once
+    // the chain is pruned, until the store deletes those segments.
+    size_t stored_from = 0;
+
+    // Height of the last tip checkpoint written, see saveTip
+    size_t tip_saved_height = 0;
+
+    size_t prune_blocks = 0;
+    size_t prune_bytes = 0;
+    size_t chain_bytes = 0;         // block data held in [chain]
+
+    size_t assume_valid_height = 0;
+    Hash256 assume_valid_hash;      // zero when there is no assume-valid block
+
+    // Only ever read and replaced with atomic_load/atomic_store
+    shared_ptr<const ChainSnapshot> current;
+
+    void publish();
+    void connectBlock(shared_ptr<const Block> block);
+    AcceptResult acceptLocked(shared_ptr<const Block> block, bool checked);
+    void addTransactionLocked(const Transaction& tx);
+    void replaceChain(BlockList new_chain);
+    void applyBlock(const Block& block);
+    void indexBlock(const Block& block);
+    void unapplyBlock(const Block& block);
+    void rebuildBalances(const Codec::ChainStateView* checkpoint = nullptr);
+    void saveTip();
+    void saveTipEvery();
+    bool readStateFile(const string& path, string& data, Codec::ChainStateView& state) const;
+    void setBase(const Codec::ChainStateView& state);
+    void clearBase();
+    ValidationResult validateSequence(const vector<const Block*>& blocks, unsigned thread_count,
+                                      size_t signatures_checked_above = 0) const;
+    void removePending(const Block& block);
+    void checkBlock(const Block& block, const Block& parent) const;
+    uint64_t blockWork() const;
+    void reorganize(size_t fork_height, const vector<Hash256>& branch);
+    void pruneSideBlocks();
+    // [position] is an index into [chain], not a height
+    void persistFrom(size_t position);
+    // Replacing the whole store with [chain]
+    void rewriteStore();
+    void pruneChain();
+    long findForkPoint(const ChainSnapshot& snap, const vector<Hash256>& locator) const;
+    long heightOf(const ChainSnapshot& snap, const Hash256& hash) const;
+    string encodedBlock(const ChainSnapshot& snap, size_t height) const;
+
+    const int difficulty;
+    const double mining_reward;
+    atomic<unsigned> mining_threads;
+    atomic<unsigned> validation_threads;
 
+    mutable mutex stats_mutex;
+    MiningStats last_mining_stats;
+    MiningTotals mining_totals;
 };
 
 #endif
\ No newline at end of file
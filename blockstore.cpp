@@ -0,0 +1,744 @@
+#include "blockstore.h"
+#include "codec.h"
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <filesystem>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char INDEX_MAGIC[8] = { 'P', '2', 'P', 'B', 'I', 'D', 'X', '2' };
+// Before the index kept block headers, see upgradeIndex
+static const char OLD_INDEX_MAGIC[8] = { 'P', '2', 'P', 'B', 'I', 'D', 'X', '1' };
+static const size_t INDEX_HEADER_SIZE = 64;
+static const size_t COUNT_OFFSET = 8;
+static const size_t FIRST_OFFSET = 16;
+static const size_t BASE_OFFSET = 24;
+static const size_t INDEX_GROWTH = 64 * 1024;              // records per growth step
+static const uint64_t SEGMENT_LIMIT = 128 * 1024 * 1024;   // bytes per segment file, at most
+static const uint64_t MIN_SEGMENT_LIMIT = 1024 * 1024;
+// Pruned records are cut out of index.dat once there are this many, and
+// at least as many as there are live ones
+static const size_t MIN_INDEX_COMPACTION = 1024;
+static const size_t RECORD_HEADER_SIZE = 8;
+
+static uint32_t payloadChecksum(string_view payload)
+{
+    unsigned char digest[Crypto::HASH_SIZE];
+    Crypto::sha256Raw(payload.data(), payload.size(), digest);
+    uint32_t sum;
+    memcpy(&sum, digest, sizeof(sum));
+    return sum;
+}
+
+static void putUint32(unsigned char* out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+BlockStore::BlockStore()
+: index_fd(-1), index_map(nullptr), index_capacity(0), base(0), count(0), synced_count(0), first(0),
+  segment_limit(SEGMENT_LIMIT), sync_every(16), sync_interval(1000)
+{
+}
+
+BlockStore::~BlockStore()
+{
+    close();
+}
+
+void BlockStore::setSyncPolicy(size_t every_blocks, chrono::milliseconds interval)
+{
+    sync_every = max<size_t>(1, every_blocks);
+    sync_interval = interval;
+}
+
+void BlockStore::setSegmentLimit(uint64_t bytes)
+{
+    segment_limit = min(SEGMENT_LIMIT, max(MIN_SEGMENT_LIMIT, bytes));
+}
+
+static string segmentFile(const string& directory, uint32_t segment)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "blk%05u.dat", segment);
+    return directory + "/" + name;
+}
+
+string BlockStore::segmentPath(uint32_t segment) const
+{
+    return segmentFile(directory, segment);
+}
+
+bool BlockStore::openSegment(uint32_t segment)
+{
+    while (segments.size() <= segment)
+    {
+        segments.emplace_back();
+    }
+    Segment& seg = segments[segment];
+    if (seg.fd >= 0)
+    {
+        return true;
+    }
+    seg.fd = ::open(segmentPath(segment).c_str(), O_RDWR | O_CREAT, 0644);
+    if (seg.fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    fstat(seg.fd, &st);
+    seg.size = st.st_size;
+    return true;
+}
+
+// Making sure the index file and its mapping have room for [records]
+// records past [base]
+bool BlockStore::mapIndex(size_t records)
+{
+    if (records <= index_capacity && index_map)
+    {
+        return true;
+    }
+    size_t capacity = ((records + INDEX_GROWTH - 1) / INDEX_GROWTH) * INDEX_GROWTH;
+    size_t bytes = INDEX_HEADER_SIZE + capacity * sizeof(IndexRecord);
+
+    struct stat st;
+    fstat(index_fd, &st);
+    if ((size_t)st.st_size < bytes && ftruncate(index_fd, bytes) != 0)
+    {
+        return false;
+    }
+    if (index_map)
+    {
+        munmap(index_map, INDEX_HEADER_SIZE + index_capacity * sizeof(IndexRecord));
+    }
+    index_map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+    if (index_map == MAP_FAILED)
+    {
+        index_map = nullptr;
+        index_capacity = 0;
+        return false;
+    }
+    index_capacity = capacity;
+    return true;
+}
+
+BlockStore::IndexRecord* BlockStore::record(size_t height) const
+{
+    return (IndexRecord*)((char*)index_map + INDEX_HEADER_SIZE) + (height - base);
+}
+
+// Updating the block count in the index header once everything it covers
+// is on disk
+bool BlockStore::writeCount(uint64_t new_count)
+{
+    memcpy((char*)index_map + COUNT_OFFSET, &new_count, sizeof(new_count));
+    if (msync(index_map, INDEX_HEADER_SIZE, MS_SYNC) != 0)
+    {
+        return false;
+    }
+    synced_count = new_count;
+    return true;
+}
+
+// Written before the segments below it are deleted, so a crash never
+// leaves the header pointing at missing files
+bool BlockStore::writeFirst(uint64_t new_first)
+{
+    memcpy((char*)index_map + FIRST_OFFSET, &new_first, sizeof(new_first));
+    if (msync(index_map, INDEX_HEADER_SIZE, MS_SYNC) != 0)
+    {
+        return false;
+    }
+    first = new_first;
+    return true;
+}
+
+void BlockStore::dropSegment(uint32_t segment)
+{
+    Segment& seg = segments[segment];
+    if (seg.map)
+    {
+        munmap(seg.map, seg.map_size);
+    }
+    if (seg.fd >= 0)
+    {
+        ::close(seg.fd);
+    }
+    seg = Segment();
+    filesystem::remove(segmentPath(segment));
+}
+
+bool BlockStore::open(const string& path)
+{
+    close();
+    directory = path;
+    error_code ec;
+    filesystem::create_directories(directory, ec);
+
+    string index_path = directory + "/index.dat";
+    index_fd = ::open(index_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (index_fd < 0)
+    {
+        cerr << "[STORE] Cannot open " << index_path << endl;
+        return false;
+    }
+
+    char magic[sizeof(INDEX_MAGIC)];
+    if (pread(index_fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic)
+        && memcmp(magic, OLD_INDEX_MAGIC, sizeof(magic)) == 0)
+    {
+        ::close(index_fd);
+        index_fd = -1;
+        if (!upgradeIndex(index_path))
+        {
+            cerr << "[STORE] Cannot upgrade " << index_path << endl;
+            return false;
+        }
+        index_fd = ::open(index_path.c_str(), O_RDWR, 0644);
+        if (index_fd < 0)
+        {
+            return false;
+        }
+    }
+
+    struct stat st;
+    fstat(index_fd, &st);
+    bool fresh = (size_t)st.st_size < INDEX_HEADER_SIZE;
+    size_t existing_records = fresh ? 0 : (st.st_size - INDEX_HEADER_SIZE) / sizeof(IndexRecord);
+    if (!mapIndex(max<size_t>(existing_records, 1)))
+    {
+        cerr << "[STORE] Cannot map the block index" << endl;
+        close();
+        return false;
+    }
+
+    if (fresh)
+    {
+        memcpy(index_map, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        writeFirst(0);
+        writeCount(0);
+    }
+    else if (memcmp(index_map, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+    {
+        cerr << "[STORE] " << directory << "/index.dat is not a block index" << endl;
+        close();
+        return false;
+    }
+
+    uint64_t header_count;
+    uint64_t header_first;
+    uint64_t header_base;
+    memcpy(&header_count, (char*)index_map + COUNT_OFFSET, sizeof(header_count));
+    memcpy(&header_first, (char*)index_map + FIRST_OFFSET, sizeof(header_first));
+    memcpy(&header_base, (char*)index_map + BASE_OFFSET, sizeof(header_base));
+    base = header_base;
+    count = max<size_t>(base, min<size_t>(header_count, base + existing_records));
+    synced_count = count;
+    first = max<size_t>(base, min<size_t>(header_first, count));
+
+    if (!recover())
+    {
+        close();
+        return false;
+    }
+
+    by_hash.reserve(count - first);
+    for (size_t h = first; h < count; h++)
+    {
+        by_hash[Hash256::fromBytes(record(h)->hash)] = h;
+    }
+    last_sync = chrono::steady_clock::now();
+    return true;
+}
+
+// Rewriting an index from before it kept block headers. Every header is
+// read from its segment this once; records past a block that can't be
+// read are left off, the same as after a crash.
+bool BlockStore::upgradeIndex(const string& path)
+{
+    struct OldRecord
+    {
+        unsigned char hash[32];
+        uint32_t segment;
+        uint32_t length;
+        uint64_t offset;
+        uint32_t checksum;
+        uint32_t reserved;
+        uint64_t height;
+    };
+
+    ifstream in(path, ios::binary);
+    string old((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    if (old.size() < INDEX_HEADER_SIZE)
+    {
+        return false;
+    }
+    uint64_t old_count;
+    uint64_t old_first;
+    memcpy(&old_count, old.data() + COUNT_OFFSET, sizeof(old_count));
+    memcpy(&old_first, old.data() + FIRST_OFFSET, sizeof(old_first));
+    old_count = min<uint64_t>(old_count, (old.size() - INDEX_HEADER_SIZE) / sizeof(OldRecord));
+    cerr << "[STORE] Upgrading the block index (" << old_count << " blocks)" << endl;
+
+    string upgraded(INDEX_HEADER_SIZE + old_count * sizeof(IndexRecord), '\0');
+    uint64_t new_count = 0;
+    for (; new_count < old_count; new_count++)
+    {
+        OldRecord old_rec;
+        memcpy(&old_rec, old.data() + INDEX_HEADER_SIZE + new_count * sizeof(OldRecord), sizeof(old_rec));
+        IndexRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        memcpy(rec.hash, old_rec.hash, sizeof(rec.hash));
+        rec.segment = old_rec.segment;
+        rec.length = old_rec.length;
+        rec.offset = old_rec.offset;
+        rec.checksum = old_rec.checksum;
+        rec.height = old_rec.height;
+        if (new_count >= old_first)
+        {
+            Location location{ rec.segment, rec.offset, rec.length, rec.checksum };
+            string data;
+            Codec::BlockView view;
+            if (!readBlock(directory, location, data) || !Codec::decodeBlock(data, view))
+            {
+                break;
+            }
+            Block block = view.toBlock();
+            memcpy(rec.previous_hash, block.getPreviousHash().data(), sizeof(rec.previous_hash));
+            memcpy(rec.merkle_root, block.getMerkleRoot().data(), sizeof(rec.merkle_root));
+            rec.tx_count = (uint32_t)block.transactionCount();
+            rec.index = block.getIndex();
+            rec.timestamp = block.getTimestamp();
+            rec.nonce = block.getNonce();
+            rec.footprint = block.footprint();
+        }
+        memcpy(&upgraded[INDEX_HEADER_SIZE + new_count * sizeof(IndexRecord)], &rec, sizeof(rec));
+    }
+    upgraded.resize(INDEX_HEADER_SIZE + new_count * sizeof(IndexRecord));
+    memcpy(&upgraded[0], INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    memcpy(&upgraded[COUNT_OFFSET], &new_count, sizeof(new_count));
+    old_first = min(old_first, new_count);
+    memcpy(&upgraded[FIRST_OFFSET], &old_first, sizeof(old_first));
+
+    string temp_path = path + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool written = write(fd, upgraded.data(), upgraded.size()) == (ssize_t)upgraded.size() && fsync(fd) == 0;
+    ::close(fd);
+    return written && rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+// Dropping whatever a crash left half written: index records whose data
+// never fully reached the segment, and segment bytes past the last record.
+bool BlockStore::recover()
+{
+    while (count > first)
+    {
+        const IndexRecord* last = record(count - 1);
+        if (openSegment(last->segment))
+        {
+            string_view data = blockData(count - 1);
+            if (!data.empty() && payloadChecksum(data) == last->checksum)
+            {
+                break;
+            }
+        }
+        count--;
+    }
+    if (count != synced_count && !writeCount(count))
+    {
+        return false;
+    }
+
+    uint32_t active = 0;
+    uint64_t end = 0;
+    if (count > first)
+    {
+        const IndexRecord* last = record(count - 1);
+        active = last->segment;
+        end = last->offset + RECORD_HEADER_SIZE + last->length;
+    }
+    if (!openSegment(active))
+    {
+        cerr << "[STORE] Cannot open " << segmentPath(active) << endl;
+        return false;
+    }
+    if (segments[active].size != end)
+    {
+        if (ftruncate(segments[active].fd, end) != 0)
+        {
+            return false;
+        }
+        segments[active].size = end;
+    }
+    for (uint32_t s = active + 1; filesystem::exists(segmentPath(s)); s++)
+    {
+        filesystem::remove(segmentPath(s));
+    }
+    return true;
+}
+
+void BlockStore::close()
+{
+    if (index_fd >= 0 && index_map)
+    {
+        flush();
+    }
+    for (auto& seg : segments)
+    {
+        if (seg.map)
+        {
+            munmap(seg.map, seg.map_size);
+        }
+        if (seg.fd >= 0)
+        {
+            ::close(seg.fd);
+        }
+    }
+    segments.clear();
+    if (index_map)
+    {
+        munmap(index_map, INDEX_HEADER_SIZE + index_capacity * sizeof(IndexRecord));
+        index_map = nullptr;
+    }
+    if (index_fd >= 0)
+    {
+        ::close(index_fd);
+        index_fd = -1;
+    }
+    index_capacity = 0;
+    base = 0;
+    count = 0;
+    synced_count = 0;
+    by_hash.clear();
+}
+
+bool BlockStore::append(const Block& block)
+{
+    if (!isOpen())
+    {
+        return false;
+    }
+
+    string payload = Codec::encode(block);
+    uint32_t checksum = payloadChecksum(payload);
+
+    uint32_t active = segments.empty() ? 0 : (uint32_t)segments.size() - 1;
+    if (!openSegment(active))
+    {
+        return false;
+    }
+    if (segments[active].size > 0 && segments[active].size + RECORD_HEADER_SIZE + payload.size() > segment_limit)
+    {
+        active++;
+        if (!flush() || !openSegment(active))
+        {
+            return false;
+        }
+    }
+    Segment& seg = segments[active];
+
+    unsigned char header[RECORD_HEADER_SIZE];
+    putUint32(header, (uint32_t)payload.size());
+    putUint32(header + 4, checksum);
+    if (pwrite(seg.fd, header, RECORD_HEADER_SIZE, seg.size) != (ssize_t)RECORD_HEADER_SIZE
+        || pwrite(seg.fd, payload.data(), payload.size(), seg.size + RECORD_HEADER_SIZE) != (ssize_t)payload.size())
+    {
+        cerr << "[STORE] Write to " << segmentPath(active) << " failed" << endl;
+        return false;
+    }
+
+    if (!mapIndex(count + 1 - base))
+    {
+        return false;
+    }
+    IndexRecord* rec = record(count);
+    memset(rec, 0, sizeof(IndexRecord));
+    memcpy(rec->hash, block.getHash().data(), sizeof(rec->hash));
+    memcpy(rec->previous_hash, block.getPreviousHash().data(), sizeof(rec->previous_hash));
+    memcpy(rec->merkle_root, block.getMerkleRoot().data(), sizeof(rec->merkle_root));
+    rec->segment = active;
+    rec->length = (uint32_t)payload.size();
+    rec->offset = seg.size;
+    rec->checksum = checksum;
+    rec->tx_count = (uint32_t)block.transactionCount();
+    rec->height = count;
+    rec->index = block.getIndex();
+    rec->timestamp = block.getTimestamp();
+    rec->nonce = block.getNonce();
+    rec->footprint = block.footprint();
+
+    seg.size += RECORD_HEADER_SIZE + payload.size();
+    by_hash[block.getHash()] = count;
+    count++;
+
+    if (count - synced_count >= sync_every || chrono::steady_clock::now() - last_sync >= sync_interval)
+    {
+        return flush();
+    }
+    return true;
+}
+
+bool BlockStore::flush()
+{
+    if (!isOpen())
+    {
+        return false;
+    }
+    last_sync = chrono::steady_clock::now();
+    if (count == synced_count)
+    {
+        return true;
+    }
+
+    // Segment data first, then the index records, then the count that
+    // makes them visible
+    uint32_t first_dirty = synced_count < count ? record(synced_count)->segment : 0;
+    for (uint32_t s = first_dirty; s < segments.size(); s++)
+    {
+        if (segments[s].fd >= 0 && fdatasync(segments[s].fd) != 0)
+        {
+            return false;
+        }
+    }
+    if (msync(index_map, INDEX_HEADER_SIZE + (count - base) * sizeof(IndexRecord), MS_SYNC) != 0)
+    {
+        return false;
+    }
+    return writeCount(count);
+}
+
+bool BlockStore::truncate(size_t new_height)
+{
+    if (!isOpen() || new_height >= count)
+    {
+        return isOpen();
+    }
+    if (new_height <= first && first > 0)
+    {
+        // Nothing left on disk to keep: starting the store over
+        for (uint32_t s = 0; s < segments.size(); s++)
+        {
+            dropSegment(s);
+        }
+        segments.clear();
+        by_hash.clear();
+        count = new_height;
+        if (!writeCount(min(synced_count, count)))
+        {
+            return false;
+        }
+        // No record is live any more, so the file can start right here
+        base = count;
+        uint64_t new_base = base;
+        memcpy((char*)index_map + BASE_OFFSET, &new_base, sizeof(new_base));
+        return writeFirst(count) && openSegment(0);
+    }
+
+    const IndexRecord* first_dropped = record(new_height);
+    uint32_t segment = first_dropped->segment;
+    uint64_t end = first_dropped->offset;
+
+    for (size_t h = new_height; h < count; h++)
+    {
+        by_hash.erase(Hash256::fromBytes(record(h)->hash));
+    }
+    count = new_height;
+    if (!writeCount(min(synced_count, count)))
+    {
+        return false;
+    }
+
+    for (uint32_t s = segment + 1; s < segments.size(); s++)
+    {
+        if (segments[s].map)
+        {
+            munmap(segments[s].map, segments[s].map_size);
+        }
+        ::close(segments[s].fd);
+        filesystem::remove(segmentPath(s));
+    }
+    segments.resize(segment + 1);
+    if (ftruncate(segments[segment].fd, end) != 0)
+    {
+        return false;
+    }
+    segments[segment].size = end;
+    return flush();
+}
+
+bool BlockStore::prune(size_t height)
+{
+    if (!isOpen())
+    {
+        return false;
+    }
+    height = min(height, count);
+    if (height <= first)
+    {
+        return true;
+    }
+    // Never the segment still being appended to
+    uint32_t active = count > 0 ? record(count - 1)->segment : 0;
+    uint32_t keep_from = height < count ? record(height)->segment : active;
+    keep_from = min(keep_from, active);
+    size_t new_first = first;
+    while (new_first < height && record(new_first)->segment < keep_from)
+    {
+        by_hash.erase(Hash256::fromBytes(record(new_first)->hash));
+        new_first++;
+    }
+    if (new_first == first)
+    {
+        return true;
+    }
+    uint32_t first_dropped = record(first)->segment;
+    if (!flush() || !writeFirst(new_first))
+    {
+        return false;
+    }
+    for (uint32_t s = first_dropped; s < keep_from; s++)
+    {
+        dropSegment(s);
+    }
+    if (first - base >= max(MIN_INDEX_COMPACTION, count - first))
+    {
+        return compactIndex();
+    }
+    return true;
+}
+
+// Rewriting index.dat without the records below [first], the same way
+// upgradeIndex does: a new file renamed over the old one, so a crash
+// leaves one or the other. Positions don't change; the header's base says
+// which one the file now starts at.
+bool BlockStore::compactIndex()
+{
+    if (!flush())
+    {
+        return false;
+    }
+    size_t live = count - first;
+    string compacted(INDEX_HEADER_SIZE + live * sizeof(IndexRecord), '\0');
+    memcpy(&compacted[0], index_map, INDEX_HEADER_SIZE);
+    uint64_t new_base = first;
+    memcpy(&compacted[BASE_OFFSET], &new_base, sizeof(new_base));
+    if (live > 0)
+    {
+        memcpy(&compacted[INDEX_HEADER_SIZE], record(first), live * sizeof(IndexRecord));
+    }
+
+    string path = directory + "/index.dat";
+    string temp_path = path + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool written = write(fd, compacted.data(), compacted.size()) == (ssize_t)compacted.size() && fsync(fd) == 0;
+    ::close(fd);
+    if (!written || rename(temp_path.c_str(), path.c_str()) != 0)
+    {
+        cerr << "[STORE] Cannot compact " << path << endl;
+        return false;
+    }
+
+    munmap(index_map, INDEX_HEADER_SIZE + index_capacity * sizeof(IndexRecord));
+    index_map = nullptr;
+    index_capacity = 0;
+    ::close(index_fd);
+    base = first;
+    index_fd = ::open(path.c_str(), O_RDWR, 0644);
+    if (index_fd < 0 || !mapIndex(max<size_t>(live, 1)))
+    {
+        cerr << "[STORE] Cannot reopen " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+string_view BlockStore::blockData(size_t height)
+{
+    if (height < first || height >= count)
+    {
+        return string_view();
+    }
+    const IndexRecord* rec = record(height);
+    if (!openSegment(rec->segment))
+    {
+        return string_view();
+    }
+    Segment& seg = segments[rec->segment];
+    uint64_t end = rec->offset + RECORD_HEADER_SIZE + rec->length;
+    if (seg.fd < 0 || end > seg.size)
+    {
+        return string_view();
+    }
+
+    // Mapping (or re-mapping, once it has grown) the segment on demand
+    if (!seg.map || end > seg.map_size)
+    {
+        if (seg.map)
+        {
+            munmap(seg.map, seg.map_size);
+        }
+        seg.map = mmap(nullptr, seg.size, PROT_READ, MAP_SHARED, seg.fd, 0);
+        if (seg.map == MAP_FAILED)
+        {
+            seg.map = nullptr;
+            seg.map_size = 0;
+            return string_view();
+        }
+        seg.map_size = seg.size;
+    }
+    return string_view((const char*)seg.map + rec->offset + RECORD_HEADER_SIZE, rec->length);
+}
+
+long BlockStore::findHeight(const Hash256& hash) const
+{
+    auto it = by_hash.find(hash);
+    return it == by_hash.end() ? -1 : (long)it->second;
+}
+
+bool BlockStore::entry(size_t height, Entry& out) const
+{
+    if (height < first || height >= count)
+    {
+        return false;
+    }
+    const IndexRecord* rec = record(height);
+    out.index = rec->index;
+    out.timestamp = rec->timestamp;
+    out.previous_hash = Hash256::fromBytes(rec->previous_hash);
+    out.hash = Hash256::fromBytes(rec->hash);
+    out.merkle_root = Hash256::fromBytes(rec->merkle_root);
+    out.nonce = rec->nonce;
+    out.tx_count = rec->tx_count;
+    out.footprint = rec->footprint;
+    out.location = { rec->segment, rec->offset, rec->length, rec->checksum };
+    return true;
+}
+
+bool BlockStore::readBlock(const string& directory, const Location& location, string& data)
+{
+    int fd = ::open(segmentFile(directory, location.segment).c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    data.resize(location.length);
+    ssize_t n = pread(fd, &data[0], location.length, location.offset + RECORD_HEADER_SIZE);
+    ::close(fd);
+    return n == (ssize_t)location.length && payloadChecksum(data) == location.checksum;
+}
@@ -0,0 +1,159 @@
+#ifndef BLOCKSTORE_H
+#define BLOCKSTORE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <chrono>
+#include "blockchain.h"
+
+using namespace std;
+
+/* On-disk block store
+
+   Blocks are appended, binary encoded (see codec.h), to segment files
+   blk00000.dat, blk00001.dat, ... Each record is:
+
+     length u32 | checksum u32 (first 4 bytes of SHA-256) | encoded block
+
+   index.dat is a 64 byte header (magic, block count, first block still
+   on disk, height of the file's first record) followed by one fixed size
+   record per height: where the block is (segment, offset, length,
+   checksum) and its whole header (hashes, merkle root, timestamp, nonce,
+   transaction count). It is mmap'ed, so
+   the height -> location lookup is a pointer offset, the hash -> height
+   map is built from the mapped records on open, and the chain's headers
+   can be read back without touching the segments (see entry()).
+
+   Writes are batched: segment data and index records are written on every
+   append, but only fsync'ed (segments first, then the index, then the
+   header's block count) every [sync_every] blocks or [sync_interval].
+   After a crash the header count only covers blocks that were fully
+   synced, and anything past it is cut off on the next open.
+
+   Pruning deletes whole segment files from the front once every block in
+   them is below the pruning point, so a pruned store sizes its segments
+   from what it keeps (setSegmentLimit). Pruned blocks read as empty and
+   can't be found by hash. Once their index records outnumber the live
+   ones, index.dat is rewritten without them; heights stay the same.
+*/
+class BlockStore
+{
+public:
+    // Where a block's record is, enough to read it back with readBlock()
+    // even after the store itself has moved on
+    struct Location
+    {
+        uint32_t segment = 0;
+        uint64_t offset = 0;
+        uint32_t length = 0;
+        uint32_t checksum = 0;
+    };
+
+    // What the index keeps about one block
+    struct Entry
+    {
+        int64_t index = 0;
+        int64_t timestamp = 0;
+        Hash256 previous_hash;
+        Hash256 hash;
+        Merkle::Hash merkle_root;
+        uint64_t nonce = 0;
+        uint32_t tx_count = 0;
+        uint64_t footprint = 0; // Block::footprint()
+        Location location;
+    };
+
+    BlockStore();
+    ~BlockStore();
+
+    bool open(const string& directory);
+    void close();
+    bool isOpen() const { return index_fd >= 0; }
+
+    bool append(const Block& block);
+    // Dropping every block at [height] and above (used when the chain is
+    // replaced past a fork point)
+    bool truncate(size_t height);
+    // Forcing everything appended so far to disk
+    bool flush();
+    // Deleting the segments that only hold blocks below [height]
+    bool prune(size_t height);
+
+    size_t height() const { return count; }
+    // Lowest height whose block is still on disk
+    size_t firstHeight() const { return first; }
+    // Encoded block at [height], pointing into the mapped segment. Valid
+    // until the store is truncated or closed. Empty on a bad height.
+    string_view blockData(size_t height);
+    long findHeight(const Hash256& hash) const;
+    // The index record at [height], false on a bad height
+    bool entry(size_t height, Entry& out) const;
+    // Copying the encoded block at [location] out of [directory]'s
+    // segments. Safe from any thread; false if the segment is gone or the
+    // record there no longer matches its checksum.
+    static bool readBlock(const string& directory, const Location& location, string& data);
+
+    void setSyncPolicy(size_t every_blocks, chrono::milliseconds interval);
+    // Starting a new segment file once one would pass [bytes]. Kept
+    // between 1MB and 128MB (the default); applies to segments started
+    // from now on.
+    void setSegmentLimit(uint64_t bytes);
+
+private:
+    struct IndexRecord
+    {
+        unsigned char hash[32];
+        unsigned char previous_hash[32];
+        unsigned char merkle_root[32];
+        uint32_t segment;
+        uint32_t length;
+        uint64_t offset;
+        uint32_t checksum;
+        uint32_t tx_count;
+        uint64_t height;    // position in the store, not the block's index
+        int64_t index;
+        int64_t timestamp;
+        uint64_t nonce;
+        uint64_t footprint;
+    };
+
+    struct Segment
+    {
+        int fd = -1;
+        uint64_t size = 0;
+        void* map = nullptr;
+        size_t map_size = 0;
+    };
+
+    string segmentPath(uint32_t segment) const;
+    bool openSegment(uint32_t segment);
+    bool mapIndex(size_t records);
+    IndexRecord* record(size_t height) const;
+    bool writeCount(uint64_t new_count);
+    bool writeFirst(uint64_t new_first);
+    void dropSegment(uint32_t segment);
+    bool recover();
+    bool upgradeIndex(const string& path);
+    bool compactIndex();
+
+    string directory;
+    int index_fd;
+    void* index_map;
+    size_t index_capacity; // records the mapping has room for
+    size_t base;           // height of the first record in index.dat
+    size_t count;          // blocks in the store
+    size_t synced_count;   // blocks covered by the on-disk header
+    size_t first;          // blocks below this were pruned
+    vector<Segment> segments;
+    unordered_map<Hash256, size_t> by_hash;
+    uint64_t segment_limit;
+
+    size_t sync_every;
+    chrono::milliseconds sync_interval;
+    chrono::steady_clock::time_point last_sync;
+};
+
+#endif
@@ -0,0 +1,752 @@
+#include "codec.h"
+#include "compact.h"
+#include <cstring>
+#include <algorithm>
+
+namespace Codec
+{
+    /*Writing*/
+
+    static void putVarint(string& out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back((char)((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back((char)value);
+    }
+
+    static void putFixed64(string& out, uint64_t value)
+    {
+        char bytes[8];
+        for (int i = 0; i < 8; i++)
+        {
+            bytes[i] = (char)(value >> (8 * i));
+        }
+        out.append(bytes, 8);
+    }
+
+    static void putString(string& out, const string& value)
+    {
+        putVarint(out, value.size());
+        out.append(value);
+    }
+
+    static void putHash(string& out, const Hash256& hash)
+    {
+        out.append((const char*)hash.data(), hash.size());
+    }
+
+    static void putDouble(string& out, double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        putFixed64(out, bits);
+    }
+
+    // Nested records are encoded into a scratch string first so their
+    // length can be written ahead of them.
+    static void putRecord(string& out, string_view record)
+    {
+        putVarint(out, record.size());
+        out.append(record);
+    }
+
+    void encodeTransaction(const Transaction& tx, string& out)
+    {
+        out.push_back(TX_TAG);
+        out.push_back((char)VERSION);
+        putHash(out, tx.id);
+        putString(out, tx.sending_address);
+        putString(out, tx.receiving_address);
+        putDouble(out, tx.amount);
+        putFixed64(out, (uint64_t)(int64_t)tx.timestamp);
+        putString(out, tx.signature);
+        putString(out, tx.file_metadata);
+    }
+
+    void encodeBlock(const Block& block, string& out)
+    {
+        out.push_back(BLOCK_TAG);
+        out.push_back((char)VERSION);
+        putFixed64(out, (uint64_t)(int64_t)block.getIndex());
+        putFixed64(out, (uint64_t)(int64_t)block.getTimestamp());
+        putHash(out, block.getPreviousHash());
+        putFixed64(out, block.getNonce());
+        putHash(out, block.getHash());
+
+        const vector<Transaction>& transactions = block.getTransactions();
+        putVarint(out, transactions.size());
+        string record;
+        for (const auto& tx : transactions)
+        {
+            record.clear();
+            encodeTransaction(tx, record);
+            putRecord(out, record);
+        }
+    }
+
+    void encodeChain(const BlockList& chain, string& out)
+    {
+        out.push_back(CHAIN_TAG);
+        out.push_back((char)VERSION);
+        putVarint(out, chain.size());
+        string record;
+        for (const auto& block : chain)
+        {
+            record.clear();
+            encodeBlock(*block, record);
+            putRecord(out, record);
+        }
+    }
+
+    void encodeGetBlocks(const vector<Hash256>& locator, uint32_t max_blocks, string& out)
+    {
+        out.push_back(GET_BLOCKS_TAG);
+        out.push_back((char)VERSION);
+        putFixed64(out, max_blocks);
+        putVarint(out, locator.size());
+        for (const auto& hash : locator)
+        {
+            putHash(out, hash);
+        }
+    }
+
+    void encodeBlocksPage(uint64_t start_height, bool more, const vector<string>& encoded_blocks, string& out)
+    {
+        out.push_back(BLOCKS_PAGE_TAG);
+        out.push_back((char)VERSION);
+        putFixed64(out, start_height);
+        out.push_back(more ? 1 : 0);
+        putVarint(out, encoded_blocks.size());
+        for (const auto& block : encoded_blocks)
+        {
+            putRecord(out, block);
+        }
+    }
+
+    void encodeInventory(const vector<InventoryItem>& items, string& out)
+    {
+        out.push_back(INVENTORY_TAG);
+        out.push_back((char)VERSION);
+        putVarint(out, items.size());
+        for (const auto& item : items)
+        {
+            out.push_back((char)item.type);
+            putHash(out, item.hash);
+            putVarint(out, item.size);
+        }
+    }
+
+    static void putShortId(string& out, uint64_t short_id)
+    {
+        for (size_t i = 0; i < Compact::SHORT_ID_BYTES; i++)
+        {
+            out.push_back((char)(short_id >> (8 * i)));
+        }
+    }
+
+    // Mining rewards are prefilled; nobody but the miner has them
+    void encodeCompactBlock(const Block& block, uint64_t block_size, string& out)
+    {
+        out.push_back(COMPACT_BLOCK_TAG);
+        out.push_back((char)VERSION);
+        putFixed64(out, (uint64_t)(int64_t)block.getIndex());
+        putFixed64(out, (uint64_t)(int64_t)block.getTimestamp());
+        putHash(out, block.getPreviousHash());
+        putFixed64(out, block.getNonce());
+        putHash(out, block.getHash());
+        putVarint(out, block_size);
+
+        const vector<Transaction>& transactions = block.getTransactions();
+        vector<size_t> prefilled;
+        for (size_t i = 0; i < transactions.size(); i++)
+        {
+            if (transactions[i].sending_address == "0")
+            {
+                prefilled.push_back(i);
+            }
+        }
+        putVarint(out, transactions.size());
+        putVarint(out, transactions.size() - prefilled.size());
+
+        Compact::Key key = Compact::keyFor(block.getHash());
+        size_t next_prefilled = 0;
+        for (size_t i = 0; i < transactions.size(); i++)
+        {
+            if (next_prefilled < prefilled.size() && prefilled[next_prefilled] == i)
+            {
+                next_prefilled++;
+                continue;
+            }
+            putShortId(out, Compact::shortId(key, transactions[i].id));
+        }
+
+        putVarint(out, prefilled.size());
+        string record;
+        for (size_t position : prefilled)
+        {
+            putVarint(out, position);
+            record.clear();
+            encodeTransaction(transactions[position], record);
+            putRecord(out, record);
+        }
+    }
+
+    void encodeBlockTxnRequest(const Hash256& hash, const vector<uint32_t>& positions, string& out)
+    {
+        out.push_back(GET_BLOCK_TXN_TAG);
+        out.push_back((char)VERSION);
+        putHash(out, hash);
+        putVarint(out, positions.size());
+        for (uint32_t position : positions)
+        {
+            putVarint(out, position);
+        }
+    }
+
+    void encodeBlockTxn(const Hash256& hash, const vector<string_view>& encoded_txs, string& out)
+    {
+        out.push_back(BLOCK_TXN_TAG);
+        out.push_back((char)VERSION);
+        putHash(out, hash);
+        putVarint(out, encoded_txs.size());
+        for (const auto& tx : encoded_txs)
+        {
+            putRecord(out, tx);
+        }
+    }
+
+    void encodeChainState(const Block& tip, uint64_t work, const BalanceMap& balances, string& out)
+    {
+        out.push_back(STATE_TAG);
+        out.push_back((char)VERSION);
+        putFixed64(out, work);
+        string record;
+        encodeBlock(tip, record);
+        putRecord(out, record);
+
+        // Sorted, so the same state always gives the same file
+        vector<pair<string, double>> sorted(balances.begin(), balances.end());
+        sort(sorted.begin(), sorted.end());
+        putVarint(out, sorted.size());
+        for (const auto& entry : sorted)
+        {
+            putString(out, entry.first);
+            putDouble(out, entry.second);
+        }
+        putHash(out, Crypto::sha256Hash(out));
+    }
+
+    string encode(const Transaction& tx)
+    {
+        string out;
+        encodeTransaction(tx, out);
+        return out;
+    }
+
+    string encode(const Block& block)
+    {
+        string out;
+        encodeBlock(block, out);
+        return out;
+    }
+
+    /*Reading*/
+
+    // Bounds checked cursor over an encoded buffer. Any failed read leaves
+    // [ok] false and every read after that fails too.
+    struct Reader
+    {
+        string_view data;
+        size_t pos = 0;
+        bool ok = true;
+
+        explicit Reader(string_view input) : data(input) {}
+
+        bool need(size_t n)
+        {
+            if (!ok || data.size() - pos < n)
+            {
+                ok = false;
+            }
+            return ok;
+        }
+
+        uint8_t byte()
+        {
+            return need(1) ? (uint8_t)data[pos++] : 0;
+        }
+
+        uint64_t varint()
+        {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7)
+            {
+                uint8_t b = byte();
+                if (!ok)
+                {
+                    return 0;
+                }
+                value |= (uint64_t)(b & 0x7f) << shift;
+                if ((b & 0x80) == 0)
+                {
+                    return value;
+                }
+            }
+            ok = false;
+            return 0;
+        }
+
+        uint64_t fixed64()
+        {
+            if (!need(8))
+            {
+                return 0;
+            }
+            uint64_t value = 0;
+            for (int i = 0; i < 8; i++)
+            {
+                value |= (uint64_t)(uint8_t)data[pos + i] << (8 * i);
+            }
+            pos += 8;
+            return value;
+        }
+
+        double float64()
+        {
+            uint64_t bits = fixed64();
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+
+        Hash256 hash()
+        {
+            Hash256 value;
+            if (need(value.size()))
+            {
+                memcpy(value.data(), data.data() + pos, value.size());
+                pos += value.size();
+            }
+            return value;
+        }
+
+        string_view bytes()
+        {
+            uint64_t length = varint();
+            if (!need(length))
+            {
+                return string_view();
+            }
+            string_view value = data.substr(pos, length);
+            pos += length;
+            return value;
+        }
+
+        bool header(char tag)
+        {
+            return byte() == (uint8_t)tag && byte() == VERSION && ok;
+        }
+
+        bool done() const
+        {
+            return ok && pos == data.size();
+        }
+    };
+
+    static bool readTransaction(Reader& in, TransactionView& tx)
+    {
+        if (!in.header(TX_TAG))
+        {
+            return false;
+        }
+        tx.id = in.hash();
+        tx.sending_address = in.bytes();
+        tx.receiving_address = in.bytes();
+        tx.amount = in.float64();
+        tx.timestamp = (int64_t)in.fixed64();
+        tx.signature = in.bytes();
+        tx.file_metadata = in.bytes();
+        return in.ok;
+    }
+
+    bool decodeTransaction(string_view data, TransactionView& tx)
+    {
+        Reader in(data);
+        return readTransaction(in, tx) && in.done();
+    }
+
+    bool TransactionCursor::next(TransactionView& tx)
+    {
+        if (remaining == 0)
+        {
+            return false;
+        }
+        Reader in(data);
+        string_view record = in.bytes();
+        if (!in.ok || !decodeTransaction(record, tx))
+        {
+            remaining = 0;
+            return false;
+        }
+        data.remove_prefix(in.pos);
+        remaining--;
+        return true;
+    }
+
+    bool decodeBlock(string_view data, BlockView& block)
+    {
+        Reader in(data);
+        if (!in.header(BLOCK_TAG))
+        {
+            return false;
+        }
+        block.index = (int64_t)in.fixed64();
+        block.timestamp = (int64_t)in.fixed64();
+        block.previous_hash = in.hash();
+        block.nonce = in.fixed64();
+        block.hash = in.hash();
+        block.tx_count = in.varint();
+        if (!in.ok)
+        {
+            return false;
+        }
+
+        size_t tx_start = in.pos;
+        TransactionView tx;
+        for (uint64_t i = 0; i < block.tx_count; i++)
+        {
+            Reader record(in.bytes());
+            if (!in.ok || !readTransaction(record, tx) || !record.done())
+            {
+                return false;
+            }
+        }
+        if (!in.done())
+        {
+            return false;
+        }
+        block.tx_data = data.substr(tx_start);
+        return true;
+    }
+
+    bool BlockCursor::next(BlockView& block)
+    {
+        if (remaining == 0)
+        {
+            return false;
+        }
+        Reader in(data);
+        string_view record = in.bytes();
+        if (!in.ok || !decodeBlock(record, block))
+        {
+            remaining = 0;
+            return false;
+        }
+        data.remove_prefix(in.pos);
+        remaining--;
+        return true;
+    }
+
+    // Only the chain framing is checked here; each block is checked as the
+    // BlockCursor reaches it.
+    bool decodeChain(string_view data, ChainView& chain)
+    {
+        Reader in(data);
+        if (!in.header(CHAIN_TAG))
+        {
+            return false;
+        }
+        chain.block_count = in.varint();
+        if (!in.ok)
+        {
+            return false;
+        }
+        chain.block_data = data.substr(in.pos);
+        return true;
+    }
+
+    bool decodeGetBlocks(string_view data, GetBlocksView& request)
+    {
+        Reader in(data);
+        if (!in.header(GET_BLOCKS_TAG))
+        {
+            return false;
+        }
+        request.max_blocks = (uint32_t)in.fixed64();
+        uint64_t locator_count = in.varint();
+        // Every hash takes 32 bytes, so this also bounds the reserve
+        if (!in.ok || locator_count > (data.size() - in.pos) / Crypto::HASH_SIZE)
+        {
+            return false;
+        }
+        request.locator.clear();
+        request.locator.reserve(locator_count);
+        for (uint64_t i = 0; i < locator_count && in.ok; i++)
+        {
+            request.locator.push_back(in.hash());
+        }
+        return in.done();
+    }
+
+    // Only the page framing is checked here; each block is checked as the
+    // BlockCursor reaches it.
+    bool decodeBlocksPage(string_view data, BlocksPageView& page)
+    {
+        Reader in(data);
+        if (!in.header(BLOCKS_PAGE_TAG))
+        {
+            return false;
+        }
+        page.start_height = in.fixed64();
+        page.more = in.byte() != 0;
+        page.block_count = in.varint();
+        if (!in.ok)
+        {
+            return false;
+        }
+        page.block_data = data.substr(in.pos);
+        return true;
+    }
+
+    bool decodeInventory(string_view data, vector<InventoryItem>& items)
+    {
+        Reader in(data);
+        if (!in.header(INVENTORY_TAG))
+        {
+            return false;
+        }
+        uint64_t count = in.varint();
+        // Every item takes at least 34 bytes, so this also bounds the reserve
+        if (!in.ok || count > (data.size() - in.pos) / (Crypto::HASH_SIZE + 2))
+        {
+            return false;
+        }
+        items.clear();
+        items.reserve(count);
+        for (uint64_t i = 0; i < count && in.ok; i++)
+        {
+            InventoryItem item;
+            uint8_t type = in.byte();
+            if (type < (uint8_t)InventoryType::Tx || type > (uint8_t)InventoryType::CompactBlock)
+            {
+                return false;
+            }
+            item.type = (InventoryType)type;
+            item.hash = in.hash();
+            item.size = in.varint();
+            items.push_back(item);
+        }
+        return in.done();
+    }
+
+    bool decodeCompactBlock(string_view data, CompactBlockView& compact)
+    {
+        Reader in(data);
+        if (!in.header(COMPACT_BLOCK_TAG))
+        {
+            return false;
+        }
+        compact.index = (int64_t)in.fixed64();
+        compact.timestamp = (int64_t)in.fixed64();
+        compact.previous_hash = in.hash();
+        compact.nonce = in.fixed64();
+        compact.hash = in.hash();
+        compact.block_size = in.varint();
+        compact.tx_count = in.varint();
+        compact.short_id_count = in.varint();
+        if (!in.ok || compact.short_id_count > (data.size() - in.pos) / Compact::SHORT_ID_BYTES)
+        {
+            return false;
+        }
+        size_t short_bytes = compact.short_id_count * Compact::SHORT_ID_BYTES;
+        compact.short_ids = data.substr(in.pos, short_bytes);
+        in.pos += short_bytes;
+
+        uint64_t prefilled_count = in.varint();
+        // Each position and prefilled record take at least 2 bytes, which
+        // also bounds tx_count (and so the receiver's allocations)
+        if (!in.ok || prefilled_count > (data.size() - in.pos) / 2
+            || compact.tx_count != compact.short_id_count + prefilled_count)
+        {
+            return false;
+        }
+        compact.prefilled.clear();
+        compact.prefilled.reserve(prefilled_count);
+        for (uint64_t i = 0; i < prefilled_count; i++)
+        {
+            uint64_t position = in.varint();
+            string_view record = in.bytes();
+            TransactionView tx;
+            if (!in.ok || position >= compact.tx_count || !decodeTransaction(record, tx)
+                || (!compact.prefilled.empty() && position <= compact.prefilled.back().first))
+            {
+                return false;
+            }
+            compact.prefilled.emplace_back(position, tx);
+        }
+        return in.done();
+    }
+
+    uint64_t CompactBlockView::shortId(size_t i) const
+    {
+        uint64_t value = 0;
+        for (size_t b = 0; b < Compact::SHORT_ID_BYTES; b++)
+        {
+            value |= (uint64_t)(uint8_t)short_ids[i * Compact::SHORT_ID_BYTES + b] << (8 * b);
+        }
+        return value;
+    }
+
+    bool decodeBlockTxnRequest(string_view data, BlockTxnRequestView& request)
+    {
+        Reader in(data);
+        if (!in.header(GET_BLOCK_TXN_TAG))
+        {
+            return false;
+        }
+        request.hash = in.hash();
+        uint64_t count = in.varint();
+        // Every position takes at least a byte
+        if (!in.ok || count > data.size() - in.pos)
+        {
+            return false;
+        }
+        request.positions.clear();
+        request.positions.reserve(count);
+        for (uint64_t i = 0; i < count && in.ok; i++)
+        {
+            uint64_t position = in.varint();
+            if (position > UINT32_MAX)
+            {
+                return false;
+            }
+            request.positions.push_back((uint32_t)position);
+        }
+        return in.done();
+    }
+
+    bool decodeBlockTxn(string_view data, BlockTxnView& txn)
+    {
+        Reader in(data);
+        if (!in.header(BLOCK_TXN_TAG))
+        {
+            return false;
+        }
+        txn.hash = in.hash();
+        txn.tx_count = in.varint();
+        if (!in.ok)
+        {
+            return false;
+        }
+        txn.tx_data = data.substr(in.pos);
+        return true;
+    }
+
+    bool decodeChainState(string_view data, ChainStateView& state)
+    {
+        if (data.size() < Crypto::HASH_SIZE)
+        {
+            return false;
+        }
+        string_view body = data.substr(0, data.size() - Crypto::HASH_SIZE);
+        if (Crypto::sha256Hash(body) != Hash256::fromBytes(data.data() + body.size()))
+        {
+            return false;
+        }
+
+        Reader in(body);
+        if (!in.header(STATE_TAG))
+        {
+            return false;
+        }
+        state.work = in.fixed64();
+        string_view tip = in.bytes();
+        uint64_t count = in.varint();
+        // Every entry takes at least 9 bytes, so this also bounds the reserve
+        if (!in.ok || !decodeBlock(tip, state.tip) || count > (body.size() - in.pos) / 9)
+        {
+            return false;
+        }
+        state.balances.clear();
+        state.balances.reserve(count);
+        for (uint64_t i = 0; i < count && in.ok; i++)
+        {
+            string_view address = in.bytes();
+            double amount = in.float64();
+            state.balances.emplace_back(address, amount);
+        }
+        return in.done();
+    }
+
+    bool splitTransactions(const BlockView& block, vector<string_view>& encoded_txs)
+    {
+        Reader in(block.tx_data);
+        encoded_txs.clear();
+        encoded_txs.reserve(block.tx_count);
+        for (uint64_t i = 0; i < block.tx_count && in.ok; i++)
+        {
+            encoded_txs.push_back(in.bytes());
+        }
+        return in.done();
+    }
+
+    // All of them sit right after the record header and, for a block, the fixed
+    // width index, timestamp, previous hash and nonce
+    static bool peekHash(string_view data, char tag, size_t offset, Hash256& out)
+    {
+        Reader in(data);
+        if (!in.header(tag) || !in.need(offset + Crypto::HASH_SIZE))
+        {
+            return false;
+        }
+        out = Hash256::fromBytes(data.data() + in.pos + offset);
+        return true;
+    }
+
+    bool peekTransactionId(string_view data, Hash256& id)
+    {
+        return peekHash(data, TX_TAG, 0, id);
+    }
+
+    bool peekBlockHash(string_view data, Hash256& hash)
+    {
+        return peekHash(data, BLOCK_TAG, 8 + 8 + Crypto::HASH_SIZE + 8, hash);
+    }
+
+    // Compact blocks share the block's header layout
+    bool peekCompactBlockHash(string_view data, Hash256& hash)
+    {
+        return peekHash(data, COMPACT_BLOCK_TAG, 8 + 8 + Crypto::HASH_SIZE + 8, hash);
+    }
+
+    /*Materialising*/
+
+    Transaction TransactionView::toTransaction() const
+    {
+        Transaction tx;
+        tx.id = id;
+        tx.sending_address = string(sending_address);
+        tx.receiving_address = string(receiving_address);
+        tx.amount = amount;
+        tx.timestamp = (time_t)timestamp;
+        tx.signature = string(signature);
+        tx.file_metadata = string(file_metadata);
+        return tx;
+    }
+
+    Block BlockView::toBlock() const
+    {
+        vector<Transaction> txs;
+        txs.reserve(tx_count);
+        TransactionCursor cursor = transactions();
+        TransactionView tx;
+        while (cursor.next(tx))
+        {
+            txs.push_back(tx.toTransaction());
+        }
+        return Block((int)index, (time_t)timestamp, move(txs), previous_hash, nonce, hash);
+    }
+}
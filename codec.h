@@ -0,0 +1,250 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include "blockchain.h"
+
+using namespace std;
+
+/* Binary encoding for transactions, blocks and whole chains
+
+   Every record starts with a one byte tag and a one byte format version.
+   Integers are fixed width little endian, [amount] is the raw IEEE-754
+   bits (so it round-trips exactly), hashes are their 32 raw bytes, and
+   every string and nested record is prefixed with its length as a LEB128
+   varint. Nothing is delimiter based, so any byte may appear in any field.
+
+     transaction: 'T' v | id h256 | sender | receiver | amount f64 | timestamp i64
+                  | signature | file_metadata
+     block:       'B' v | index i64 | timestamp i64 | previous_hash h256 | nonce u64
+                  | hash h256 | tx_count | (len, transaction) * tx_count
+     chain:       'C' v | block_count | (len, block) * block_count
+
+   Chain sync messages:
+
+     get_blocks:  'G' v | max_blocks u64 | locator_count | h256 * locator_count
+     blocks:      'P' v | start_height u64 | more u8 | block_count
+                  | (len, block) * block_count
+
+   Gossip (the same payload announces items in an inv and asks for them
+   in a getdata; [size] is the encoded size of the item, 0 in a getdata):
+
+     inventory:   'I' v | item_count | (type u8 | h256 | size) * item_count
+
+   Compact blocks (see compact.h). Short ids fill the positions that
+   aren't prefilled, in block order; prefilled positions only go up.
+
+     cmpctblock:  'K' v | index i64 | timestamp i64 | previous_hash h256 | nonce u64
+                  | hash h256 | block_size | tx_count | short_id_count
+                  | short_id 6 bytes * short_id_count
+                  | prefilled_count | (position | len, transaction) * prefilled_count
+     getblocktxn: 'Q' v | hash h256 | count | position * count
+     blocktxn:    'R' v | hash h256 | tx_count | (len, transaction) * tx_count
+
+   State snapshot (a chain's tip block and the balances right after it,
+   addresses in byte order; [checksum] is SHA-256 of everything before it):
+
+     state:       'S' v | work u64 | (len, tip block) | balance_count
+                  | (address | amount f64) * balance_count | checksum h256
+
+   Decoding produces views: the string fields point straight into the
+   received buffer, so nothing is copied until a view is turned into a
+   Transaction/Block. A view is only valid while that buffer is alive.
+*/
+namespace Codec
+{
+    // 2: hashes went from 64 hex characters to 32 raw bytes
+    const uint8_t VERSION = 2;
+    const char TX_TAG = 'T';
+    const char BLOCK_TAG = 'B';
+    const char CHAIN_TAG = 'C';
+    const char GET_BLOCKS_TAG = 'G';
+    const char BLOCKS_PAGE_TAG = 'P';
+    const char INVENTORY_TAG = 'I';
+    const char COMPACT_BLOCK_TAG = 'K';
+    const char GET_BLOCK_TXN_TAG = 'Q';
+    const char BLOCK_TXN_TAG = 'R';
+    const char STATE_TAG = 'S';
+
+    struct TransactionView
+    {
+        Hash256 id;
+        string_view sending_address;
+        string_view receiving_address;
+        double amount = 0.0;
+        int64_t timestamp = 0;
+        string_view signature;
+        string_view file_metadata;
+
+        Transaction toTransaction() const;
+    };
+
+    // Walks the transactions of a block (or the blocks of a chain) one at
+    // a time without building a vector of them first.
+    class TransactionCursor
+    {
+    public:
+        TransactionCursor(string_view data, uint64_t count) : data(data), remaining(count) {}
+        // False once there are no more transactions or the data is malformed
+        bool next(TransactionView& tx);
+    private:
+        string_view data;
+        uint64_t remaining;
+    };
+
+    struct BlockView
+    {
+        int64_t index = 0;
+        int64_t timestamp = 0;
+        Hash256 previous_hash;
+        uint64_t nonce = 0;
+        Hash256 hash;
+        uint64_t tx_count = 0;
+        string_view tx_data; // the encoded transactions, back to back
+
+        TransactionCursor transactions() const { return TransactionCursor(tx_data, tx_count); }
+        Block toBlock() const;
+    };
+
+    class BlockCursor
+    {
+    public:
+        BlockCursor(string_view data, uint64_t count) : data(data), remaining(count) {}
+        bool next(BlockView& block);
+    private:
+        string_view data;
+        uint64_t remaining;
+    };
+
+    struct ChainView
+    {
+        uint64_t block_count = 0;
+        string_view block_data;
+
+        BlockCursor blocks() const { return BlockCursor(block_data, block_count); }
+    };
+
+    // A request for the blocks after the first [locator] hash the peer
+    // has on its chain. Locators run from newest to oldest.
+    struct GetBlocksView
+    {
+        uint32_t max_blocks = 0;
+        vector<Hash256> locator;
+    };
+
+    // One page of consecutive blocks, the first at [start_height].
+    // [more] means the sender has blocks past this page.
+    struct BlocksPageView
+    {
+        uint64_t start_height = 0;
+        bool more = false;
+        uint64_t block_count = 0;
+        string_view block_data;
+
+        BlockCursor blocks() const { return BlockCursor(block_data, block_count); }
+    };
+
+    struct ChainStateView
+    {
+        uint64_t work = 0;   // cumulative work up to and including the tip
+        BlockView tip;
+        vector<pair<string_view, double>> balances;
+    };
+
+    enum class InventoryType : uint8_t
+    {
+        Tx = 1,
+        Block = 2,
+        CompactBlock = 3, // only in a getdata: send the block as a cmpctblock
+    };
+
+    struct InventoryItem
+    {
+        InventoryType type = InventoryType::Tx;
+        Hash256 hash;
+        uint64_t size = 0;
+    };
+
+    struct CompactBlockView
+    {
+        int64_t index = 0;
+        int64_t timestamp = 0;
+        Hash256 previous_hash;
+        uint64_t nonce = 0;
+        Hash256 hash;
+        uint64_t block_size = 0;     // encoded size of the full block
+        uint64_t tx_count = 0;
+        uint64_t short_id_count = 0;
+        string_view short_ids;       // SHORT_ID_BYTES each, back to back
+        vector<pair<uint64_t, TransactionView>> prefilled; // (position, transaction)
+
+        uint64_t shortId(size_t i) const;
+    };
+
+    // A compact block's receiver asking for the transactions at
+    // [positions] of the block
+    struct BlockTxnRequestView
+    {
+        Hash256 hash;
+        vector<uint32_t> positions;
+    };
+
+    struct BlockTxnView
+    {
+        Hash256 hash;
+        uint64_t tx_count = 0;
+        string_view tx_data;
+
+        TransactionCursor transactions() const { return TransactionCursor(tx_data, tx_count); }
+    };
+
+    void encodeTransaction(const Transaction& tx, string& out);
+    void encodeBlock(const Block& block, string& out);
+    void encodeChain(const BlockList& chain, string& out);
+
+    void encodeGetBlocks(const vector<Hash256>& locator, uint32_t max_blocks, string& out);
+    // [encoded_blocks] are already encoded with encodeBlock
+    void encodeBlocksPage(uint64_t start_height, bool more, const vector<string>& encoded_blocks, string& out);
+    void encodeInventory(const vector<InventoryItem>& items, string& out);
+    // [block_size] is the block's encodeBlock size, for the receiver's stats
+    void encodeCompactBlock(const Block& block, uint64_t block_size, string& out);
+    void encodeBlockTxnRequest(const Hash256& hash, const vector<uint32_t>& positions, string& out);
+    // [encoded_txs] are already encoded with encodeTransaction
+    void encodeBlockTxn(const Hash256& hash, const vector<string_view>& encoded_txs, string& out);
+    void encodeChainState(const Block& tip, uint64_t work, const BalanceMap& balances, string& out);
+
+    string encode(const Transaction& tx);
+    string encode(const Block& block);
+
+    // All decoders return false on truncated or malformed input. Decoding a
+    // block checks the framing of every transaction in it up front.
+    bool decodeTransaction(string_view data, TransactionView& tx);
+    bool decodeBlock(string_view data, BlockView& block);
+    bool decodeChain(string_view data, ChainView& chain);
+    bool decodeGetBlocks(string_view data, GetBlocksView& request);
+    bool decodeBlocksPage(string_view data, BlocksPageView& page);
+    bool decodeInventory(string_view data, vector<InventoryItem>& items);
+    bool decodeCompactBlock(string_view data, CompactBlockView& compact);
+    bool decodeBlockTxnRequest(string_view data, BlockTxnRequestView& request);
+    // Only the framing is checked here; each transaction is checked as the
+    // TransactionCursor reaches it.
+    bool decodeBlockTxn(string_view data, BlockTxnView& txn);
+    // Also false if the checksum doesn't match
+    bool decodeChainState(string_view data, ChainStateView& state);
+
+    // The encoded transactions of a decoded block, one per entry, pointing
+    // into the block's buffer
+    bool splitTransactions(const BlockView& block, vector<string_view>& encoded_txs);
+
+    // The id of an encoded transaction / hash of an encoded block, read
+    // from its fixed position without decoding anything else
+    bool peekTransactionId(string_view data, Hash256& id);
+    bool peekBlockHash(string_view data, Hash256& hash);
+    bool peekCompactBlockHash(string_view data, Hash256& hash);
+}
+
+#endif
@@ -0,0 +1,127 @@
+#include "compact.h"
+#include "codec.h"
+
+namespace Compact
+{
+    static uint64_t readLE64(const unsigned char* p)
+    {
+        uint64_t value = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            value |= (uint64_t)p[i] << (8 * i);
+        }
+        return value;
+    }
+
+    Key keyFor(const Hash256& block_hash)
+    {
+        Key key;
+        key.k0 = readLE64(block_hash.data());
+        key.k1 = readLE64(block_hash.data() + 8);
+        return key;
+    }
+
+    // Cut to the 48 bits that go on the wire
+    uint64_t shortId(const Key& key, const Hash256& tx_id)
+    {
+        return Crypto::sipHash(key, tx_id) & 0xffffffffffffULL;
+    }
+
+    bool PartialBlock::init(const Codec::CompactBlockView& compact)
+    {
+        index = compact.index;
+        timestamp = compact.timestamp;
+        previous_hash = compact.previous_hash;
+        nonce = compact.nonce;
+        block_hash = compact.hash;
+        block_size = compact.block_size;
+        key = keyFor(block_hash);
+
+        // The decoder has already checked the counts add up
+        size_t count = (size_t)compact.tx_count;
+        slots.assign(count, Transaction());
+        filled.assign(count, false);
+        short_ids.assign(count, 0);
+        slot_of.clear();
+        slot_of.reserve((size_t)compact.short_id_count);
+
+        size_t next_prefilled = 0;
+        size_t next_short = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (next_prefilled < compact.prefilled.size() && compact.prefilled[next_prefilled].first == i)
+            {
+                slots[i] = compact.prefilled[next_prefilled].second.toTransaction();
+                filled[i] = true;
+                next_prefilled++;
+                continue;
+            }
+            short_ids[i] = compact.shortId(next_short++);
+            if (!slot_of.emplace(short_ids[i], (uint32_t)i).second)
+            {
+                return false;
+            }
+        }
+        missing_count = slot_of.size();
+        return next_prefilled == compact.prefilled.size() && next_short == compact.short_id_count;
+    }
+
+    void PartialBlock::offer(const Transaction& tx)
+    {
+        if (missing_count == 0)
+        {
+            return;
+        }
+        auto it = slot_of.find(shortId(key, tx.id));
+        if (it == slot_of.end() || filled[it->second])
+        {
+            return;
+        }
+        slots[it->second] = tx;
+        filled[it->second] = true;
+        missing_count--;
+    }
+
+    vector<uint32_t> PartialBlock::missing() const
+    {
+        vector<uint32_t> positions;
+        positions.reserve(missing_count);
+        for (size_t i = 0; i < filled.size(); i++)
+        {
+            if (!filled[i])
+            {
+                positions.push_back((uint32_t)i);
+            }
+        }
+        return positions;
+    }
+
+    bool PartialBlock::fill(const vector<Transaction>& txs)
+    {
+        vector<uint32_t> positions = missing();
+        if (txs.size() != positions.size())
+        {
+            return false;
+        }
+        for (size_t i = 0; i < txs.size(); i++)
+        {
+            if (shortId(key, txs[i].id) != short_ids[positions[i]])
+            {
+                return false;
+            }
+        }
+        for (size_t i = 0; i < txs.size(); i++)
+        {
+            slots[positions[i]] = txs[i];
+            filled[positions[i]] = true;
+        }
+        missing_count = 0;
+        return true;
+    }
+
+    Block PartialBlock::build()
+    {
+        missing_count = 0;
+        return Block((int)index, (time_t)timestamp, move(slots), previous_hash, nonce, block_hash);
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include "crypto.h"
+#include "blockchain.h"
+
+using namespace std;
+
+namespace Codec
+{
+    struct CompactBlockView;
+}
+
+/* Compact block relay
+
+   A compact block is a block's header fields plus a 6 byte short id for
+   each transaction. Peers usually have nearly all of a new block's
+   transactions in their mempool already, so the receiver rebuilds the
+   block from its own pool and only asks for the few it is missing
+   (getblocktxn / blocktxn). The mining reward, which nobody else can have,
+   is sent in full ("prefilled").
+
+   Short ids are SipHash-2-4 of the transaction id, keyed with the block
+   hash and cut to 48 bits. The key isn't known until the block is mined,
+   so nobody can grind transactions whose short ids collide ahead of time.
+   A collision that happens anyway only costs a fallback to the full block.
+*/
+namespace Compact
+{
+    const size_t SHORT_ID_BYTES = 6;
+
+    using Key = Crypto::SipKey;
+
+    Key keyFor(const Hash256& block_hash);
+    uint64_t shortId(const Key& key, const Hash256& tx_id);
+
+    // A block being rebuilt from a compact block
+    class PartialBlock
+    {
+    public:
+        // False if the compact block can't be rebuilt this way (malformed,
+        // or two of its transactions share a short id); ask for the full
+        // block instead
+        bool init(const Codec::CompactBlockView& compact);
+
+        // Taking [tx] if it is one of the transactions still missing
+        void offer(const Transaction& tx);
+
+        bool complete() const { return missing_count == 0; }
+        // Positions in the block of the transactions still missing
+        vector<uint32_t> missing() const;
+        // Filling the missing() positions, in order. False if [txs] doesn't
+        // line up with them.
+        bool fill(const vector<Transaction>& txs);
+        // Handing the transactions over to the rebuilt block
+        Block build();
+
+        const Hash256& hash() const { return block_hash; }
+        uint64_t blockSize() const { return block_size; }
+        size_t transactionCount() const { return slots.size(); }
+
+    private:
+        int64_t index = 0;
+        int64_t timestamp = 0;
+        Hash256 previous_hash;
+        uint64_t nonce = 0;
+        Hash256 block_hash;
+        uint64_t block_size = 0;
+        Key key;
+
+        vector<Transaction> slots;
+        vector<bool> filled;
+        vector<uint64_t> short_ids;                  // per slot, unused for prefilled ones
+        unordered_map<uint64_t, uint32_t> slot_of;   // short id -> slot, missing ones only
+        size_t missing_count = 0;
+    };
+}
+
+#endif
@@ -3,58 +3,276 @@
 #include <openssl/pem.h>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/encoder.h>
+#include <openssl/decoder.h>
 #include <sstream>
 #include <iomanip>
 #include <fstream>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+
+/*Signature schemes*/
+
+// Reading everything written to a memory BIO back out as a string
+static string bioToString(BIO* bio)
+{
+    char* data;
+    long length = BIO_get_mem_data(bio, &data);
+    return string(data, length);
+}
 
-Wallet::Wallet() : rsa_key(nullptr) {}
+string SignatureScheme::sign(EVP_PKEY* signing_key, string_view data) const
+{
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    if (!ctx)
+    {
+        return "";
+    }
 
-//Getting an error about RSA being deprecated.
-Wallet::~Wallet()
+    string signature;
+    size_t sig_len = 0;
+    if (EVP_DigestSignInit(ctx, nullptr, digest(), nullptr, signing_key) == 1
+        && EVP_DigestSign(ctx, nullptr, &sig_len, (const unsigned char*)data.data(), data.size()) == 1)
+    {
+        vector<unsigned char> sig(sig_len);
+        if (EVP_DigestSign(ctx, sig.data(), &sig_len, (const unsigned char*)data.data(), data.size()) == 1)
+        {
+            signature = Crypto::base64_encode(sig.data(), sig_len);
+        }
+    }
+    EVP_MD_CTX_free(ctx);
+    return signature;
+}
+
+bool SignatureScheme::verify(EVP_PKEY* public_key, string_view data, const vector<unsigned char>& signature) const
 {
-    if (rsa_key)
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    if (!ctx)
     {
-        RSA_free(rsa_key);
+        return false;
     }
+    bool result = EVP_DigestVerifyInit(ctx, nullptr, digest(), nullptr, public_key) == 1
+        && EVP_DigestVerify(ctx, signature.data(), signature.size(), 
+                            (const unsigned char*)data.data(), data.size()) == 1;
+    EVP_MD_CTX_free(ctx);
+    return result;
 }
-    /*Generating a new 2048-bit RSA public/private key pair.*/
-bool Wallet::generateKeys()
+
+namespace
 {
-    BIGNUM * bne = BN_new(); // Creating a really big number
+    EVP_PKEY* generateWith(int id, int rsa_bits)
+    {
+        EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(id, nullptr);
+        EVP_PKEY* generated = nullptr;
+        if (ctx && EVP_PKEY_keygen_init(ctx) == 1
+            && (rsa_bits == 0 || EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, rsa_bits) == 1))
+        {
+            EVP_PKEY_keygen(ctx, &generated);
+        }
+        EVP_PKEY_CTX_free(ctx);
+        return generated;
+    }
 
-    if (!bne || !BN_set_word(bne, RSA_F4))
+    class RsaScheme : public SignatureScheme
     {
-        BN_free(bne);
-        return false;
+    public:
+        KeyType type() const override { return KeyType::RSA2048; }
+        const char* name() const override { return "rsa"; }
+        const EVP_MD* digest() const override { return EVP_sha256(); }
+
+        EVP_PKEY* generate() const override
+        {
+            return generateWith(EVP_PKEY_RSA, 2048);
+        }
+
+        // Same PKCS#1 PEM text older wallets put on the chain: the
+        // "type-specific" structure of an RSA public key is PKCS#1
+        string encodePublicKey(EVP_PKEY* public_key) const override
+        {
+            OSSL_ENCODER_CTX* ctx = OSSL_ENCODER_CTX_new_for_pkey(
+                public_key, OSSL_KEYMGMT_SELECT_PUBLIC_KEY, "PEM", "type-specific", nullptr);
+            BIO* bio = BIO_new(BIO_s_mem());
+            string encoded;
+            if (ctx && bio && OSSL_ENCODER_CTX_get_num_encoders(ctx) > 0 && OSSL_ENCODER_to_bio(ctx, bio) == 1)
+            {
+                encoded = bioToString(bio);
+            }
+            BIO_free_all(bio);
+            OSSL_ENCODER_CTX_free(ctx);
+            return encoded;
+        }
+
+        EVP_PKEY* decodePublicKey(const string& encoded) const override
+        {
+            EVP_PKEY* decoded = nullptr;
+            OSSL_DECODER_CTX* ctx = OSSL_DECODER_CTX_new_for_pkey(
+                &decoded, "PEM", "type-specific", "RSA", OSSL_KEYMGMT_SELECT_PUBLIC_KEY, nullptr, nullptr);
+            BIO* bio = BIO_new_mem_buf(encoded.data(), (int)encoded.size());
+            if (!ctx || !bio || OSSL_DECODER_from_bio(ctx, bio) != 1)
+            {
+                EVP_PKEY_free(decoded);
+                decoded = nullptr;
+            }
+            BIO_free(bio);
+            OSSL_DECODER_CTX_free(ctx);
+            return decoded;
+        }
+
+        bool recognises(const string& encoded) const override
+        {
+            return encoded.rfind("-----BEGIN RSA PUBLIC KEY-----", 0) == 0;
+        }
+    };
+
+    class Ed25519Scheme : public SignatureScheme
+    {
+    public:
+        KeyType type() const override { return KeyType::Ed25519; }
+        const char* name() const override { return "ed25519"; }
+        const EVP_MD* digest() const override { return nullptr; }
+
+        EVP_PKEY* generate() const override
+        {
+            return generateWith(EVP_PKEY_ED25519, 0);
+        }
+
+        string encodePublicKey(EVP_PKEY* public_key) const override
+        {
+            unsigned char raw[32];
+            size_t raw_len = sizeof(raw);
+            if (EVP_PKEY_get_raw_public_key(public_key, raw, &raw_len) != 1)
+            {
+                return "";
+            }
+            return PREFIX + Crypto::base64_encode(raw, raw_len);
+        }
+
+        EVP_PKEY* decodePublicKey(const string& encoded) const override
+        {
+            if (!recognises(encoded))
+            {
+                return nullptr;
+            }
+            vector<unsigned char> raw = Crypto::base64_decode(encoded.substr(PREFIX.size()));
+            if (raw.size() != 32)
+            {
+                return nullptr;
+            }
+            return EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, nullptr, raw.data(), raw.size());
+        }
+
+        bool recognises(const string& encoded) const override
+        {
+            return encoded.rfind(PREFIX, 0) == 0;
+        }
+
+    private:
+        const string PREFIX = "ed25519:";
+    };
+
+    const RsaScheme rsa_scheme;
+    const Ed25519Scheme ed25519_scheme;
+    const SignatureScheme* const all_schemes[] = { &ed25519_scheme, &rsa_scheme };
+}
+
+const SignatureScheme& SignatureScheme::forType(KeyType type)
+{
+    if (type == KeyType::RSA2048)
+    {
+        return rsa_scheme;
+    }
+    return ed25519_scheme;
+}
+
+const SignatureScheme* SignatureScheme::forPublicKey(const string& encoded)
+{
+    for (const SignatureScheme* candidate : all_schemes)
+    {
+        if (candidate->recognises(encoded))
+        {
+            return candidate;
+        }
+    }
+    return nullptr;
+}
+
+const SignatureScheme* SignatureScheme::byName(const string& scheme_name)
+{
+    for (const SignatureScheme* candidate : all_schemes)
+    {
+        if (scheme_name == candidate->name())
+        {
+            return candidate;
+        }
     }
+    return nullptr;
+}
+
+/*Wallet*/
+
+Wallet::Wallet() : key(nullptr), scheme(nullptr) {}
 
-    /*Creating a new RSA key structure*/
-    rsa_key = RSA_new();
+Wallet::~Wallet()
+{
+    EVP_PKEY_free(key);
+}
 
-    if (!rsa_key || !RSA_generate_key_ex(rsa_key, 2048, bne, nullptr))
-    { 
-        RSA_free(rsa_key);
+// Taking ownership of a private key and deriving the public key and address
+bool Wallet::setKey(EVP_PKEY* new_key)
+{
+    const SignatureScheme* new_scheme = nullptr;
+    if (new_key)
+    {
+        int id = EVP_PKEY_base_id(new_key);
+        if (id == EVP_PKEY_RSA)
+        {
+            new_scheme = &SignatureScheme::forType(KeyType::RSA2048);
+        }
+        else if (id == EVP_PKEY_ED25519)
+        {
+            new_scheme = &SignatureScheme::forType(KeyType::Ed25519);
+        }
+    }
+    if (!new_scheme)
+    {
+        EVP_PKEY_free(new_key);
         return false;
     }
 
-    BN_free(bne); // freeing the exponent
+    EVP_PKEY_free(key);
+    key = new_key;
+    scheme = new_scheme;
+    public_key_str = scheme->encodePublicKey(key);
+    address = Crypto::sha256(public_key_str);
+    return true;
+}
 
-    /*Extracting a public key to a string*/
-    BIO* bio_public = BIO_new(BIO_s_mem());
-    PEM_write_bio_RSAPublicKey(bio_public, rsa_key);
-    char* public_key_c;
-    long public_key_len = BIO_get_mem_data(bio_public, &public_key_c);
-    public_key_str.assign(public_key_c, public_key_len);
-    BIO_free_all(bio_public);
+    /*Generating a new key pair for the chosen signature scheme.*/
+bool Wallet::generateKeys(KeyType type)
+{
+    if (!setKey(SignatureScheme::forType(type).generate()))
+    {
+        return false;
+    }
 
+    // RSA keys keep the traditional "RSA PRIVATE KEY" file format
     BIO* bio_private = BIO_new(BIO_s_mem());
-    PEM_write_bio_RSAPrivateKey(bio_private, rsa_key, NULL, NULL, 0, NULL, NULL);
-    char* private_key_c;
-    long priv_key_len = BIO_get_mem_data(bio_private, &private_key_c);
-    private_key_str.assign(private_key_c, priv_key_len);
+    if (type == KeyType::RSA2048)
+    {
+        PEM_write_bio_PrivateKey_traditional(bio_private, key, NULL, NULL, 0, NULL, NULL);
+    }
+    else
+    {
+        PEM_write_bio_PrivateKey(bio_private, key, NULL, NULL, 0, NULL, NULL);
+    }
+    private_key_str = bioToString(bio_private);
     BIO_free_all(bio_private);
-
-    address = Crypto::sha256(public_key_str);
     return true;
 }
 
@@ -73,6 +291,8 @@ bool Wallet::saveToFile(const std::string& filename)
     return true;
 }
 
+// Loading any private key PEM we know how to use, including the
+// "RSA PRIVATE KEY" files older versions wrote
 bool Wallet::loadFromFile(const string& filename)
 {
     ifstream file(filename);
@@ -83,36 +303,22 @@ bool Wallet::loadFromFile(const string& filename)
 
     stringstream buffer;
     buffer << file.rdbuf();
-    private_key_str = buffer.str();
+    string loaded_key_str = buffer.str();
     file.close();
 
-    BIO* bio = BIO_new_mem_buf(private_key_str.c_str(), -1);
+    BIO* bio = BIO_new_mem_buf(loaded_key_str.c_str(), -1);
     if (!bio)
     {
         return false;
     }
-
-    if (rsa_key)
-    {
-        RSA_free(rsa_key);
-    }
-    rsa_key = PEM_read_bio_RSAPrivateKey(bio, nullptr, nullptr, nullptr);
+    EVP_PKEY* loaded = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, nullptr);
     BIO_free(bio);
 
-    if (!rsa_key)
-
+    if (!setKey(loaded))
     {
         return false;
     }
-
-    BIO* bio_pub = BIO_new(BIO_s_mem());
-    PEM_write_bio_RSAPublicKey(bio_pub, rsa_key);
-    char* public_key_c;
-    long public_key_len = BIO_get_mem_data(bio_pub, &public_key_c);
-    public_key_str.assign(public_key_c, public_key_len);
-    BIO_free_all(bio_pub);
-
-    address = Crypto::sha256(public_key_str);
+    private_key_str = loaded_key_str;
     return true;
 }
 
@@ -127,57 +333,136 @@ string Wallet::getPublicKey()
 }
 
 
-    /*Signing data using the wallet's RSA Private key*/
+    /*Signing data using the wallet's private key*/
     // To ensure authenticity and integrity
-string Wallet::sign(const string& data)
+string Wallet::sign(string_view data)
 {
-    if (!rsa_key)
+    if (!key)
     {
         return "";
     }
+    return scheme->sign(key, data);
+}
+
+/* Parsed public key cache
+   Parsing a PEM key costs far more than the verify itself, and the same
+   senders show up over and over. Parsed keys are kept in a bounded LRU
+   keyed by the SHA-256 of the encoded key. Entries are shared_ptrs so a key
+   evicted mid-verify stays alive until that verify is done.
+*/
+namespace
+{
+    using KeyPtr = shared_ptr<EVP_PKEY>;
 
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256((unsigned char*)data.c_str(), data.length(), hash);
+    class KeyCache
+    {
+    public:
+        KeyPtr get(const SignatureScheme& scheme, const string& public_key)
+        {
+            unsigned char digest[Crypto::HASH_SIZE];
+            Crypto::sha256Raw(public_key.data(), public_key.size(), digest);
+            string key((const char*)digest, Crypto::HASH_SIZE);
+
+            {
+                lock_guard<mutex> lock(cache_mutex);
+                auto it = entries.find(key);
+                if (it != entries.end())
+                {
+                    lru.splice(lru.begin(), lru, it->second);
+                    hits++;
+                    return it->second->second;
+                }
+            }
+            misses++;
+
+            // Parsing outside the lock so misses don't serialise verifiers
+            EVP_PKEY* decoded = scheme.decodePublicKey(public_key);
+            if (!decoded)
+            {
+                return nullptr;
+            }
+            KeyPtr parsed(decoded, EVP_PKEY_free);
+
+            lock_guard<mutex> lock(cache_mutex);
+            auto it = entries.find(key);
+            if (it != entries.end())
+            {
+                return it->second->second;
+            }
+            lru.emplace_front(key, parsed);
+            entries[key] = lru.begin();
+            trim();
+            return parsed;
+        }
 
-    unsigned char* sig = new unsigned char[RSA_size(rsa_key)];
-    unsigned int sig_len;
+        KeyCacheStats stats()
+        {
+            lock_guard<mutex> lock(cache_mutex);
+            KeyCacheStats result;
+            result.hits = hits;
+            result.misses = misses;
+            result.size = entries.size();
+            result.capacity = capacity;
+            return result;
+        }
+
+        void setCapacity(size_t new_capacity)
+        {
+            lock_guard<mutex> lock(cache_mutex);
+            capacity = new_capacity;
+            trim();
+        }
 
-    if (RSA_sign(NID_sha256, hash, SHA256_DIGEST_LENGTH, sig, &sig_len, rsa_key))
+    private:
+        void trim()
+        {
+            while (entries.size() > capacity)
+            {
+                entries.erase(lru.back().first);
+                lru.pop_back();
+            }
+        }
+
+        mutex cache_mutex;
+        list<pair<string, KeyPtr>> lru;
+        unordered_map<string, list<pair<string, KeyPtr>>::iterator> entries;
+        size_t capacity = 4096;
+        atomic<uint64_t> hits{0};
+        atomic<uint64_t> misses{0};
+    };
+
+    KeyCache& keyCache()
     {
-       string signature = Crypto::base64_encode(sig, sig_len);
-       delete[] sig;
-       return signature; 
+        static KeyCache cache;
+        return cache;
     }
-
-    delete[] sig;
-    return "";
 }
 
     /*Verifying whether the signature matches data using the
-      RSA public key*/
-bool Wallet::verify(const string& publicKey, const string& data, const string& signature)
+      sender's public key. The key's format picks the scheme.*/
+bool Wallet::verify(const string& publicKey, string_view data, const string& signature)
 {
-    BIO* bio = BIO_new_mem_buf(publicKey.c_str(), -1);
-    if (!bio)
+    const SignatureScheme* sender_scheme = SignatureScheme::forPublicKey(publicKey);
+    if (!sender_scheme)
     {
         return false;
     }
-
-    RSA* rsa_pub_key = PEM_read_bio_RSAPublicKey(bio, nullptr, nullptr, nullptr);
-    BIO_free(bio);
-    
-    if (!rsa_pub_key)
+    KeyPtr public_key = keyCache().get(*sender_scheme, publicKey);
+    if (!public_key)
     {
         return false;
     }
+    return sender_scheme->verify(public_key.get(), data, Crypto::base64_decode(signature));
+}
 
-    vector<unsigned char> decoded_sig = Crypto::base64_decode(signature);
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256((unsigned char*)data.c_str(), data.length(), hash);
+KeyCacheStats Wallet::keyCacheStats()
+{
+    return keyCache().stats();
+}
 
-    bool result = RSA_verify(NID_sha256, hash, SHA256_DIGEST_LENGTH, decoded_sig.data(), decoded_sig.size(), rsa_pub_key);
-    RSA_free(rsa_pub_key);
-    return result;
+void Wallet::setKeyCacheCapacity(size_t capacity)
+{
+    keyCache().setCapacity(capacity);
 }
 
 namespace Crypto
@@ -186,16 +471,83 @@ namespace Crypto
     string sha256(const string& data)
     {
         unsigned char hash[SHA256_DIGEST_LENGTH];
-        SHA256_CTX sha256;
-        SHA256_Init(&sha256);
-        SHA256_Update(&sha256, data.c_str(), data.size());
-        SHA256_Final(hash, &sha256);
-        stringstream ss;
-        for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        sha256Raw(data.data(), data.size(), hash);
+        return toHex(hash, SHA256_DIGEST_LENGTH);
+    }
+
+    void sha256Raw(const void* data, size_t length, unsigned char out[HASH_SIZE])
+    {
+        SHA256(static_cast<const unsigned char*>(data), length, out);
+    }
+
+    Hash256 sha256Hash(string_view data)
+    {
+        Hash256 out;
+        sha256Raw(data.data(), data.size(), out.data());
+        return out;
+    }
+
+    static SipKey randomSipKey()
+    {
+        unsigned char bytes[16];
+        if (RAND_bytes(bytes, sizeof(bytes)) != 1)
+        {
+            // Still a key an outsider can't predict from the ids alone
+            uint64_t seed = (uint64_t)chrono::steady_clock::now().time_since_epoch().count();
+            Hash256 fallback = sha256Hash(string_view((const char*)&seed, sizeof(seed)));
+            memcpy(bytes, fallback.data(), sizeof(bytes));
+        }
+        SipKey key;
+        memcpy(&key.k0, bytes, 8);
+        memcpy(&key.k1, bytes + 8, 8);
+        return key;
+    }
+
+    const SipKey& processKey()
+    {
+        static const SipKey key = randomSipKey();
+        return key;
+    }
+
+    string toHex(const unsigned char* data, size_t length)
+    {
+        static const char digits[] = "0123456789abcdef";
+        string out(length * 2, '0');
+        for (size_t i = 0; i < length; i++)
+        {
+            out[2 * i] = digits[data[i] >> 4];
+            out[2 * i + 1] = digits[data[i] & 0x0f];
+        }
+        return out;
+    }
+
+    static int hexValue(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    bool fromHex(string_view hex, unsigned char* out, size_t out_length)
+    {
+        memset(out, 0, out_length);
+        if (hex.size() != out_length * 2)
         {
-            ss << hex << setw(2) << setfill('0') << (int)hash[i];
+            return false;
         }
-        return ss.str();
+        for (size_t i = 0; i < out_length; i++)
+        {
+            int hi = hexValue(hex[2 * i]);
+            int lo = hexValue(hex[2 * i + 1]);
+            if (hi < 0 || lo < 0)
+            {
+                memset(out, 0, out_length);
+                return false;
+            }
+            out[i] = (unsigned char)((hi << 4) | lo);
+        }
+        return true;
     }
 
     /*Encoding the Bio buffer*/
@@ -232,9 +584,52 @@ namespace Crypto
 
         BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
         int decoded_size = BIO_read(bio, buffer.data(), input.length());
-        buffer.resize(decoded_size);
+        buffer.resize(decoded_size > 0 ? decoded_size : 0);
         BIO_free_all(bio);
 
         return buffer;
     }
-}
\ No newline at end of file
+}
+
+/*Hash256*/
+
+bool Hash256::isZero() const
+{
+    for (unsigned char b : bytes)
+    {
+        if (b)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+string Hash256::toHex() const
+{
+    return Crypto::toHex(bytes.data(), bytes.size());
+}
+
+bool Hash256::fromHex(string_view hex, Hash256& out)
+{
+    return Crypto::fromHex(hex, out.data(), out.size());
+}
+
+Hash256 Hash256::fromHex(string_view hex)
+{
+    Hash256 out;
+    fromHex(hex, out);
+    return out;
+}
+
+Hash256 Hash256::fromBytes(const void* raw)
+{
+    Hash256 out;
+    memcpy(out.data(), raw, out.size());
+    return out;
+}
+
+ostream& operator<<(ostream& out, const Hash256& hash)
+{
+    return out << hash.toHex();
+}
@@ -2,30 +2,87 @@
 #define CRYPTO_H
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iosfwd>
 #include <openssl/rsa.h>
+#include <openssl/evp.h>
 
 using namespace std;
 
-/* Creating a wallet with RSA keys and an address*/
+enum class KeyType { RSA2048, Ed25519 };
+
+/* Signature schemes
+   Each scheme knows how to make a key pair and how to turn its public key
+   into the string that goes into Transaction::sending_address (and back).
+   Signing and verifying go through OpenSSL's EVP API for every scheme.
+
+     RSA2048 - PEM "RSA PUBLIC KEY" (~450 bytes), 256 byte signatures.
+               Kept so existing wallets and chains keep working.
+     Ed25519 - "ed25519:" + base64 of the 32 byte key, 64 byte signatures.
+*/
+class SignatureScheme
+{
+public:
+    virtual ~SignatureScheme() = default;
+
+    virtual KeyType type() const = 0;
+    virtual const char* name() const = 0;
+    virtual EVP_PKEY* generate() const = 0;
+    virtual string encodePublicKey(EVP_PKEY* key) const = 0;
+    virtual EVP_PKEY* decodePublicKey(const string& encoded) const = 0;
+    // True when [encoded] looks like one of this scheme's public keys
+    virtual bool recognises(const string& encoded) const = 0;
+    // Digest to sign with, nullptr for schemes that hash internally
+    virtual const EVP_MD* digest() const = 0;
+
+    string sign(EVP_PKEY* key, string_view data) const;
+    bool verify(EVP_PKEY* key, string_view data, const vector<unsigned char>& signature) const;
+
+    static const SignatureScheme& forType(KeyType type);
+    static const SignatureScheme* forPublicKey(const string& encoded);
+    static const SignatureScheme* byName(const string& name);
+};
+
+// Counters for the parsed public key cache used by Wallet::verify
+struct KeyCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t size = 0;
+    size_t capacity = 0;
+};
+
+/* Creating a wallet with a key pair and an address*/
 class Wallet {
 
 public:
     Wallet();
     ~Wallet();
 
-    bool generateKeys();
+    bool generateKeys(KeyType type = KeyType::Ed25519);
     bool saveToFile(const string& filename);
     bool loadFromFile(const string& filename);
 
     string getAddress();
     string getPublicKey();
+    const SignatureScheme* getScheme() const { return scheme; }
+
+    string sign(string_view data);
+    static bool verify(const string& publicKey, string_view data, const string& signature);
 
-    string sign(const string& data);
-    static bool verify(const string& publicKey, const string& data, const string& signature);
+    static KeyCacheStats keyCacheStats();
+    static void setKeyCacheCapacity(size_t capacity);
 
 private: 
-    RSA* rsa_key;
+    bool setKey(EVP_PKEY* new_key);
+
+    EVP_PKEY* key;
+    const SignatureScheme* scheme;
     string public_key_str;
     string private_key_str;
     string address;
@@ -35,9 +92,145 @@ private:
 //Encryption 
 namespace Crypto 
 {
+    const size_t HASH_SIZE = 32;
+
     string sha256(const string& data);
+    void sha256Raw(const void* data, size_t length, unsigned char out[HASH_SIZE]);
+    string toHex(const unsigned char* data, size_t length);
+    // Decodes exactly out_length bytes of hex. Anything else (e.g. the
+    // genesis "0" previous hash) gives all zero bytes and returns false.
+    bool fromHex(string_view hex, unsigned char* out, size_t out_length);
     string base64_encode(const unsigned char* buffer, size_t length);
     vector<unsigned char> base64_decode(const string& input);
 }
 
+/* A SHA-256 digest kept as its 32 raw bytes
+
+   Block hashes, previous hashes and transaction ids are all Hash256s.
+   Comparing, copying and hashing one never allocates; hex only comes into
+   it when a hash is shown to or typed in by a user (toHex/fromHex and
+   operator<<).
+*/
+struct Hash256
+{
+    array<unsigned char, Crypto::HASH_SIZE> bytes{};
+
+    unsigned char* data() { return bytes.data(); }
+    const unsigned char* data() const { return bytes.data(); }
+    static constexpr size_t size() { return Crypto::HASH_SIZE; }
+    const unsigned char* begin() const { return bytes.data(); }
+    const unsigned char* end() const { return bytes.data() + Crypto::HASH_SIZE; }
+    // The raw bytes, e.g. for signing or hashing the digest again
+    string_view view() const { return string_view((const char*)bytes.data(), Crypto::HASH_SIZE); }
+
+    bool isZero() const;
+    string toHex() const;
+    // Exactly 64 hex digits; anything else (like the genesis block's "0")
+    // gives the zero hash and returns false
+    static bool fromHex(string_view hex, Hash256& out);
+    static Hash256 fromHex(string_view hex);
+    static Hash256 fromBytes(const void* raw);
+
+    bool operator==(const Hash256& other) const { return bytes == other.bytes; }
+    bool operator!=(const Hash256& other) const { return bytes != other.bytes; }
+    bool operator<(const Hash256& other) const { return bytes < other.bytes; }
+};
+
+ostream& operator<<(ostream& out, const Hash256& hash);
+
+namespace Crypto
+{
+    Hash256 sha256Hash(string_view data);
+
+    struct SipKey
+    {
+        uint64_t k0 = 0;
+        uint64_t k1 = 0;
+    };
+    // A key drawn at random once per process
+    const SipKey& processKey();
+
+    inline uint64_t sipRotl(uint64_t x, int b)
+    {
+        return (x << b) | (x >> (64 - b));
+    }
+
+    inline void sipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3)
+    {
+        v0 += v1; v1 = sipRotl(v1, 13); v1 ^= v0; v0 = sipRotl(v0, 32);
+        v2 += v3; v3 = sipRotl(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = sipRotl(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = sipRotl(v1, 17); v1 ^= v2; v2 = sipRotl(v2, 32);
+    }
+
+    // SipHash-c-d of a 32 byte hash under a 128 bit key: four message
+    // words, then the final word holding only the length
+    template <int C, int D>
+    inline uint64_t sipHashRounds(const SipKey& key, const Hash256& hash)
+    {
+        uint64_t v0 = 0x736f6d6570736575ULL ^ key.k0;
+        uint64_t v1 = 0x646f72616e646f6dULL ^ key.k1;
+        uint64_t v2 = 0x6c7967656e657261ULL ^ key.k0;
+        uint64_t v3 = 0x7465646279746573ULL ^ key.k1;
+
+        for (size_t i = 0; i < HASH_SIZE; i += 8)
+        {
+            // Little endian words, as the reference implementation reads them
+            uint64_t m = 0;
+            for (int b = 0; b < 8; b++)
+            {
+                m |= (uint64_t)hash.data()[i + b] << (8 * b);
+            }
+            v3 ^= m;
+            for (int r = 0; r < C; r++)
+            {
+                sipRound(v0, v1, v2, v3);
+            }
+            v0 ^= m;
+        }
+        uint64_t last = (uint64_t)HASH_SIZE << 56;
+        v3 ^= last;
+        for (int r = 0; r < C; r++)
+        {
+            sipRound(v0, v1, v2, v3);
+        }
+        v0 ^= last;
+
+        v2 ^= 0xff;
+        for (int r = 0; r < D; r++)
+        {
+            sipRound(v0, v1, v2, v3);
+        }
+        return v0 ^ v1 ^ v2 ^ v3;
+    }
+
+    // The standard SipHash-2-4, e.g. for compact block short ids
+    inline uint64_t sipHash(const SipKey& key, const Hash256& hash)
+    {
+        return sipHashRounds<2, 4>(key, hash);
+    }
+
+    // Bucket hash for tables keyed by Hash256: the lighter SipHash-1-3
+    // under processKey(). Nothing outside the process ever sees it.
+    inline uint64_t tableHash(const Hash256& hash)
+    {
+        return sipHashRounds<1, 3>(processKey(), hash);
+    }
+}
+
+// Most hashes we put in tables come from peers, and a peer can grind ids
+// (transaction ids above all) whose raw bytes all land in one bucket. A
+// key nobody outside the process knows keeps the buckets even.
+namespace std
+{
+    template <>
+    struct hash<Hash256>
+    {
+        size_t operator()(const Hash256& h) const noexcept
+        {
+            return (size_t)Crypto::tableHash(h);
+        }
+    };
+}
+
 #endif
\ No newline at end of file
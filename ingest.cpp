@@ -0,0 +1,203 @@
+#include "ingest.h"
+#include <chrono>
+#include <algorithm>
+
+IngestPipeline::~IngestPipeline()
+{
+    stop();
+}
+
+void IngestPipeline::start(Check check_fn, Apply apply_fn, Reject reject_fn, Drained drained_fn,
+                           unsigned verifier_count, size_t queue_capacity)
+{
+    check = move(check_fn);
+    apply = move(apply_fn);
+    reject = move(reject_fn);
+    drained = move(drained_fn);
+    capacity = max<size_t>(1, queue_capacity);
+    if (verifier_count == 0)
+    {
+        verifier_count = max(1u, thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < verifier_count; i++)
+    {
+        verifiers.emplace_back(&IngestPipeline::verifyLoop, this);
+    }
+    applier = thread(&IngestPipeline::applyLoop, this);
+}
+
+void IngestPipeline::stop()
+{
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if (stopping)
+        {
+            return;
+        }
+        stopping = true;
+    }
+    work_ready.notify_all();
+    verified_ready.notify_all();
+    for (auto& t : verifiers)
+    {
+        t.join();
+    }
+    verifiers.clear();
+    if (applier.joinable())
+    {
+        applier.join();
+    }
+}
+
+bool IngestPipeline::push(IngestItem item)
+{
+    received++;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if (stopping)
+        {
+            return false;
+        }
+        waiting.push_back(move(item));
+        size_t depth = waiting.size() + in_flight + verified.size();
+        max_depth = max(max_depth, depth);
+        if (depth >= capacity)
+        {
+            is_congested = true;
+        }
+    }
+    work_ready.notify_one();
+    return is_congested;
+}
+
+void IngestPipeline::verifyLoop()
+{
+    while (true)
+    {
+        IngestItem item;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            work_ready.wait(lock, [this] { return stopping || !waiting.empty(); });
+            if (stopping)
+            {
+                return;
+            }
+            item = move(waiting.front());
+            waiting.pop_front();
+            in_flight++;
+        }
+
+        bool ok = !check || check(item.tx);
+
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            in_flight--;
+            verified.push_back({ move(item), ok });
+        }
+        verified_ready.notify_one();
+    }
+}
+
+void IngestPipeline::applyLoop()
+{
+    while (true)
+    {
+        Verified next;
+        bool now_drained = false;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            verified_ready.wait(lock, [this] { return stopping || !verified.empty(); });
+            if (stopping)
+            {
+                return;
+            }
+            next = move(verified.front());
+            verified.pop_front();
+            size_t depth = waiting.size() + in_flight + verified.size();
+            if (is_congested && depth <= capacity / 2)
+            {
+                is_congested = false;
+                now_drained = true;
+            }
+        }
+
+        if (next.ok)
+        {
+            verified_count++;
+            if (apply(next.item))
+            {
+                countAccepted();
+            }
+        }
+        else
+        {
+            rejected++;
+            if (reject)
+            {
+                reject(next.item);
+            }
+        }
+        if (now_drained && drained)
+        {
+            drained();
+        }
+    }
+}
+
+static int64_t steadySeconds()
+{
+    return chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Zeroing the buckets of the seconds that passed with nothing accepted.
+// Called with rate_mutex held.
+void IngestPipeline::advanceRate(int64_t second)
+{
+    if (second - current_second >= RATE_WINDOW)
+    {
+        per_second.fill(0);
+    }
+    else
+    {
+        for (int64_t s = current_second + 1; s <= second; s++)
+        {
+            per_second[s % RATE_WINDOW] = 0;
+        }
+    }
+    current_second = max(current_second, second);
+}
+
+void IngestPipeline::countAccepted()
+{
+    accepted++;
+    lock_guard<mutex> lock(rate_mutex);
+    int64_t second = steadySeconds();
+    advanceRate(second);
+    per_second[second % RATE_WINDOW]++;
+}
+
+IngestStats IngestPipeline::stats()
+{
+    IngestStats stats;
+    stats.received = received;
+    stats.rejected = rejected;
+    stats.verified = verified_count;
+    stats.accepted = accepted;
+    stats.throttled = throttled;
+    stats.capacity = capacity;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        stats.depth = waiting.size() + in_flight + verified.size();
+        stats.max_depth = max_depth;
+        stats.verifiers = verifiers.size();
+    }
+    lock_guard<mutex> lock(rate_mutex);
+    advanceRate(steadySeconds());
+    uint64_t total = 0;
+    for (uint64_t count : per_second)
+    {
+        total += count;
+    }
+    stats.tps = (double)total / RATE_WINDOW;
+    return stats;
+}
@@ -0,0 +1,133 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <deque>
+#include <vector>
+#include <array>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include "blockchain.h"
+
+using namespace std;
+
+/* Transaction ingest pipeline
+
+   Transactions from peers are taken in three stages, so no network
+   thread ever waits on a signature check:
+
+     1. the I/O loop that decoded the transaction pushes it on the queue
+     2. a pool of verifier threads runs the stateless checks (signature
+        and all) in parallel
+     3. a single applier thread commits verified transactions to the
+        mempool, one at a time, in the order they finished verifying,
+        which can still turn one down (no funds, already pending)
+
+   The queue is bounded by [capacity] transactions, counting both stages.
+   Once it is full the pipeline reports itself congested, and the network
+   layer stops reading from the peers that keep pushing, until the queue
+   has drained to half. A push is never refused; the bound is kept by the
+   readers backing off, so a transaction that was read is never lost.
+*/
+
+struct IngestItem
+{
+    Transaction tx;
+    int peer_id = -1;
+    size_t size = 0; // encoded size
+};
+
+struct IngestStats
+{
+    uint64_t received = 0;   // pushed by the network threads
+    uint64_t rejected = 0;   // failed verification
+    uint64_t verified = 0;   // passed verification and handed to the applier
+    uint64_t accepted = 0;   // taken by the applier
+    size_t depth = 0;        // waiting in either stage right now
+    size_t max_depth = 0;
+    size_t capacity = 0;
+    uint64_t throttled = 0;  // times a peer's reads were paused
+    double tps = 0.0;        // accepted per second over the last RATE_WINDOW seconds
+    unsigned verifiers = 0;
+};
+
+class IngestPipeline
+{
+public:
+    // Run on the verifier threads, so it has to be thread safe
+    using Check = function<bool(const Transaction&)>;
+    // Run on the applier thread with every transaction that passed;
+    // returns whether it was accepted
+    using Apply = function<bool(const IngestItem&)>;
+    // Run on the applier thread with every transaction that failed
+    using Reject = function<void(const IngestItem&)>;
+    // Run on the applier thread when a congested queue has drained to half
+    using Drained = function<void()>;
+
+    static const size_t DEFAULT_CAPACITY = 10000;
+    static const int RATE_WINDOW = 10;
+
+    IngestPipeline() = default;
+    ~IngestPipeline();
+    IngestPipeline(const IngestPipeline&) = delete;
+    IngestPipeline& operator=(const IngestPipeline&) = delete;
+
+    // verifier_count == 0 uses one per hardware thread
+    void start(Check check, Apply apply, Reject reject, Drained drained, unsigned verifier_count = 0,
+               size_t capacity = DEFAULT_CAPACITY);
+    // Finishing what is already running; anything still queued is dropped
+    void stop();
+
+    // Returns whether the queue is congested after taking [item]
+    bool push(IngestItem item);
+    bool congested() const { return is_congested; }
+    void countThrottled() { throttled++; }
+    IngestStats stats();
+
+private:
+    struct Verified
+    {
+        IngestItem item;
+        bool ok;
+    };
+
+    void verifyLoop();
+    void applyLoop();
+    void countAccepted();
+
+    Check check;
+    Apply apply;
+    Reject reject;
+    Drained drained;
+    size_t capacity = DEFAULT_CAPACITY;
+
+    mutex queue_mutex;
+    condition_variable work_ready;
+    condition_variable verified_ready;
+    deque<IngestItem> waiting;
+    deque<Verified> verified;
+    size_t in_flight = 0;            // taken by a verifier, not yet in [verified]
+    bool stopping = false;
+    atomic<bool> is_congested{false};
+
+    vector<thread> verifiers;
+    thread applier;
+
+    atomic<uint64_t> received{0};
+    atomic<uint64_t> rejected{0};
+    atomic<uint64_t> verified_count{0};
+    atomic<uint64_t> accepted{0};
+    atomic<uint64_t> throttled{0};
+    size_t max_depth = 0;
+
+    // Accepted count per second, for the last RATE_WINDOW seconds
+    mutex rate_mutex;
+    array<uint64_t, RATE_WINDOW> per_second{};
+    int64_t current_second = 0;
+    void advanceRate(int64_t second);
+};
+
+#endif
@@ -1,98 +1,264 @@
 #include "p2p.h"
 #include "blockchain.h"
 #include "crypto.h"
+#include "codec.h"
+#include "metrics.h"
+#include "mempool.h"
 #include <iostream>
 #include <thread>
 #include <chrono>
 #include <sstream>
+#include <limits>
 
 // Global objects for a node's Blockchain & Wallet
 static Blockchain my_blockchain;
 static Wallet my_wallet;
 
-// Handling received blocks
+// Range sync limits, per page
+static const uint32_t SYNC_PAGE_BLOCKS = 500;
+static const size_t SYNC_PAGE_BYTES = 8 * 1024 * 1024;
 
-void handle_received_block(const Block& block, int peer_id)
+// Asking [peer_id] for the blocks after our chain. [tip_hash], when given,
+// is the last block that peer sent us, which may be on a side branch.
+static void request_blocks(int peer_id, const Hash256& tip_hash = Hash256())
 {
+    vector<Hash256> locator = my_blockchain.getLocator();
+    if (!tip_hash.isZero())
+    {
+        locator.insert(locator.begin(), tip_hash);
+    }
+    string request;
+    Codec::encodeGetBlocks(locator, SYNC_PAGE_BLOCKS, request);
+    P2P::sendToPeer(peer_id, P2P::MessageType::GetBlocks, request);
+}
 
-    // if (block.getHash() == my_blockchain.getLatestBlock().getHash())
-    // {
-    //    cout << "DEBUG: Received a block that is already our latest. Ignoring redundant broadcast." << endl;
-    //    cout << "> " << flush;
-    //    return; // Exit the function early 
-    // }
-    
+// Handling received blocks. Only blocks that move our tip are passed on
+// to the other peers.
+
+GossipVerdict handle_received_block(const Block& block, int peer_id)
+{
     cout << "\n[Network] Received new block from a peer." << endl;
-    
-    const Block& latest_block = my_blockchain.getLatestBlock();
-    // when we receive a block I'm check that it's previous hash is our latest block
-    // [block 0] --> [block1] --> latest_block
-    // [block 3]: block.previousHash() = hash(block 2), index = 3
-    if (block.getPreviousHash() == latest_block.getHash() 
-        && block.getIndex() == latest_block.getIndex() + 1)
+
+    GossipVerdict verdict = GossipVerdict::Rejected;
+    try
     {
-        try
-        {
-            my_blockchain.addBlock(block);
-            cout << "\n[SYSTEM] Appended new block to chain." << endl;
-        }
-        catch (const runtime_error& e) 
+        switch (my_blockchain.acceptBlock(block))
         {
-            cerr << "\n[SYSTEM] Error appending block: " << e.what() << endl;
+            case Blockchain::AcceptResult::Extended:
+                cout << "\n[SYSTEM] Appended new block to chain." << endl;
+                verdict = GossipVerdict::Relay;
+                break;
+            case Blockchain::AcceptResult::Reorganized:
+                cout << "\n[SYSTEM] Switched to the branch ending in block " << block.getIndex() << "." << endl;
+                verdict = GossipVerdict::Relay;
+                break;
+            case Blockchain::AcceptResult::SideBranch:
+                cout << "\n[SYSTEM] Stored block " << block.getIndex() << " on a side branch." << endl;
+                verdict = GossipVerdict::Known;
+                break;
+            case Blockchain::AcceptResult::Duplicate:
+                cout << "\n[SYSTEM] Received block is already known. Ignoring." << endl;
+                verdict = GossipVerdict::Known;
+                break;
+            case Blockchain::AcceptResult::Orphan:
+                cout << "\n[SYSTEM] Received block doesn't connect to any block we know. Requesting missing blocks from " 
+                << peer_id << " for synchronization." << endl;
+                request_blocks(peer_id);
+                break;
         }
     }
-
-    else if (block.getIndex() > latest_block.getIndex())
-    {
-        cout << "\n[SYSTEM] Blockchain fork detected. Requesting chain from " 
-        << peer_id << " for synchronization." << endl;
-        P2P::sendToPeer(peer_id, "GET_CHAIN");
-    }
-    else 
+    catch (const runtime_error& e) 
     {
-        cout << "\n[SYSTEM] Received block is older than current head. Ignoring." << endl;
+        cerr << "\n[SYSTEM] Error accepting block: " << e.what() << endl;
     }
 
     cout << "> " << flush;
+    return verdict;
 }
 
 
 
-void handle_received_chain(const string& chain_data)
+// Answering a locator with the page of blocks after the newest hash in it
+// that is on our chain
+void handle_get_blocks(const Codec::GetBlocksView& request, int peer_id)
+{
+    size_t max_blocks = min<size_t>(max<uint32_t>(request.max_blocks, 1), SYNC_PAGE_BLOCKS);
+    P2P::sendToPeer(peer_id, P2P::MessageType::Blocks,
+                    my_blockchain.encodeBlocksAfter(request.locator, max_blocks, SYNC_PAGE_BYTES));
+}
+
+// Taking in a page of blocks. Each one goes into the block tree, which
+// switches branches by itself once the peer's branch has more work.
+void handle_blocks(const Codec::BlocksPageView& page, int peer_id)
 {
-    cout << "\n[SYSTEM] Received full chain response from peer." << endl;
-    Blockchain received_chain;
-    received_chain.deserialize(chain_data);
+    size_t start_height = my_blockchain.height();
+    bool reorganized = false;
+    Hash256 last_hash;
 
-    if (received_chain.isChainValid() && received_chain.getChain().size() > my_blockchain.getChain().size())
+    Codec::BlockCursor cursor = page.blocks();
+    Codec::BlockView view;
+    while (cursor.next(view))
     {
-        my_blockchain.replaceChain(received_chain.getChain());
-        cout << "Sucessfully synchronized to longer chain." << endl;
+        Block block = view.toBlock();
+        last_hash = block.getHash();
+        try
+        {
+            Blockchain::AcceptResult result = my_blockchain.acceptBlock(block);
+            if (result == Blockchain::AcceptResult::Orphan)
+            {
+                throw runtime_error("Block " + to_string(block.getIndex()) + " doesn't connect to any block we know.");
+            }
+            reorganized |= result == Blockchain::AcceptResult::Reorganized;
+        }
+        catch (const runtime_error& e)
+        {
+            cerr << "\n[SYSTEM] Sync with peer " << peer_id << " stopped: " << e.what() << endl;
+            cout << "> " << flush;
+            return;
+        }
     }
-    else 
+
+    if (reorganized || my_blockchain.height() != start_height)
     {
-        cout << "[SYSTEM] Received chain is not valid. Keeping current chain." << endl;
+        cout << "\n[SYSTEM] Synchronized with peer " << peer_id << "; now at height " 
+        << my_blockchain.height() << endl;
+    }
+    if (page.more)
+    {
+        request_blocks(peer_id, last_hash);
     }
-
     cout << "> " << flush;
 }
 
 // Handling received transactions
-void handle_received_tx(const Transaction& tx)
+// Run on the ingest verifier threads
+bool check_received_tx(const Transaction& tx)
 {
     try
     {
-        my_blockchain.addTransaction(tx);
+        my_blockchain.verifyTransaction(tx);
+        return true;
+    }
+    catch (const runtime_error&)
+    {
+        // Counted by the pipeline (see `peers`); a peer spraying bad
+        // transactions would otherwise flood the console from every verifier
+        return false;
+    }
+}
+
+// Run on the ingest applier thread, with transactions check_received_tx passed
+GossipVerdict handle_received_tx(const Transaction& tx)
+{
+    GossipVerdict verdict = GossipVerdict::Rejected;
+    try
+    {
+        my_blockchain.addVerifiedTransaction(tx);
         cout << "\n[NETWORK] Received and added new transaction to pending pool." << endl;
+        verdict = GossipVerdict::Relay;
     }
     catch (const runtime_error& e)
     {
         cout << "\n[NETWORK] Received invalid transaction: " << e.what() << endl;
     }
     cout << "> " << flush;
+    return verdict;
+}
+
+// Whether an item a peer announced is one we already have
+bool have_item(const Codec::InventoryItem& item)
+{
+    if (item.type != Codec::InventoryType::Tx)
+    {
+        return my_blockchain.hasBlock(item.hash);
+    }
+    return my_blockchain.hasPendingTransaction(item.hash);
+}
+
+// The encoded item a peer asked for, empty if we don't have it (any more)
+string lookup_item(const Codec::InventoryItem& item)
+{
+    if (item.type == Codec::InventoryType::Block)
+    {
+        return my_blockchain.encodeBlock(item.hash);
+    }
+    if (item.type == Codec::InventoryType::CompactBlock)
+    {
+        return my_blockchain.encodeCompactBlock(item.hash);
+    }
+    Transaction tx;
+    return my_blockchain.findPendingTransaction(item.hash, tx) ? Codec::encode(tx) : string();
 }
 
 
+// Everything the node can tell about itself, for `stats` and the scrape endpoint
+Metrics::Report collect_metrics()
+{
+    using Metrics::label;
+    Metrics::Report report;
+
+    auto snap = my_blockchain.snapshot();
+    report.gauge("p2p_chain_height", "Height of the chain tip").set(snap->height());
+    report.gauge("p2p_chain_base_height", "Lowest block still held (non-zero when started from a snapshot or pruned)")
+        .set(snap->base);
+    report.gauge("p2p_chain_block_bytes", "Approximate memory held by blocks").set(snap->block_bytes);
+    report.gauge("p2p_chain_side_blocks", "Blocks on side branches").set(snap->side_blocks);
+    report.gauge("p2p_chain_addresses", "Addresses with a confirmed balance").set(snap->balances.size());
+    report.histogram("p2p_block_check_seconds", "Time to check a block against its parent", Metrics::block_check);
+    report.histogram("p2p_chain_validation_seconds", "Time for a full chain validation", Metrics::chain_validation);
+
+    MiningTotals mining = my_blockchain.getMiningTotals();
+    MiningStats last_mining = my_blockchain.getLastMiningStats();
+    report.counter("p2p_mined_blocks_total", "Blocks mined by this node").set(mining.blocks);
+    report.counter("p2p_mining_hashes_total", "Hashes tried while mining").set(mining.hashes);
+    report.counter("p2p_mining_seconds_total", "Time spent mining").set(mining.seconds);
+    report.gauge("p2p_mining_hashrate", "Hashes per second over the last mined block").set(last_mining.totalHashRate());
+
+    MempoolStats mempool = my_blockchain.mempoolStats();
+    report.gauge("p2p_mempool_transactions", "Pending transactions").set(mempool.count);
+    report.gauge("p2p_mempool_bytes", "Size of the pending transactions").set(mempool.bytes);
+    report.counter("p2p_mempool_evicted_total", "Pending transactions evicted to stay under the limits")
+        .set(mempool.evicted);
+
+    report.histogram("p2p_signature_verify_seconds", "Time to verify a signature that wasn't cached",
+                     Metrics::signature_verify);
+    SignatureCacheStats signatures = Transaction::signatureCacheStats();
+    report.counter("p2p_signature_cache_hits_total", "Signature checks answered from the cache").set(signatures.hits);
+    report.counter("p2p_signature_cache_misses_total", "Signature checks that had to verify").set(signatures.misses);
+
+    TrafficStats traffic = P2P::trafficStats();
+    report.gauge("p2p_peers", "Connected peers").set(traffic.by_peer.size());
+    auto& type_messages = report.counter("p2p_messages_total", "Messages by type and direction");
+    auto& type_bytes = report.counter("p2p_message_bytes_total", "Message bytes by type and direction");
+    for (const auto& entry : traffic.by_type)
+    {
+        string type = label("type", Protocol::typeName(entry.first));
+        type_messages.set(entry.second.messages_in, type + ",direction=\"in\"");
+        type_messages.set(entry.second.messages_out, type + ",direction=\"out\"");
+        type_bytes.set(entry.second.bytes_in, type + ",direction=\"in\"");
+        type_bytes.set(entry.second.bytes_out, type + ",direction=\"out\"");
+    }
+    auto& peer_messages = report.counter("p2p_peer_messages_total", "Messages by peer and direction");
+    auto& peer_bytes = report.counter("p2p_peer_bytes_total", "Message bytes by peer and direction");
+    auto& peer_queued = report.gauge("p2p_peer_queued_bytes", "Bytes waiting to be sent to a peer");
+    for (const auto& peer : traffic.by_peer)
+    {
+        string labels = label("peer", to_string(peer.id)) + "," + label("address", peer.address);
+        peer_messages.set(peer.traffic.messages_in, labels + ",direction=\"in\"");
+        peer_messages.set(peer.traffic.messages_out, labels + ",direction=\"out\"");
+        peer_bytes.set(peer.traffic.bytes_in, labels + ",direction=\"in\"");
+        peer_bytes.set(peer.traffic.bytes_out, labels + ",direction=\"out\"");
+        peer_queued.set(peer.queued_bytes, labels);
+    }
+
+    IngestStats ingest = P2P::ingestStats();
+    report.gauge("p2p_ingest_queue_depth", "Transactions waiting in the ingest pipeline").set(ingest.depth);
+    report.gauge("p2p_ingest_tps", "Transactions accepted per second, over the last 10 seconds").set(ingest.tps);
+    report.counter("p2p_ingest_rejected_total", "Peer transactions that failed verification").set(ingest.rejected);
+    report.counter("p2p_ingest_throttled_total", "Times a peer's reads were paused").set(ingest.throttled);
+    return report;
+}
+
 // The main command-line interface 
 void cli_interface()
 {
@@ -113,17 +279,24 @@ void cli_interface()
         }
         else if (command == "createwallet")
         {
-            string filename;
-            ss >> filename;
+            string filename, scheme_name;
+            ss >> filename >> scheme_name;
             if (filename.empty())
             {
-                cout << "Usage: createwallet <filename>" << endl;
+                cout << "Usage: createwallet <filename> [ed25519|rsa]" << endl;
+                continue;
+            }
+            const SignatureScheme* scheme = scheme_name.empty() 
+                ? &SignatureScheme::forType(KeyType::Ed25519) : SignatureScheme::byName(scheme_name);
+            if (!scheme)
+            {
+                cout << "Unknown signature scheme: " << scheme_name << endl;
                 continue;
             }
-            if (my_wallet.generateKeys())
+            if (my_wallet.generateKeys(scheme->type()))
             {
                 my_wallet.saveToFile(filename);
-                cout << "Wallet created and save to " << filename << endl;
+                cout << "Wallet (" << scheme->name() << ") created and save to " << filename << endl;
                 cout << "Your new address: " << my_wallet.getAddress() << endl;
             }
         }
@@ -138,7 +311,7 @@ void cli_interface()
             }
             if (my_wallet.loadFromFile(filename))
             {
-                cout << "Wallet loaded from " << filename << endl;
+                cout << "Wallet (" << my_wallet.getScheme()->name() << ") loaded from " << filename << endl;
                 cout << "Your address: " << my_wallet.getAddress() << endl;
             } 
             else 
@@ -152,11 +325,31 @@ void cli_interface()
             {
                 cout << "You must load a wallet first to receive mining rewards." << endl;
             }
+            unsigned threads = 0;
+            if (ss >> threads)
+            {
+                my_blockchain.setMiningThreads(threads);
+            }
             cout << "Mining pending transactions..." << endl;
-            my_blockchain.minePendingTransaction(my_wallet.getAddress());
-            cout << "Block sucessfully mined! Broadcasting to network..." << endl;
-        
-            P2P::broadcast("BLOCK:" + my_blockchain.getLatestBlock().serialize());
+            Blockchain::AcceptResult result;
+            try
+            {
+                result = my_blockchain.minePendingTransaction(my_wallet.getAddress());
+            }
+            catch (const runtime_error& e)
+            {
+                cout << "The mined block was refused: " << e.what() << endl;
+                continue;
+            }
+            if (result != Blockchain::AcceptResult::Extended)
+            {
+                cout << "Another block reached the chain first; the mined block was kept as a side branch." << endl;
+                continue;
+            }
+            cout << "Block sucessfully mined! Announcing to network..." << endl;
+
+            shared_ptr<const Block> mined = my_blockchain.getLatestBlock();
+            P2P::announce(Codec::InventoryType::Block, mined->getHash(), Codec::encode(*mined).size());
             cout << "Balance is now: " << my_blockchain.getBalance(my_wallet.getAddress()) << endl;
         }
 
@@ -193,13 +386,13 @@ void cli_interface()
             tx.amount = amount;
             tx.timestamp = time(nullptr);
             tx.id = tx.calculate_Hash();
-            tx.signature = my_wallet.sign(tx.id);
+            tx.signature = my_wallet.sign(tx.id.view());
 
             try
             {
                 my_blockchain.addTransaction(tx);
-                cout << "Transaction added to pending pool. Broadcasting to network..." << endl;
-                P2P::broadcast("Tx:" + tx.serializer());
+                cout << "Transaction " << tx.id << " added to pending pool. Announcing to network..." << endl;
+                P2P::announce(Codec::InventoryType::Tx, tx.id, Codec::encode(tx).size());
             }
             catch (const runtime_error& e)
             {
@@ -209,47 +402,285 @@ void cli_interface()
         else if (command == "peers")
         {
             P2P::listPeers();
+            GossipStats gossip = P2P::gossipStats();
+            cout << "Gossip: " << gossip.inv_sent << " announced, " << gossip.inv_received << " announcements received, "
+            << gossip.requested << " requested, " << gossip.served << " served" << endl;
+            cout << "  " << gossip.already_known << " already known (" << gossip.bytes_avoided << " bytes not sent), "
+            << gossip.duplicates_dropped << " duplicates dropped (" << gossip.duplicate_bytes << " bytes), "
+            << gossip.seen << " hashes seen" << endl;
+            cout << "Compact blocks: " << gossip.compact_received << " received, " << gossip.compact_from_pool
+            << " rebuilt from the mempool alone, " << gossip.compact_txs_fetched << " transactions fetched, "
+            << gossip.compact_fallbacks << " full block fallbacks" << endl;
+            cout << "  " << gossip.compact_bytes << " bytes received for blocks of " << gossip.compact_block_bytes
+            << " bytes" << endl;
+            IngestStats ingest = P2P::ingestStats();
+            cout << "Ingest: " << ingest.received << " received, " << ingest.verified << " verified, "
+            << ingest.accepted << " accepted, " << ingest.rejected << " rejected, " << ingest.tps
+            << " tx/s accepted over the last "
+            << IngestPipeline::RATE_WINDOW << "s (" << ingest.verifiers << " verifiers)" << endl;
+            cout << "  queue " << ingest.depth << "/" << ingest.capacity << " (peak " << ingest.max_depth << "), "
+            << ingest.throttled << " peer reads throttled" << endl;
+        }
+        else if (command == "stats")
+        {
+            cout << collect_metrics().table();
         }
         else if (command == "chain")
         {
-            for (const auto& block : my_blockchain.getChain())
+            for (const auto& block : my_blockchain.snapshot()->blocks)
             {
-                cout << "Index: " << block.getIndex() << "Prev Hash: " << block.getPreviousHash() << " | Hash: " << block.getHash() << endl;
+                cout << "Index: " << block->getIndex() << "Prev Hash: " << block->getPreviousHash() << " | Hash: " << block->getHash() << endl;
             }
         }
         else if (command == "valid")
         {
-            cout << "Chain valid? " << (my_blockchain.isChainValid() ? "Yes" : "No") << endl;
+            ValidationResult result = my_blockchain.validateChain();
+            cout << "Chain valid? " << (result.valid ? "Yes" : "No") << endl;
+            if (!result.valid)
+            {
+                cout << "First invalid block: " << result.first_invalid_block << " (" << result.reason << ")" << endl;
+            }
+            KeyCacheStats keys = Wallet::keyCacheStats();
+            cout << "Key cache: " << keys.hits << " hits, " << keys.misses << " misses, " 
+            << keys.size << "/" << keys.capacity << " keys" << endl;
+            SignatureCacheStats signatures = Transaction::signatureCacheStats();
+            cout << "Signature cache: " << signatures.hits << " hits, " << signatures.misses << " misses, "
+            << signatures.size << "/" << signatures.capacity << " signatures" << endl;
+        }
+        else if (command == "snapshot")
+        {
+            string path;
+            ss >> path;
+            if (path.empty())
+            {
+                cout << "Usage: snapshot <file>" << endl;
+                continue;
+            }
+            auto snap = my_blockchain.snapshot();
+            if (my_blockchain.saveState(path))
+            {
+                cout << "State at height " << snap->height() << " (" << snap->tip().getHash() << ", "
+                << snap->balances.size() << " addresses) written to " << path << endl;
+            }
+        }
+        else if (command == "proof")
+        {
+            string tx_hex;
+            ss >> tx_hex;
+            Hash256 tx_id;
+            if (!Hash256::fromHex(tx_hex, tx_id))
+            {
+                cout << "Usage: proof <transaction_id>   (64 hex digits)" << endl;
+                continue;
+            }
+            // What a light client would be sent: the block's Merkle root
+            // (in its header) and the path from the transaction up to it
+            bool found = false;
+            for (const auto& entry : my_blockchain.snapshot()->blocks)
+            {
+                const Block& block = *entry;
+                Merkle::Proof proof;
+                if (!block.merkleProof(tx_id, proof))
+                {
+                    continue;
+                }
+                found = true;
+                cout << "Block " << block.getIndex() << " | Merkle root: " << Merkle::toHex(block.getMerkleRoot()) << endl;
+                cout << "Leaf " << proof.index << " of " << proof.leaf_count << ", path:" << endl;
+                for (const auto& sibling : proof.path)
+                {
+                    cout << "  " << Merkle::toHex(sibling) << endl;
+                }
+                bool ok = Merkle::verifyProof(Merkle::leafHash(tx_id), proof, block.getMerkleRoot());
+                cout << "Proof verifies? " << (ok ? "Yes" : "No") << endl;
+                break;
+            }
+            if (!found)
+            {
+                cout << "Transaction " << tx_id << " is not in any block." << endl;
+            }
         }
         else 
         {
-            cout << "Unknown command. Commands: exit, createwallet, loadwallet, mine, checkbalance, sendfunds, peers, chain, valid" << endl;
+            cout << "Unknown command. Commands: exit, createwallet, loadwallet, mine, checkbalance, sendfunds, peers, stats, chain, valid, snapshot, proof" << endl;
         }
     }
 }
 
+// A whole decimal number no bigger than [max]; nothing else is accepted
+static bool parse_number(const string& text, unsigned long max, unsigned long& value)
+{
+    if (text.empty() || text.size() > 19 || text.find_first_not_of("0123456789") != string::npos)
+    {
+        return false;
+    }
+    value = stoul(text);
+    return value <= max;
+}
+
+static bool parse_port(const string& text, int& port)
+{
+    unsigned long value = 0;
+    if (!parse_number(text, 65535, value) || value == 0)
+    {
+        return false;
+    }
+    port = (int)value;
+    return true;
+}
+
 int main(int argc, char* argv[])
 {
-    if (argc < 2) 
+    // Positional arguments, plus optional "--datadir <dir>", "--snapshot <file>",
+    // "--assumevalid <height>:<block_hash>", "--prune <blocks>|<N>MB" and
+    // "--metrics-port <port>" anywhere
+    vector<string> args;
+    string data_dir;
+    string snapshot_file;
+    string assume_valid;
+    string prune;
+    string metrics_port_arg;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--datadir" && i + 1 < argc)
+        {
+            data_dir = argv[++i];
+        }
+        else if (arg == "--snapshot" && i + 1 < argc)
+        {
+            snapshot_file = argv[++i];
+        }
+        else if (arg == "--assumevalid" && i + 1 < argc)
+        {
+            assume_valid = argv[++i];
+        }
+        else if (arg == "--prune" && i + 1 < argc)
+        {
+            prune = argv[++i];
+        }
+        else if (arg == "--metrics-port" && i + 1 < argc)
+        {
+            metrics_port_arg = argv[++i];
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
+
+    if (args.empty()) 
+    {
+        cerr << "Usage: " << argv[0] << " <listening_port> [peer_ip peer_port] [--datadir <dir>] [--snapshot <file>]"
+             << " [--assumevalid <height>:<block_hash>] [--prune <blocks>|<N>MB]"
+             << " [--metrics-port <port>]" << endl;
+        return 1;
+    }
+
+    int listening_port = 0;
+    int peer_port = 0;
+    int metrics_port = 0;
+    if (!parse_port(args[0], listening_port) || (args.size() == 3 && !parse_port(args[2], peer_port))
+        || (!metrics_port_arg.empty() && !parse_port(metrics_port_arg, metrics_port)))
     {
-        cerr << "Usage: " << argv[0] << " <listening_port> [peer_ip peer_port]" << endl;
+        cerr << "Ports are numbers from 1 to 65535" << endl;
         return 1;
     }
 
-    int listening_port = stoi(argv[1]);
+    if (!assume_valid.empty())
+    {
+        size_t colon = assume_valid.find(':');
+        Hash256 hash;
+        unsigned long height = 0;
+        if (colon == string::npos || !parse_number(assume_valid.substr(0, colon), INT32_MAX, height)
+            || !Hash256::fromHex(assume_valid.substr(colon + 1), hash) || hash.isZero())
+        {
+            cerr << "--assumevalid takes <height>:<block_hash>" << endl;
+            return 1;
+        }
+        my_blockchain.setAssumeValid(height, hash);
+    }
 
-    P2P::startServer(listening_port, handle_received_block, handle_received_tx, handle_received_chain);
+
+    // Pruning is set first, so an archive store that is reopened pruned is
+    // cut down straight away
+    if (!prune.empty())
+    {
+        const unsigned long MB = 1024 * 1024;
+        bool megabytes = prune.size() > 2 && prune.compare(prune.size() - 2, 2, "MB") == 0;
+        string digits = megabytes ? prune.substr(0, prune.size() - 2) : prune;
+        unsigned long max = numeric_limits<size_t>::max();
+        unsigned long amount = 0;
+        if (!parse_number(digits, megabytes ? max / MB : max, amount) || amount == 0)
+        {
+            cerr << "--prune takes a block count, or a size like 500MB" << endl;
+            return 1;
+        }
+        if (megabytes)
+        {
+            my_blockchain.setPruning(0, amount * MB);
+        }
+        else
+        {
+            my_blockchain.setPruning(amount, 0);
+        }
+    }
+
+    // Reopening this node's block store, so a restart picks up where it left off
+    if (data_dir.empty())
+    {
+        data_dir = "chaindata_" + args[0];
+    }
+    if (my_blockchain.openStore(data_dir))
+    {
+        cout << "[STORE] Opened " << data_dir << " at height " << my_blockchain.height();
+        if (my_blockchain.baseHeight() > 0)
+        {
+            cout << " (blocks from height " << my_blockchain.baseHeight() << ")";
+        }
+        cout << endl;
+    }
+    else
+    {
+        cerr << "[STORE] Could not open " << data_dir << "; running without persistence" << endl;
+    }
+    // Starting from a state snapshot rather than syncing from genesis
+    if (!snapshot_file.empty() && my_blockchain.loadState(snapshot_file))
+    {
+        cout << "[STORE] Loaded state snapshot " << snapshot_file << " at height " << my_blockchain.height() << endl;
+    }
+
+    P2P::Handlers handlers;
+    handlers.on_block = handle_received_block;
+    handlers.check_tx = check_received_tx;
+    handlers.on_tx = handle_received_tx;
+    handlers.on_get_blocks = handle_get_blocks;
+    handlers.on_blocks = handle_blocks;
+    handlers.have = have_item;
+    handlers.lookup = lookup_item;
+    handlers.fill_from_pool = [](Compact::PartialBlock& partial) { my_blockchain.fillFromMempool(partial); };
+    P2P::startServer(listening_port, handlers);
+    // Prometheus text on http://127.0.0.1:<port>/metrics (any path will do)
+    if (metrics_port > 0 && Metrics::startServer(metrics_port, []() { return collect_metrics().prometheus(); }))
+    {
+        cout << "[METRICS] Serving on 127.0.0.1:" << metrics_port << endl;
+    }
 
     // If peer is found then connect to it
-    if (argc == 4) 
+    if (args.size() == 3) 
     {
-        string peer_ip = argv[2];
-        int peer_port = stoi(argv[3]);
+        string peer_ip = args[1];
         this_thread::sleep_for(chrono::seconds(1));
-        P2P::connectToPeer(peer_ip, peer_port);
+        int peer_id = P2P::connectToPeer(peer_ip, peer_port);
+        if (peer_id >= 0)
+        {
+            request_blocks(peer_id);
+        }
     }
 
     cli_interface();
 
+    Metrics::stopServer();
+    P2P::stop();
     return 0;
 }
@@ -0,0 +1,182 @@
+#include "mempool.h"
+
+Mempool::Mempool(size_t max_count, size_t max_bytes)
+: total_bytes(0), max_count(max<size_t>(1, max_count)), max_bytes(max_bytes), next_sequence(0),
+  evicted(0), duplicates(0)
+{
+}
+
+size_t Mempool::transactionSize(const Transaction& tx)
+{
+    // The strings plus the amount and timestamp
+    return tx.id.size() + tx.sending_address.size() + tx.receiving_address.size()
+         + tx.signature.size() + tx.file_metadata.size() + 16;
+}
+
+Mempool::AddResult Mempool::add(const Transaction& tx)
+{
+    if (by_id.count(tx.id))
+    {
+        duplicates++;
+        return AddResult::Duplicate;
+    }
+
+    size_t size = transactionSize(tx);
+    double priority = tx.amount / (double)size;
+    if (size > max_bytes)
+    {
+        return AddResult::Full;
+    }
+    if (by_id.size() >= max_count || total_bytes + size > max_bytes)
+    {
+        // Only making room if the newcomer outranks what it would push out
+        if (priority <= by_priority.begin()->priority)
+        {
+            return AddResult::Full;
+        }
+        evictFor(size);
+    }
+
+    Entry& entry = by_id.emplace(tx.id, Entry{tx, tx.senderAddress(), size, {}}).first->second;
+    entry.rank = by_priority.insert(Key{priority, next_sequence++, &entry}).first;
+
+    SenderIndex& sender = by_sender[entry.sender];
+    sender.spends += tx.amount;
+    sender.entries.insert(&entry);
+    total_bytes += size;
+    return AddResult::Added;
+}
+
+// Dropping the lowest priority entries until [incoming_bytes] more fit
+void Mempool::evictFor(size_t incoming_bytes)
+{
+    while (!by_priority.empty() && (by_id.size() >= max_count || total_bytes + incoming_bytes > max_bytes))
+    {
+        erase(by_id.find(by_priority.begin()->entry->tx.id));
+        evicted++;
+    }
+}
+
+void Mempool::erase(unordered_map<Hash256, Entry>::iterator it)
+{
+    Entry& entry = it->second;
+    auto sender = by_sender.find(entry.sender);
+    if (sender != by_sender.end())
+    {
+        sender->second.spends -= entry.tx.amount;
+        sender->second.entries.erase(&entry);
+        if (sender->second.entries.empty())
+        {
+            by_sender.erase(sender);
+        }
+    }
+    by_priority.erase(entry.rank);
+    total_bytes -= entry.size;
+    by_id.erase(it);
+}
+
+const Transaction* Mempool::find(const Hash256& id) const
+{
+    auto it = by_id.find(id);
+    return it == by_id.end() ? nullptr : &it->second.tx;
+}
+
+void Mempool::forEach(const function<void(const Transaction&)>& fn) const
+{
+    for (const auto& item : by_id)
+    {
+        fn(item.second.tx);
+    }
+}
+
+bool Mempool::remove(const Hash256& id)
+{
+    auto it = by_id.find(id);
+    if (it == by_id.end())
+    {
+        return false;
+    }
+    erase(it);
+    return true;
+}
+
+void Mempool::removeConfirmed(const Block& block)
+{
+    if (by_id.empty())
+    {
+        return;
+    }
+    for (const auto& tx : block.getTransactions())
+    {
+        remove(tx.id);
+    }
+}
+
+void Mempool::clear()
+{
+    by_id.clear();
+    by_priority.clear();
+    by_sender.clear();
+    total_bytes = 0;
+}
+
+vector<Transaction> Mempool::select(size_t max_txs, size_t max_size) const
+{
+    vector<Transaction> selected;
+    size_t size = 0;
+    for (auto it = by_priority.rbegin(); it != by_priority.rend() && selected.size() < max_txs; ++it)
+    {
+        const Entry& entry = *it->entry;
+        if (size + entry.size > max_size)
+        {
+            continue;
+        }
+        size += entry.size;
+        selected.push_back(entry.tx);
+    }
+    return selected;
+}
+
+vector<Transaction> Mempool::bySender(const string& sender_address) const
+{
+    vector<Transaction> found;
+    auto sender = by_sender.find(sender_address);
+    if (sender == by_sender.end())
+    {
+        return found;
+    }
+    for (const Entry* entry : sender->second.entries)
+    {
+        found.push_back(entry->tx);
+    }
+    return found;
+}
+
+double Mempool::pendingSpends(const string& sender_address) const
+{
+    auto sender = by_sender.find(sender_address);
+    return sender == by_sender.end() ? 0.0 : sender->second.spends;
+}
+
+void Mempool::setLimits(size_t new_max_count, size_t new_max_bytes)
+{
+    max_count = max<size_t>(1, new_max_count);
+    max_bytes = new_max_bytes;
+    while (!by_priority.empty() && (by_id.size() > max_count || total_bytes > max_bytes))
+    {
+        erase(by_id.find(by_priority.begin()->entry->tx.id));
+        evicted++;
+    }
+}
+
+MempoolStats Mempool::stats() const
+{
+    MempoolStats s;
+    s.count = by_id.size();
+    s.bytes = total_bytes;
+    s.max_count = max_count;
+    s.max_bytes = max_bytes;
+    s.evicted = evicted;
+    s.duplicates = duplicates;
+    return s;
+}
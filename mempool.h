@@ -0,0 +1,128 @@
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <string>
+#include <functional>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include "blockchain.h"
+
+using namespace std;
+
+struct MempoolStats
+{
+    size_t count = 0;
+    size_t bytes = 0;
+    size_t max_count = 0;
+    size_t max_bytes = 0;
+    uint64_t evicted = 0;
+    uint64_t duplicates = 0;
+};
+
+/* Pending transaction pool
+
+   Transactions are indexed three ways:
+     - by id, so a duplicate is turned away with one hash lookup
+     - by sender, with a running total of what each sender has pending
+     - by priority (amount per byte), so blocks are filled best first and
+       the worst entry is the one evicted once the pool is full
+
+   The pool is bounded by a transaction count and by an approximate byte
+   size. A new transaction that doesn't beat the lowest entry in a full
+   pool is refused rather than evicting something better.
+*/
+class Mempool
+{
+public:
+    enum class AddResult
+    {
+        Added,
+        Duplicate,
+        Full, // the pool is full and this one ranks below everything in it
+    };
+
+    static const size_t DEFAULT_MAX_COUNT = 100000;
+    static const size_t DEFAULT_MAX_BYTES = 64 * 1024 * 1024;
+
+    Mempool(size_t max_count = DEFAULT_MAX_COUNT, size_t max_bytes = DEFAULT_MAX_BYTES);
+
+    AddResult add(const Transaction& tx);
+    bool contains(const Hash256& id) const { return by_id.count(id) > 0; }
+    // Null if [id] isn't pending
+    const Transaction* find(const Hash256& id) const;
+    bool remove(const Hash256& id);
+    // Dropping every transaction [block] confirms
+    void removeConfirmed(const Block& block);
+    void clear();
+
+    // Highest priority first, oldest first among equals, up to either limit
+    vector<Transaction> select(size_t max_count, size_t max_bytes) const;
+    vector<Transaction> bySender(const string& sender_address) const;
+    // Calling [fn] with every pending transaction, in no particular order
+    void forEach(const function<void(const Transaction&)>& fn) const;
+    // Total amount [sender_address] has waiting in the pool
+    double pendingSpends(const string& sender_address) const;
+
+    size_t size() const { return by_id.size(); }
+    size_t bytes() const { return total_bytes; }
+    void setLimits(size_t max_count, size_t max_bytes);
+    MempoolStats stats() const;
+
+    // Rough in-memory/on-wire size used for priority and the byte limit
+    static size_t transactionSize(const Transaction& tx);
+
+private:
+    struct Entry;
+    struct Key
+    {
+        double priority;
+        uint64_t sequence;
+        const Entry* entry; // by_id nodes never move, so this stays valid
+    };
+    // Lowest priority first; among equals the newest sorts lowest, so it
+    // is evicted first and mined last
+    struct KeyOrder
+    {
+        bool operator()(const Key& a, const Key& b) const
+        {
+            if (a.priority != b.priority)
+            {
+                return a.priority < b.priority;
+            }
+            return a.sequence > b.sequence;
+        }
+    };
+
+    struct Entry
+    {
+        Transaction tx;
+        string sender;
+        size_t size;
+        set<Key, KeyOrder>::iterator rank;
+    };
+
+    struct SenderIndex
+    {
+        double spends = 0.0;
+        unordered_set<const Entry*> entries;
+    };
+
+    void erase(unordered_map<Hash256, Entry>::iterator it);
+    void evictFor(size_t incoming_bytes);
+
+    unordered_map<Hash256, Entry> by_id;
+    set<Key, KeyOrder> by_priority;
+    unordered_map<string, SenderIndex> by_sender;
+
+    size_t total_bytes;
+    size_t max_count;
+    size_t max_bytes;
+    uint64_t next_sequence;
+    uint64_t evicted;
+    uint64_t duplicates;
+};
+
+#endif
@@ -0,0 +1,162 @@
+#include "merkle.h"
+
+namespace Merkle
+{
+    Hash leafHash(const Hash256& tx_id)
+    {
+        unsigned char data[1 + Crypto::HASH_SIZE];
+        data[0] = 0x00;
+        copy(tx_id.begin(), tx_id.end(), data + 1);
+        Hash out;
+        Crypto::sha256Raw(data, sizeof(data), out.data());
+        return out;
+    }
+
+    Hash nodeHash(const Hash& left, const Hash& right)
+    {
+        unsigned char data[1 + 2 * Crypto::HASH_SIZE];
+        data[0] = 0x01;
+        copy(left.begin(), left.end(), data + 1);
+        copy(right.begin(), right.end(), data + 1 + Crypto::HASH_SIZE);
+        Hash out;
+        Crypto::sha256Raw(data, sizeof(data), out.data());
+        return out;
+    }
+
+    // Merging equal sized subtrees upwards like a binary counter carrying
+    void Tree::append(const Hash& leaf)
+    {
+        Hash carry = leaf;
+        size_t level = 0;
+        while (leaf_count & ((size_t)1 << level))
+        {
+            carry = nodeHash(peaks[level], carry);
+            level++;
+        }
+        if (peaks.size() <= level)
+        {
+            peaks.resize(level + 1);
+        }
+        peaks[level] = carry;
+        leaf_count++;
+    }
+
+    // Folding the peaks from the smallest up: each larger subtree is the
+    // left child of everything to its right
+    Hash Tree::root() const
+    {
+        Hash acc{};
+        bool have = false;
+        for (size_t level = 0; level < peaks.size(); level++)
+        {
+            if (!(leaf_count & ((size_t)1 << level)))
+            {
+                continue;
+            }
+            acc = have ? nodeHash(peaks[level], acc) : peaks[level];
+            have = true;
+        }
+        return acc;
+    }
+
+    static Hash rangeRoot(const vector<Hash>& leaves, size_t begin, size_t end)
+    {
+        Tree tree;
+        for (size_t i = begin; i < end; i++)
+        {
+            tree.append(leaves[i]);
+        }
+        return tree.root();
+    }
+
+    Hash root(const vector<Hash>& leaves)
+    {
+        return rangeRoot(leaves, 0, leaves.size());
+    }
+
+    // Largest power of two strictly below [n] (n > 1)
+    static size_t splitPoint(size_t n)
+    {
+        size_t k = 1;
+        while (k * 2 < n)
+        {
+            k *= 2;
+        }
+        return k;
+    }
+
+    static void collectPath(const vector<Hash>& leaves, size_t index, size_t begin, size_t end, vector<Hash>& path)
+    {
+        size_t n = end - begin;
+        if (n <= 1)
+        {
+            return;
+        }
+        size_t k = splitPoint(n);
+        if (index < begin + k)
+        {
+            collectPath(leaves, index, begin, begin + k, path);
+            path.push_back(rangeRoot(leaves, begin + k, end));
+        }
+        else
+        {
+            collectPath(leaves, index, begin + k, end, path);
+            path.push_back(rangeRoot(leaves, begin, begin + k));
+        }
+    }
+
+    bool buildProof(const vector<Hash>& leaves, size_t index, Proof& proof)
+    {
+        if (index >= leaves.size())
+        {
+            return false;
+        }
+        proof.index = index;
+        proof.leaf_count = leaves.size();
+        proof.path.clear();
+        collectPath(leaves, index, 0, leaves.size(), proof.path);
+        return true;
+    }
+
+    // Walking back up from the leaf. [node] is the leaf's position at the
+    // current level and [last] the position of the rightmost node there;
+    // a node with no right sibling is carried up unchanged.
+    bool verifyProof(const Hash& leaf, const Proof& proof, const Hash& root)
+    {
+        if (proof.index >= proof.leaf_count)
+        {
+            return false;
+        }
+        size_t node = proof.index;
+        size_t last = proof.leaf_count - 1;
+        Hash acc = leaf;
+        for (const auto& sibling : proof.path)
+        {
+            if (last == 0)
+            {
+                return false;
+            }
+            if ((node & 1) || node == last)
+            {
+                acc = nodeHash(sibling, acc);
+                while (!(node & 1) && node != 0)
+                {
+                    node >>= 1;
+                    last >>= 1;
+                }
+            }
+            else
+            {
+                acc = nodeHash(acc, sibling);
+            }
+            node >>= 1;
+            last >>= 1;
+        }
+        return last == 0 && acc == root;
+    }
+
+    string toHex(const Hash& hash)
+    {
+        return hash.toHex();
+    }
+}
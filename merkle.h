@@ -0,0 +1,62 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include "crypto.h"
+
+using namespace std;
+
+/* Merkle tree over a block's transaction ids
+
+   Leaves and inner nodes are hashed with different one byte prefixes so a
+   node can never pass for a leaf:
+
+     leaf = SHA-256(0x00 | tx id)   (the id's 32 raw bytes)
+     node = SHA-256(0x01 | left | right)
+
+   A tree over n leaves splits at the largest power of two below n (the
+   RFC 6962 shape), so no leaf is ever duplicated to fill a level, and an
+   empty tree has the all-zero root.
+*/
+namespace Merkle
+{
+    using Hash = Hash256;
+
+    Hash leafHash(const Hash256& tx_id);
+    Hash nodeHash(const Hash& left, const Hash& right);
+
+    // Builds the root one leaf at a time. Only the roots of the complete
+    // subtrees seen so far are kept (one per set bit of the leaf count),
+    // so an append and a root are both O(log n).
+    class Tree
+    {
+    public:
+        void append(const Hash& leaf);
+        void appendTransaction(const Hash256& tx_id) { append(leafHash(tx_id)); }
+        Hash root() const;
+        size_t size() const { return leaf_count; }
+    private:
+        vector<Hash> peaks; // peaks[i] covers 2^i leaves, valid if bit i of leaf_count is set
+        size_t leaf_count = 0;
+    };
+
+    Hash root(const vector<Hash>& leaves);
+
+    // The sibling hashes from leaf [index] up to the root, lowest first
+    struct Proof
+    {
+        size_t index = 0;
+        size_t leaf_count = 0;
+        vector<Hash> path;
+    };
+
+    // False if [index] is out of range
+    bool buildProof(const vector<Hash>& leaves, size_t index, Proof& proof);
+    bool verifyProof(const Hash& leaf, const Proof& proof, const Hash& root);
+
+    string toHex(const Hash& hash);
+}
+
+#endif
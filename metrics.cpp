@@ -0,0 +1,313 @@
+#include "metrics.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace Metrics
+{
+    Histogram signature_verify;
+    Histogram block_check;
+    Histogram chain_validation;
+
+    const array<double, Histogram::BUCKETS>& Histogram::bounds()
+    {
+        static const array<double, BUCKETS> values = []()
+        {
+            array<double, BUCKETS> out{};
+            const double steps[3] = { 1.0, 2.5, 5.0 };
+            double decade = 1e-6;
+            for (size_t i = 0; i < BUCKETS; i++)
+            {
+                out[i] = steps[i % 3] * decade;
+                if (i % 3 == 2)
+                {
+                    decade *= 10.0;
+                }
+            }
+            return out;
+        }();
+        return values;
+    }
+
+    void Histogram::observe(double seconds)
+    {
+        const auto& limits = bounds();
+        size_t bucket = lower_bound(limits.begin(), limits.end(), seconds) - limits.begin();
+        counts[bucket].fetch_add(1, memory_order_relaxed);
+        count.fetch_add(1, memory_order_relaxed);
+        sum_ns.fetch_add((uint64_t)(max(0.0, seconds) * 1e9), memory_order_relaxed);
+    }
+
+    void Histogram::observe(chrono::steady_clock::duration elapsed)
+    {
+        observe(chrono::duration<double>(elapsed).count());
+    }
+
+    // The buckets are read one at a time, so a snapshot taken while others
+    // record can be off by the odd sample; [count] is their sum, so it
+    // always agrees with them
+    Histogram::Snapshot Histogram::snapshot() const
+    {
+        Snapshot snap;
+        for (size_t i = 0; i <= BUCKETS; i++)
+        {
+            snap.counts[i] = counts[i].load(memory_order_relaxed);
+            snap.count += snap.counts[i];
+        }
+        snap.sum = sum_ns.load(memory_order_relaxed) / 1e9;
+        return snap;
+    }
+
+    double Histogram::Snapshot::quantile(double q) const
+    {
+        if (count == 0)
+        {
+            return 0.0;
+        }
+        uint64_t rank = (uint64_t)(q * (count - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; i++)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+            {
+                return bounds()[i];
+            }
+        }
+        return bounds().back();
+    }
+
+    Family& Family::set(double value, const string& labels)
+    {
+        samples.push_back({ labels, value });
+        return *this;
+    }
+
+    Family& Report::counter(const string& name, const string& help)
+    {
+        families.push_back({ name, help, Kind::Counter, {}, {} });
+        return families.back();
+    }
+
+    Family& Report::gauge(const string& name, const string& help)
+    {
+        families.push_back({ name, help, Kind::Gauge, {}, {} });
+        return families.back();
+    }
+
+    void Report::histogram(const string& name, const string& help, const Histogram& source)
+    {
+        families.push_back({ name, help, Kind::Histogram, {}, source.snapshot() });
+    }
+
+    string label(const string& key, const string& value)
+    {
+        string out = key + "=\"";
+        for (char c : value)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out.push_back('\\');
+                out.push_back(c);
+            }
+            else if (c == '\n')
+            {
+                out += "\\n";
+            }
+            else
+            {
+                out.push_back(c);
+            }
+        }
+        return out + "\"";
+    }
+
+    static string braced(const string& labels)
+    {
+        return labels.empty() ? string() : "{" + labels + "}";
+    }
+
+    // Whole numbers (most counters) without a decimal point or exponent
+    static string formatValue(double value, int precision)
+    {
+        ostringstream out;
+        double whole;
+        if (modf(value, &whole) == 0.0 && fabs(value) < 9e15)
+        {
+            out << (int64_t)value;
+        }
+        else
+        {
+            out << setprecision(precision) << value;
+        }
+        return out.str();
+    }
+
+    string Report::prometheus() const
+    {
+        ostringstream out;
+        for (const auto& family : families)
+        {
+            const char* type = family.kind == Kind::Counter ? "counter"
+                             : family.kind == Kind::Gauge ? "gauge" : "histogram";
+            out << "# HELP " << family.name << " " << family.help << "\n";
+            out << "# TYPE " << family.name << " " << type << "\n";
+            if (family.kind != Kind::Histogram)
+            {
+                for (const auto& sample : family.samples)
+                {
+                    out << family.name << braced(sample.labels) << " " << formatValue(sample.value, 15) << "\n";
+                }
+                continue;
+            }
+            const auto& h = family.histogram;
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < Histogram::BUCKETS; i++)
+            {
+                cumulative += h.counts[i];
+                out << family.name << "_bucket{le=\"" << formatValue(Histogram::bounds()[i], 6) << "\"} " << cumulative << "\n";
+            }
+            out << family.name << "_bucket{le=\"+Inf\"} " << h.count << "\n";
+            out << family.name << "_sum " << formatValue(h.sum, 15) << "\n";
+            out << family.name << "_count " << h.count << "\n";
+        }
+        return out.str();
+    }
+
+    string Report::table() const
+    {
+        ostringstream out;
+        for (const auto& family : families)
+        {
+            if (family.kind == Kind::Histogram)
+            {
+                const auto& h = family.histogram;
+                out << left << setw(40) << family.name << " " << h.count << " samples";
+                if (h.count > 0)
+                {
+                    out << fixed << setprecision(3) << ", mean " << h.sum / h.count * 1e3 << " ms"
+                        << ", p50 <= " << h.quantile(0.5) * 1e3 << " ms"
+                        << ", p99 <= " << h.quantile(0.99) * 1e3 << " ms";
+                }
+                out << defaultfloat << "\n";
+                continue;
+            }
+            for (const auto& sample : family.samples)
+            {
+                // Per type/peer series are mostly zeros; only the busy ones are shown
+                if (!sample.labels.empty() && sample.value == 0.0)
+                {
+                    continue;
+                }
+                out << left << setw(40) << (family.name + braced(sample.labels)) << " "
+                    << formatValue(sample.value, 6) << "\n";
+            }
+        }
+        return out.str();
+    }
+
+    /* Scrape endpoint */
+
+    static atomic<bool> serving(false);
+    static int server_socket = -1;
+    static thread server_thread;
+
+    static void answer(int client, const function<string()>& render)
+    {
+        // The request itself doesn't matter; reading it keeps the client
+        // from seeing a reset when we close
+        char request[2048];
+        pollfd pfd = { client, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) > 0)
+        {
+            recv(client, request, sizeof(request), 0);
+        }
+        string body = render();
+        string response = "HTTP/1.0 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: " + to_string(body.size()) + "\r\n"
+                          "Connection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size())
+        {
+            ssize_t n = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                break;
+            }
+            sent += n;
+        }
+    }
+
+    bool startServer(int port, function<string()> render)
+    {
+        if (serving)
+        {
+            return false;
+        }
+        server_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_socket < 0)
+        {
+            return false;
+        }
+        int yes = 1;
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(server_socket, (sockaddr*)&address, sizeof(address)) < 0 || listen(server_socket, 8) < 0)
+        {
+            cerr << "[METRICS] Cannot listen on 127.0.0.1:" << port << ": " << strerror(errno) << endl;
+            close(server_socket);
+            server_socket = -1;
+            return false;
+        }
+
+        serving = true;
+        server_thread = thread([render]()
+        {
+            while (serving)
+            {
+                // Waking up now and then to notice stopServer
+                pollfd pfd = { server_socket, POLLIN, 0 };
+                if (poll(&pfd, 1, 250) <= 0)
+                {
+                    continue;
+                }
+                int client = accept(server_socket, nullptr, nullptr);
+                if (client < 0)
+                {
+                    continue;
+                }
+                answer(client, render);
+                close(client);
+            }
+        });
+        return true;
+    }
+
+    void stopServer()
+    {
+        if (!serving.exchange(false))
+        {
+            return;
+        }
+        if (server_thread.joinable())
+        {
+            server_thread.join();
+        }
+        close(server_socket);
+        server_socket = -1;
+    }
+}
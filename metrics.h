@@ -0,0 +1,131 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+using namespace std;
+
+/* Runtime metrics
+
+   Counters and latency histograms are plain atomics, so recording one is
+   a relaxed add on the hot path and never takes a lock. Whoever wants to
+   look (the `stats` command, a Prometheus scrape) builds a Report: the
+   current value of every metric, read on demand, which can be printed as
+   a table or as Prometheus text.
+
+   The few histograms that need to be recorded from deep inside the chain
+   code (signature checks, block and chain validation) live here as
+   globals. Everything else already has a stats struct (MiningStats,
+   MempoolStats, GossipStats, ...), and is read from that into the Report.
+*/
+namespace Metrics
+{
+    class Counter
+    {
+    public:
+        void add(uint64_t n = 1) { value.fetch_add(n, memory_order_relaxed); }
+        uint64_t get() const { return value.load(memory_order_relaxed); }
+    private:
+        atomic<uint64_t> value{0};
+    };
+
+    // Latencies in fixed buckets from 1us to 10s, three per decade
+    class Histogram
+    {
+    public:
+        static const size_t BUCKETS = 22;
+        // Upper bound of each bucket, in seconds; one more bucket past the last is +Inf
+        static const array<double, BUCKETS>& bounds();
+
+        struct Snapshot
+        {
+            array<uint64_t, BUCKETS + 1> counts{}; // per bucket, not cumulative
+            uint64_t count = 0;
+            double sum = 0.0;                       // seconds
+            // Upper bound of the bucket holding the [q] quantile
+            double quantile(double q) const;
+        };
+
+        void observe(double seconds);
+        void observe(chrono::steady_clock::duration elapsed);
+        Snapshot snapshot() const;
+
+    private:
+        array<atomic<uint64_t>, BUCKETS + 1> counts{};
+        atomic<uint64_t> count{0};
+        atomic<uint64_t> sum_ns{0};
+    };
+
+    // Recording the time until it goes out of scope
+    class Timer
+    {
+    public:
+        explicit Timer(Histogram& histogram) : histogram(histogram), start(chrono::steady_clock::now()) {}
+        ~Timer() { histogram.observe(chrono::steady_clock::now() - start); }
+    private:
+        Histogram& histogram;
+        chrono::steady_clock::time_point start;
+    };
+
+    extern Histogram signature_verify;  // signature checks that missed the cache
+    extern Histogram block_check;       // checking a block against its parent
+    extern Histogram chain_validation;  // full validateChain runs
+
+    enum class Kind { Counter, Gauge, Histogram };
+
+    struct Sample
+    {
+        string labels; // already in Prometheus form, e.g. type="block",peer="2"
+        double value;
+    };
+
+    struct Family
+    {
+        string name;
+        string help;
+        Kind kind;
+        vector<Sample> samples;
+        Histogram::Snapshot histogram; // only for Kind::Histogram
+
+        Family& set(double value, const string& labels = string());
+    };
+
+    class Report
+    {
+    public:
+        // The Family returned stays valid while more are added, so one can
+        // be filled in over a loop that adds others
+        Family& counter(const string& name, const string& help);
+        Family& gauge(const string& name, const string& help);
+        void histogram(const string& name, const string& help, const Histogram& source);
+
+        // Prometheus text exposition format, version 0.0.4
+        string prometheus() const;
+        // One line per sample (labelled ones only when non-zero), histograms
+        // as count/mean/p50/p99
+        string table() const;
+
+    private:
+        deque<Family> families; // a deque never moves what it holds
+    };
+
+    // Building "key=\"value\"" with the value escaped
+    string label(const string& key, const string& value);
+
+    /* Scrape endpoint
+       A minimal HTTP server on 127.0.0.1:[port] that answers every request
+       with render(). It runs on its own thread and handles one connection
+       at a time, which is all a scraper needs.
+    */
+    bool startServer(int port, function<string()> render);
+    void stopServer();
+}
+
+#endif
@@ -1,161 +1,1183 @@
 #include <iostream>
 #include <thread>
 #include <vector>
+#include <deque>
+#include <array>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <string>
 #include <cstring>
 #include <algorithm>
+#include <unordered_map>
 #include "p2p.h"
 #include "blockchain.h"
+#include "codec.h"
+#include "compact.h"
+#include "ingest.h"
+#include "metrics.h"
+#include "rollingset.h"
 
 using namespace std;
 
-#ifdef _WIN32
-    #include <winsock2.h>
-    #include <ws2tcpip.h>
-    #pragma comment(lib, "ws2_32.lib")
-    using socklen_t = int;
-#else
-    #include <sys/socket.h> 
-    #include <netinet/in.h>
-    #include <arpa/inet.h>
-    #include <unistd.h>
-    #define SOCKET int
-    #define INVALID_SOCKET -1
-    #define SOCKET_ERROR -1
-    #define closesocket close
-#endif
-
-const int BUFFER_SIZE = 8192;
-
-struct Peer 
+// The network engine is built on epoll, so it's Linux only
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#define SOCKET int
+#define INVALID_SOCKET -1
+#define SOCKET_ERROR -1
+#define closesocket close
+
+const int BUFFER_SIZE = 64 * 1024;
+
+/* Network engine
+   A small, fixed set of I/O threads each run their own epoll loop. Every
+   peer socket is non-blocking and belongs to exactly one loop, which does
+   all of its reads and is the only thread that closes it.
+
+   Sends never block the caller: a frame is written straight away if the
+   socket has room, and whatever is left goes on the peer's own outbound
+   queue, which its loop drains when the socket turns writable. A peer
+   whose queue passes the high-water mark, or that hasn't taken a byte for
+   [stall_timeout], is disconnected instead of holding everyone else up.
+*/
+struct Peer
 {
     SOCKET socket;
-    string ip; 
+    string ip;
     int port;
-    int id; 
+    int id;
+    size_t loop;
+
+    // Only touched by the owning loop thread
+    Protocol::FrameReader reader;
+    // Off while the ingest queue is congested; guarded by write_mutex
+    bool reading = true;
+
+    // Outbound queue, shared between senders and the owning loop
+    mutex write_mutex;
+    deque<string> outbox;
+    size_t out_offset = 0;     // bytes of outbox.front() already sent
+    size_t queued_bytes = 0;
+    chrono::steady_clock::time_point last_progress;
+    atomic<bool> closing{false};
+
+    Metrics::Counter messages_in;
+    Metrics::Counter bytes_in;
+    Metrics::Counter messages_out;
+    Metrics::Counter bytes_out;
+
+    Peer(SOCKET socket, string ip, int port, int id, size_t loop, size_t max_message_size)
+    : socket(socket), ip(move(ip)), port(port), id(id), loop(loop), reader(max_message_size),
+      last_progress(chrono::steady_clock::now())
+    {
+    }
+};
+
+using PeerPtr = shared_ptr<Peer>;
+
+struct IoLoop
+{
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    vector<PeerPtr> paused; // peers whose reads wait on the ingest queue
 };
 
-static vector<Peer> peers;
+static const uint64_t LISTENER_TAG = UINT64_MAX;
+static const uint64_t WAKE_TAG = UINT64_MAX - 1;
+
+static unordered_map<int, PeerPtr> peers;
 static mutex peers_mutex;
 static int next_peer_id = 0;
-static BlockCallback block_received; // notify of new blocks.
-static TxCallback tx_received;       // notify of new transactions
-static ChainCallback chain_received;
+static P2P::Handlers handlers;
+static size_t max_message_size = Protocol::DEFAULT_MAX_MESSAGE_SIZE;
 
+static SOCKET listen_fd = INVALID_SOCKET;
+static vector<IoLoop> loops;
+static vector<thread> loop_threads;
+static once_flag loops_started;
+static atomic<bool> running(true);
+static atomic<size_t> next_loop(0);
+static unsigned io_thread_count = 2;
+static size_t send_queue_limit = 64 * 1024 * 1024;
+static chrono::seconds stall_timeout(30);
 
-void handle_peer_connection(SOCKET peer_socket, string ip, int port)
+static IngestPipeline ingest;
+static unsigned verify_thread_count = 0;
+static size_t ingest_capacity = IngestPipeline::DEFAULT_CAPACITY;
+
+/* Items asked for and not received yet
+   Each one is remembered with the peer it was asked from until it
+   arrives or REQUEST_TIMEOUT passes, so further announcements of it don't
+   turn into more getdata. Requests are also queued oldest first, which
+   makes expiring them cheap and gives a hard cap on the total: once it is
+   reached the oldest request is forgotten. No peer gets more than its
+   share of outstanding requests; past that its announcements are ignored
+   and the item is fetched from whoever announces it next.
+*/
+class RequestTracker
 {
-    int current_peer_id;
+public:
+    using Clock = chrono::steady_clock;
+
+    RequestTracker(size_t max_total, size_t max_per_peer, Clock::duration timeout)
+        : max_total(max_total), max_per_peer(max_per_peer), timeout(timeout) {}
+
+    bool inFlight(const Hash256& hash, Clock::time_point now) const
     {
-        lock_guard<mutex> lock(peers_mutex);
-        current_peer_id = next_peer_id++;
-        peers.push_back({peer_socket, ip, port, current_peer_id});
+        auto it = requests.find(hash);
+        return it != requests.end() && now - it->second.time < timeout;
+    }
+
+    // Recording that [hash] was asked from [peer_id]. False (and nothing
+    // recorded) if the peer already has max_per_peer requests outstanding,
+    // unless [force] is set.
+    bool add(const Hash256& hash, int peer_id, Clock::time_point now, bool force = false)
+    {
+        expire(now);
+        auto it = requests.find(hash);
+        if (it != requests.end() && it->second.peer_id == peer_id)
+        {
+            it->second.time = now;
+            order.push_back({hash, now});
+            compact();
+            return true;
+        }
+        auto count = per_peer.find(peer_id);
+        if (!force && count != per_peer.end() && count->second >= max_per_peer)
+        {
+            return false;
+        }
+        if (it != requests.end())
+        {
+            release(it->second.peer_id);
+            requests.erase(it);
+        }
+        while (requests.size() >= max_total && !order.empty())
+        {
+            forget(order.front());
+            order.pop_front();
+        }
+        requests[hash] = {peer_id, now};
+        per_peer[peer_id]++;
+        order.push_back({hash, now});
+        compact();
+        return true;
+    }
+
+    // The item arrived (or we no longer want it)
+    void erase(const Hash256& hash)
+    {
+        auto it = requests.find(hash);
+        if (it != requests.end())
+        {
+            release(it->second.peer_id);
+            requests.erase(it);
+        }
     }
 
+    size_t size() const { return requests.size(); }
 
-    cout << "[P2P] Peer " << current_peer_id << " connected (" << ip << ":" << port << ")" << endl;
+private:
+    struct Request
+    {
+        int peer_id;
+        Clock::time_point time;
+    };
 
-    char buffer[BUFFER_SIZE];
+    void release(int peer_id)
+    {
+        auto count = per_peer.find(peer_id);
+        if (count != per_peer.end() && --count->second == 0)
+        {
+            per_peer.erase(count);
+        }
+    }
 
-    while(true)
+    // Dropping the request a queue entry stands for, if it is still the
+    // current one for that hash (it may have been received or re-asked)
+    void forget(const pair<Hash256, Clock::time_point>& entry)
     {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(peer_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0)
+        auto it = requests.find(entry.first);
+        if (it != requests.end() && it->second.time == entry.second)
         {
-            cout << "[P2P] Peer " << current_peer_id << " disconnected." << endl;
-            break;
+            release(it->second.peer_id);
+            requests.erase(it);
         }
+    }
 
-        // Message Protocols
-        string message(buffer, bytes_received);
-        if (message.rfind("BLOCK:", 0) == 0)
+    void expire(Clock::time_point now)
+    {
+        while (!order.empty() && now - order.front().second >= timeout)
         {
-            string block_data = message.substr(6);
+            forget(order.front());
+            order.pop_front();
+        }
+    }
 
-            if (block_received)
+    // Received and re-asked items leave stale entries behind in [order];
+    // once they outnumber the live ones the queue is rebuilt without them
+    void compact()
+    {
+        if (order.size() <= 2 * max(requests.size(), (size_t)1024))
+        {
+            return;
+        }
+        deque<pair<Hash256, Clock::time_point>> live;
+        for (const auto& entry : order)
+        {
+            auto it = requests.find(entry.first);
+            if (it != requests.end() && it->second.time == entry.second)
             {
-                block_received(Block::deserialize(block_data), current_peer_id);
+                live.push_back(entry);
             }
-            else if (message.rfind("TX:", 0) == 0)
+        }
+        order.swap(live);
+    }
+
+    size_t max_total;
+    size_t max_per_peer;
+    Clock::duration timeout;
+    unordered_map<Hash256, Request> requests;
+    unordered_map<int, size_t> per_peer;
+    deque<pair<Hash256, Clock::time_point>> order;
+};
+
+/* Gossip
+   Blocks and transactions are announced by hash (inv) and only sent in
+   full to peers that ask (getdata). Every hash we have accepted goes in
+   the seen filter, so an announcement for it is never followed up and a
+   full copy that arrives anyway is dropped before it is decoded.
+
+   The filter is a RollingHashSet, so it always remembers the most recent
+   SEEN_GENERATION..2*SEEN_GENERATION hashes.
+*/
+static const size_t SEEN_GENERATION = 50000;
+// An item asked for from one peer isn't asked for again until this passes
+static const chrono::seconds REQUEST_TIMEOUT(30);
+static const size_t MAX_REQUESTED = 100000;
+static const size_t MAX_REQUESTED_PER_PEER = 5000;
+// Most items answered from a single getdata
+static const size_t MAX_GETDATA_ITEMS = 1000;
+
+static mutex gossip_mutex;
+static RollingHashSet seen(SEEN_GENERATION);
+static RequestTracker requested(MAX_REQUESTED, MAX_REQUESTED_PER_PEER, REQUEST_TIMEOUT);
+
+static atomic<uint64_t> inv_sent(0);
+static atomic<uint64_t> inv_received(0);
+static atomic<uint64_t> items_requested(0);
+static atomic<uint64_t> items_served(0);
+static atomic<uint64_t> already_known(0);
+static atomic<uint64_t> bytes_avoided(0);
+static atomic<uint64_t> duplicates_dropped(0);
+static atomic<uint64_t> duplicate_bytes(0);
+
+/* Compact blocks
+   Announced blocks are asked for as compact blocks (see compact.h). One
+   our mempool completes is handled like a full block straight away; the
+   rest wait in [pending_compact] while the peer that sent them fills in
+   the missing transactions. Whenever rebuilding fails (colliding short
+   ids, a bad blocktxn, a rebuilt block whose hash doesn't match) that
+   peer is asked for the full block instead.
+*/
+struct PendingCompact
+{
+    Compact::PartialBlock partial;
+    int peer_id = -1;
+    chrono::steady_clock::time_point started;
+    size_t bytes = 0; // received so far
+};
+
+static const size_t MAX_PENDING_COMPACT = 64;
+static unordered_map<Hash256, PendingCompact> pending_compact; // guarded by gossip_mutex
+
+static atomic<uint64_t> compact_received(0);
+static atomic<uint64_t> compact_from_pool(0);
+static atomic<uint64_t> compact_txs_fetched(0);
+static atomic<uint64_t> compact_fallbacks(0);
+static atomic<uint64_t> compact_bytes(0);
+static atomic<uint64_t> compact_block_bytes(0);
+
+// Traffic per message type, indexed by the type byte. Slot 0 takes any
+// type we don't know: the frame reader passes those through and the
+// dispatcher ignores them, so newer peers can add types, and they're
+// reported as type "unknown".
+static const size_t MESSAGE_TYPE_SLOTS = (size_t)Protocol::MessageType::BlockTxn + 1;
+
+struct TypeTraffic
+{
+    Metrics::Counter messages_in;
+    Metrics::Counter bytes_in;
+    Metrics::Counter messages_out;
+    Metrics::Counter bytes_out;
+};
+static array<TypeTraffic, MESSAGE_TYPE_SLOTS> traffic_by_type;
+
+static TypeTraffic& trafficFor(uint8_t type)
+{
+    return traffic_by_type[type < MESSAGE_TYPE_SLOTS ? type : 0];
+}
+
+static PeerPtr findPeer(int peer_id)
+{
+    lock_guard<mutex> lock(peers_mutex);
+    auto it = peers.find(peer_id);
+    return it == peers.end() ? nullptr : it->second;
+}
+
+// Waking [loop] out of epoll_wait. The eventfd only refuses a write when
+// its counter would overflow, i.e. when plenty of wake-ups are pending
+// already, so EAGAIN is fine.
+static void wakeLoop(const IoLoop& loop)
+{
+    uint64_t one = 1;
+    if (write(loop.wake_fd, &one, sizeof(one)) != (ssize_t)sizeof(one) && errno != EAGAIN)
+    {
+        cerr << "[P2P] Cannot wake I/O loop: " << strerror(errno) << endl;
+    }
+}
+
+// Asking the owning loop to drop a peer. Only that loop closes the socket,
+// so a recycled fd can never be mistaken for this peer.
+static void requestClose(const PeerPtr& peer, const string& reason)
+{
+    if (peer->closing.exchange(true))
+    {
+        return;
+    }
+    cerr << "[P2P] Dropping peer " << peer->id << ": " << reason << endl;
+    {
+        lock_guard<mutex> lock(peer->write_mutex);
+        if (peer->socket != INVALID_SOCKET)
+        {
+            shutdown(peer->socket, SHUT_RDWR);
+        }
+    }
+    wakeLoop(loops[peer->loop]);
+}
+
+static void closePeer(const PeerPtr& peer)
+{
+    {
+        lock_guard<mutex> lock(peers_mutex);
+        peers.erase(peer->id);
+    }
+    {
+        lock_guard<mutex> lock(peer->write_mutex);
+        if (peer->socket == INVALID_SOCKET)
+        {
+            return;
+        }
+        epoll_ctl(loops[peer->loop].epoll_fd, EPOLL_CTL_DEL, peer->socket, nullptr);
+        closesocket(peer->socket);
+        peer->socket = INVALID_SOCKET;
+    }
+    cout << "[P2P] Peer " << peer->id << " disconnected." << endl;
+}
+
+// Turning EPOLLOUT interest on or off. Called with the peer's write_mutex
+// held so it can't race with the socket being closed.
+static void watchWrites(const Peer* peer, bool enable)
+{
+    if (peer->socket == INVALID_SOCKET)
+    {
+        return;
+    }
+    epoll_event ev{};
+    ev.events = (peer->reading ? (uint32_t)EPOLLIN : 0u) | EPOLLRDHUP | (enable ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.u64 = (uint64_t)peer->id;
+    epoll_ctl(loops[peer->loop].epoll_fd, EPOLL_CTL_MOD, peer->socket, &ev);
+}
+
+// Writing as much of the queue as the socket will take right now.
+// Called with the peer's write_mutex held. Returns false on a dead socket.
+static bool flushLocked(Peer& peer)
+{
+    while (!peer.outbox.empty())
+    {
+        const string& front = peer.outbox.front();
+        ssize_t n = send(peer.socket, front.data() + peer.out_offset,
+                         front.size() - peer.out_offset, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        peer.out_offset += n;
+        peer.queued_bytes -= n;
+        peer.last_progress = chrono::steady_clock::now();
+        if (peer.out_offset == front.size())
+        {
+            peer.outbox.pop_front();
+            peer.out_offset = 0;
+        }
+    }
+    return true;
+}
+
+static void queueFrame(const PeerPtr& peer, const string& framed)
+{
+    if (peer->closing)
+    {
+        return;
+    }
+
+    string close_reason;
+    {
+        lock_guard<mutex> lock(peer->write_mutex);
+        if (peer->queued_bytes + framed.size() > send_queue_limit)
+        {
+            close_reason = "send queue over " + to_string(send_queue_limit) + " bytes";
+        }
+        else
+        {
+            bool was_idle = peer->outbox.empty();
+            if (was_idle)
             {
-                string tx_data = message.substr(3);
-                if (tx_received)
-                {
-                    tx_received(Transaction::deserializer(tx_data));
-                }
+                peer->last_progress = chrono::steady_clock::now();
             }
-            else if (message.rfind("GET_CHAIN", 0) == 0)
+            peer->outbox.push_back(framed);
+            peer->queued_bytes += framed.size();
+            TypeTraffic& traffic = trafficFor((uint8_t)framed[4]); // the type byte, after the magic
+            traffic.messages_out.add();
+            traffic.bytes_out.add(framed.size());
+            peer->messages_out.add();
+            peer->bytes_out.add(framed.size());
+            if (was_idle)
             {
-                if (chain_received)
+                if (!flushLocked(*peer))
                 {
-                    P2P::sendToPeer(current_peer_id, "CHAIN_RESP:");
+                    close_reason = "send failed";
                 }
-            }
-            else if (message.rfind("CHAIN_RESP:", 0) == 0)
-            {
-                string chain_data = message.substr(11);
-                if (chain_received)
+                else if (!peer->outbox.empty())
                 {
-                    chain_received(chain_data);
+                    watchWrites(peer.get(), true);
                 }
             }
         }
     }
 
+    if (!close_reason.empty())
+    {
+        requestClose(peer, close_reason);
+    }
+}
+
+static void sendFrame(int peer_id, const string& framed);
+
+// A full block/transaction that is already in the seen filter is counted
+// and dropped without being decoded. Either way it's no longer in flight.
+static bool dropIfSeen(const Hash256& hash, size_t size)
+{
+    lock_guard<mutex> lock(gossip_mutex);
+    requested.erase(hash);
+    if (!seen.contains(hash))
+    {
+        return false;
+    }
+    duplicates_dropped++;
+    duplicate_bytes += size;
+    return true;
+}
+
+// The same for a transaction from [peer_id], except that one we keep is
+// still in flight until the ingest pipeline settles it: announcements of
+// it while it waits in the queue don't fetch more copies
+static bool dropIfSeenTx(const Hash256& id, size_t size, int peer_id)
+{
+    lock_guard<mutex> lock(gossip_mutex);
+    if (!seen.contains(id))
+    {
+        requested.add(id, peer_id, chrono::steady_clock::now(), true);
+        return false;
+    }
+    requested.erase(id);
+    duplicates_dropped++;
+    duplicate_bytes += size;
+    return true;
+}
+
+// Recording what the node made of an item a peer sent us, and passing it
+// on to everyone else if it was new
+static void settle(GossipVerdict verdict, Codec::InventoryType type, const Hash256& hash, size_t size, int peer_id)
+{
+    if (verdict == GossipVerdict::Relay)
+    {
+        P2P::announce(type, hash, size, peer_id);
+    }
+    else if (verdict == GossipVerdict::Known)
+    {
+        lock_guard<mutex> lock(gossip_mutex);
+        seen.insert(hash);
+    }
+}
+
+// Asking [peer_id] for the announced items we have neither seen nor
+// already asked someone else for
+static void handleInventory(const vector<Codec::InventoryItem>& items, int peer_id)
+{
+    vector<Codec::InventoryItem> wanted;
+    auto now = chrono::steady_clock::now();
+    for (const auto& item : items)
+    {
+        inv_received++;
+        bool known;
+        {
+            lock_guard<mutex> lock(gossip_mutex);
+            known = seen.contains(item.hash);
+        }
+        if (!known && handlers.have && handlers.have(item))
+        {
+            lock_guard<mutex> lock(gossip_mutex);
+            seen.insert(item.hash);
+            known = true;
+        }
+        if (known)
+        {
+            already_known++;
+            bytes_avoided += item.size;
+            continue;
+        }
+
+        lock_guard<mutex> lock(gossip_mutex);
+        if (requested.inFlight(item.hash, now) || !requested.add(item.hash, peer_id, now))
+        {
+            continue;
+        }
+        Codec::InventoryType type = item.type;
+        if (type == Codec::InventoryType::Block && handlers.fill_from_pool)
+        {
+            type = Codec::InventoryType::CompactBlock;
+        }
+        wanted.push_back({type, item.hash, 0});
+    }
+    if (wanted.empty())
+    {
+        return;
+    }
+    items_requested += wanted.size();
+    string request;
+    Codec::encodeInventory(wanted, request);
+    sendFrame(peer_id, Protocol::frame(Protocol::MessageType::GetData, request));
+}
+
+// Answering a getdata with the items we still have. Anything we don't is
+// left out; the peer asks someone else once its request times out.
+static void handleGetData(const vector<Codec::InventoryItem>& items, int peer_id)
+{
+    if (!handlers.lookup)
+    {
+        return;
+    }
+    size_t answered = 0;
+    for (const auto& item : items)
+    {
+        if (answered == MAX_GETDATA_ITEMS)
+        {
+            break;
+        }
+        string payload = handlers.lookup(item);
+        if (payload.empty())
+        {
+            continue;
+        }
+        Protocol::MessageType type = Protocol::MessageType::Tx;
+        if (item.type == Codec::InventoryType::Block)
+        {
+            type = Protocol::MessageType::Block;
+        }
+        else if (item.type == Codec::InventoryType::CompactBlock)
+        {
+            type = Protocol::MessageType::CmpctBlock;
+        }
+        sendFrame(peer_id, Protocol::frame(type, payload));
+        answered++;
+    }
+    items_served += answered;
+}
+
+// Asking [peer_id] for the full block after a compact one didn't work out
+static void requestFullBlock(const Hash256& hash, int peer_id)
+{
+    compact_fallbacks++;
+    {
+        lock_guard<mutex> lock(gossip_mutex);
+        requested.add(hash, peer_id, chrono::steady_clock::now(), true);
+    }
+    string request;
+    Codec::encodeInventory({{Codec::InventoryType::Block, hash, 0}}, request);
+    sendFrame(peer_id, Protocol::frame(Protocol::MessageType::GetData, request));
+}
 
+// Handing a fully rebuilt block on. A short id collision can put the wrong
+// transaction in a slot, which shows up as a hash that doesn't match.
+static void finishCompact(Compact::PartialBlock& partial, int peer_id, size_t bytes)
+{
+    Hash256 hash = partial.hash();
+    size_t block_size = (size_t)partial.blockSize();
+    Block block = partial.build();
+    if (block.calculateHash() != hash)
+    {
+        requestFullBlock(hash, peer_id);
+        return;
+    }
+    compact_bytes += bytes;
+    compact_block_bytes += block_size;
+    GossipVerdict verdict = handlers.on_block(block, peer_id);
+    settle(verdict, Codec::InventoryType::Block, hash, block_size, peer_id);
+}
+
+static void handleCompactBlock(const Codec::CompactBlockView& compact, size_t bytes, int peer_id)
+{
+    compact_received++;
+    Compact::PartialBlock partial;
+    if (!partial.init(compact))
+    {
+        requestFullBlock(compact.hash, peer_id);
+        return;
+    }
+    handlers.fill_from_pool(partial);
+    if (partial.complete())
+    {
+        compact_from_pool++;
+        finishCompact(partial, peer_id, bytes);
+        return;
+    }
+
+    vector<uint32_t> missing = partial.missing();
+    bool slot_free;
+    {
+        lock_guard<mutex> lock(gossip_mutex);
+        auto now = chrono::steady_clock::now();
+        // Peers that never answer only hold a slot until the request times out
+        for (auto it = pending_compact.begin(); it != pending_compact.end();)
+        {
+            it = now - it->second.started >= REQUEST_TIMEOUT ? pending_compact.erase(it) : next(it);
+        }
+        slot_free = pending_compact.size() < MAX_PENDING_COMPACT;
+        if (slot_free)
+        {
+            // Still in flight, so other announcements of it are left alone
+            requested.add(compact.hash, peer_id, now, true);
+            pending_compact[compact.hash] = { move(partial), peer_id, now, bytes };
+        }
+    }
+    if (!slot_free)
+    {
+        // No room to rebuild it; the block is still wanted, just in full
+        requestFullBlock(compact.hash, peer_id);
+        return;
+    }
+    compact_txs_fetched += missing.size();
+    string request;
+    Codec::encodeBlockTxnRequest(compact.hash, missing, request);
+    sendFrame(peer_id, Protocol::frame(Protocol::MessageType::GetBlockTxn, request));
+}
+
+// Sending the transactions a compact block's receiver is missing. A
+// request for anything we can't answer in full is ignored.
+static void handleGetBlockTxn(const Codec::BlockTxnRequestView& request, int peer_id)
+{
+    if (!handlers.lookup)
+    {
+        return;
+    }
+    string block_data = handlers.lookup({Codec::InventoryType::Block, request.hash, 0});
+    Codec::BlockView block;
+    vector<string_view> encoded_txs;
+    if (block_data.empty() || !Codec::decodeBlock(block_data, block) || !Codec::splitTransactions(block, encoded_txs))
+    {
+        return;
+    }
+    vector<string_view> wanted;
+    wanted.reserve(request.positions.size());
+    for (uint32_t position : request.positions)
+    {
+        if (position >= encoded_txs.size())
+        {
+            return;
+        }
+        wanted.push_back(encoded_txs[position]);
+    }
+    string reply;
+    Codec::encodeBlockTxn(request.hash, wanted, reply);
+    sendFrame(peer_id, Protocol::frame(Protocol::MessageType::BlockTxn, reply));
+}
+
+static void handleBlockTxn(const Codec::BlockTxnView& txn, size_t bytes, int peer_id)
+{
+    PendingCompact pending;
+    {
+        lock_guard<mutex> lock(gossip_mutex);
+        auto it = pending_compact.find(txn.hash);
+        if (it == pending_compact.end() || it->second.peer_id != peer_id)
+        {
+            return;
+        }
+        pending = move(it->second);
+        pending_compact.erase(it);
+    }
+
+    vector<Transaction> txs;
+    txs.reserve(min<uint64_t>(txn.tx_count, pending.partial.transactionCount()));
+    Codec::TransactionCursor cursor = txn.transactions();
+    Codec::TransactionView tx;
+    while (txs.size() <= pending.partial.transactionCount() && cursor.next(tx))
+    {
+        txs.push_back(tx.toTransaction());
+    }
+    if (txs.size() != txn.tx_count || !pending.partial.fill(txs))
+    {
+        requestFullBlock(txn.hash, peer_id);
+        return;
+    }
+    finishCompact(pending.partial, peer_id, pending.bytes + bytes);
+}
+
+// Handing a complete message to whoever handles that type
+static void dispatch(const Protocol::Message& message, int peer_id)
+{
+    using Protocol::MessageType;
+    switch (message.type)
+    {
+        case MessageType::Block:
+        {
+            Hash256 hash;
+            if (!Codec::peekBlockHash(message.payload, hash) || dropIfSeen(hash, message.payload.size()))
+            {
+                break;
+            }
+            Codec::BlockView block;
+            if (handlers.on_block && Codec::decodeBlock(message.payload, block))
+            {
+                GossipVerdict verdict = handlers.on_block(block.toBlock(), peer_id);
+                settle(verdict, Codec::InventoryType::Block, hash, message.payload.size(), peer_id);
+            }
+            break;
+        }
+        case MessageType::Tx:
+        {
+            Hash256 id;
+            if (!Codec::peekTransactionId(message.payload, id) || dropIfSeenTx(id, message.payload.size(), peer_id))
+            {
+                break;
+            }
+            // Checked and applied by the ingest pipeline, which settles it
+            Codec::TransactionView tx;
+            if (handlers.on_tx && Codec::decodeTransaction(message.payload, tx))
+            {
+                ingest.push({ tx.toTransaction(), peer_id, message.payload.size() });
+            }
+            else
+            {
+                lock_guard<mutex> lock(gossip_mutex);
+                requested.erase(id);
+            }
+            break;
+        }
+        case MessageType::GetBlocks:
+        {
+            Codec::GetBlocksView request;
+            if (handlers.on_get_blocks && Codec::decodeGetBlocks(message.payload, request))
+            {
+                handlers.on_get_blocks(request, peer_id);
+            }
+            break;
+        }
+        case MessageType::Blocks:
+        {
+            Codec::BlocksPageView page;
+            if (handlers.on_blocks && Codec::decodeBlocksPage(message.payload, page))
+            {
+                handlers.on_blocks(page, peer_id);
+            }
+            break;
+        }
+        case MessageType::Inv:
+        {
+            vector<Codec::InventoryItem> items;
+            if (Codec::decodeInventory(message.payload, items))
+            {
+                handleInventory(items, peer_id);
+            }
+            break;
+        }
+        case MessageType::GetData:
+        {
+            vector<Codec::InventoryItem> items;
+            if (Codec::decodeInventory(message.payload, items))
+            {
+                handleGetData(items, peer_id);
+            }
+            break;
+        }
+        case MessageType::CmpctBlock:
+        {
+            Hash256 hash;
+            if (!Codec::peekCompactBlockHash(message.payload, hash) || dropIfSeen(hash, message.payload.size()))
+            {
+                break;
+            }
+            Codec::CompactBlockView compact;
+            if (handlers.on_block && handlers.fill_from_pool && Codec::decodeCompactBlock(message.payload, compact))
+            {
+                handleCompactBlock(compact, message.payload.size(), peer_id);
+            }
+            break;
+        }
+        case MessageType::GetBlockTxn:
+        {
+            Codec::BlockTxnRequestView request;
+            if (Codec::decodeBlockTxnRequest(message.payload, request))
+            {
+                handleGetBlockTxn(request, peer_id);
+            }
+            break;
+        }
+        case MessageType::BlockTxn:
+        {
+            Codec::BlockTxnView txn;
+            if (handlers.on_block && Codec::decodeBlockTxn(message.payload, txn))
+            {
+                handleBlockTxn(txn, message.payload.size(), peer_id);
+            }
+            break;
+        }
+        default:
+            cout << "[P2P] Ignoring unknown message type " << (int)message.type
+            << " from peer " << peer_id << endl;
+            break;
+    }
+}
+
+// Turning a peer's reads off or back on. Data it sends meanwhile waits
+// in the socket buffer, and then TCP flow control slows the peer down.
+static void setReading(const PeerPtr& peer, bool reading)
+{
+    lock_guard<mutex> lock(peer->write_mutex);
+    peer->reading = reading;
+    watchWrites(peer.get(), !peer->outbox.empty());
+}
+
+// Reading everything the socket has and dispatching each complete message.
+// A peer that adds to a congested ingest queue isn't read from again until
+// the queue drains.
+static void handleReadable(const PeerPtr& peer, vector<char>& buffer)
+{
+    while (true)
+    {
+        ssize_t bytes_received = recv(peer->socket, buffer.data(), buffer.size(), 0);
+        if (bytes_received == 0)
+        {
+            requestClose(peer, "connection closed");
+            return;
+        }
+        if (bytes_received < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                requestClose(peer, strerror(errno));
+            }
+            return;
+        }
+
+        // One recv can end mid-message or hold several messages
+        peer->reader.append(buffer.data(), bytes_received);
+        Protocol::Message message;
+        Protocol::FrameReader::Status status;
+        bool sent_tx = false;
+        while ((status = peer->reader.next(message)) == Protocol::FrameReader::Status::Message)
+        {
+            sent_tx = sent_tx || message.type == Protocol::MessageType::Tx;
+            size_t size = Protocol::HEADER_SIZE + message.payload.size();
+            TypeTraffic& traffic = trafficFor((uint8_t)message.type);
+            traffic.messages_in.add();
+            traffic.bytes_in.add(size);
+            peer->messages_in.add();
+            peer->bytes_in.add(size);
+            dispatch(message, peer->id);
+        }
+        if (status == Protocol::FrameReader::Status::Error)
+        {
+            requestClose(peer, peer->reader.error());
+            return;
+        }
+        if (sent_tx && ingest.congested())
+        {
+            setReading(peer, false);
+            loops[peer->loop].paused.push_back(peer);
+            ingest.countThrottled();
+            return;
+        }
+    }
+}
+
+static void handleWritable(const PeerPtr& peer)
+{
+    bool ok;
+    {
+        lock_guard<mutex> lock(peer->write_mutex);
+        ok = flushLocked(*peer);
+        if (ok && peer->outbox.empty())
+        {
+            watchWrites(peer.get(), false);
+        }
+    }
+    if (!ok)
+    {
+        requestClose(peer, "send failed");
+    }
+}
+
+static void setNonBlocking(SOCKET socket)
+{
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Handing a connected socket to one of the I/O loops. It is registered
+// with epoll before anyone can find it in [peers], so a send racing with
+// this never modifies an fd epoll doesn't know yet. An event that fires in
+// between finds no peer and is simply reported again (level triggered).
+static int addPeer(SOCKET peer_socket, const string& ip, int port)
+{
+    setNonBlocking(peer_socket);
+    size_t loop = next_loop++ % loops.size();
+
+    int id;
+    {
+        lock_guard<mutex> lock(peers_mutex);
+        id = next_peer_id++;
+    }
+    PeerPtr peer = make_shared<Peer>(peer_socket, ip, port, id, loop, max_message_size);
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u64 = (uint64_t)id;
+    if (epoll_ctl(loops[loop].epoll_fd, EPOLL_CTL_ADD, peer_socket, &ev) == SOCKET_ERROR)
+    {
+        cerr << "[P2P] Cannot watch peer " << ip << ":" << port << ": " << strerror(errno) << endl;
+        closesocket(peer_socket);
+        return -1;
+    }
     {
         lock_guard<mutex> lock(peers_mutex);
-        peers.erase(remove_if(peers.begin(), peers.end(), [current_peer_id](const Peer& p)
+        peers[id] = peer;
+    }
+
+    cout << "[P2P] Peer " << peer->id << " connected (" << ip << ":" << port << ")" << endl;
+    return peer->id;
+}
+
+static void acceptAll(SOCKET listen_socket)
+{
+    while (true)
+    {
+        sockaddr_in client_addr{};
+        socklen_t addr_len = sizeof(client_addr);
+        SOCKET client_socket = accept(listen_socket, (sockaddr*)&client_addr, &addr_len);
+        if (client_socket == INVALID_SOCKET)
         {
-            return p.id == current_peer_id;
-        }), peers.end());
+            return;
+        }
+        char ip[INET_ADDRSTRLEN] = "unknown";
+        inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip));
+        addPeer(client_socket, ip, ntohs(client_addr.sin_port));
     }
-    closesocket(peer_socket);
 }
 
-// ---Setting up the server part of the P2P node---
+// Dropping peers whose queued data hasn't moved for [stall_timeout]
+static void reapStalled(size_t loop)
+{
+    vector<PeerPtr> owned;
+    {
+        lock_guard<mutex> lock(peers_mutex);
+        for (const auto& entry : peers)
+        {
+            if (entry.second->loop == loop)
+            {
+                owned.push_back(entry.second);
+            }
+        }
+    }
 
-void P2P::startServer(int port, BlockCallback on_block, TxCallback on_tx, ChainCallback chain)
+    auto now = chrono::steady_clock::now();
+    for (const auto& peer : owned)
+    {
+        bool stalled;
+        {
+            lock_guard<mutex> lock(peer->write_mutex);
+            stalled = !peer->outbox.empty() && now - peer->last_progress > stall_timeout;
+        }
+        if (stalled)
+        {
+            requestClose(peer, "stalled with unsent data");
+        }
+        if (peer->closing)
+        {
+            closePeer(peer);
+        }
+    }
+}
+
+static void runLoop(size_t index)
 {
-    block_received = on_block;
-    tx_received = on_tx;
-    chain_received = chain;
+    IoLoop& loop = loops[index];
+    vector<char> buffer(BUFFER_SIZE);
+    epoll_event events[64];
+    auto last_sweep = chrono::steady_clock::now();
 
-#ifdef _WIN32
-    WSADATA wsaData;
-    WSAStartup(MAKEWORD(2, 2), &wsaData);
-#endif
+    while (running)
+    {
+        int count = epoll_wait(loop.epoll_fd, events, 64, 1000);
+        for (int i = 0; i < count; i++)
+        {
+            uint64_t tag = events[i].data.u64;
+            if (tag == WAKE_TAG)
+            {
+                uint64_t drained;
+                read(loop.wake_fd, &drained, sizeof(drained));
+                continue;
+            }
+            if (tag == LISTENER_TAG)
+            {
+                acceptAll(listen_fd);
+                continue;
+            }
+
+            PeerPtr peer = findPeer((int)tag);
+            if (!peer)
+            {
+                continue;
+            }
+            if (!peer->closing && (events[i].events & EPOLLOUT))
+            {
+                handleWritable(peer);
+            }
+            if (!peer->closing && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+            {
+                handleReadable(peer, buffer);
+            }
+            if (peer->closing)
+            {
+                closePeer(peer);
+            }
+        }
+
+        // The applier wakes every loop once the queue drains
+        if (!loop.paused.empty() && !ingest.congested())
+        {
+            for (const auto& peer : loop.paused)
+            {
+                setReading(peer, true);
+            }
+            loop.paused.clear();
+        }
+
+        auto now = chrono::steady_clock::now();
+        if (count == 0 || now - last_sweep > chrono::seconds(1))
+        {
+            reapStalled(index);
+            last_sweep = now;
+        }
+    }
+}
+
+static void startLoops()
+{
+    call_once(loops_started, []()
+    {
+        loops.resize(max(1u, io_thread_count));
+        for (size_t i = 0; i < loops.size(); i++)
+        {
+            loops[i].epoll_fd = epoll_create1(0);
+            loops[i].wake_fd = eventfd(0, EFD_NONBLOCK);
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u64 = WAKE_TAG;
+            epoll_ctl(loops[i].epoll_fd, EPOLL_CTL_ADD, loops[i].wake_fd, &ev);
+        }
+        for (size_t i = 0; i < loops.size(); i++)
+        {
+            loop_threads.emplace_back(runLoop, i);
+        }
+
+        ingest.start(handlers.check_tx,
+            [](const IngestItem& item)
+            {
+                GossipVerdict verdict = handlers.on_tx(item.tx);
+                settle(verdict, Codec::InventoryType::Tx, item.tx.id, item.size, item.peer_id);
+                lock_guard<mutex> lock(gossip_mutex);
+                requested.erase(item.tx.id);
+                return verdict == GossipVerdict::Relay;
+            },
+            // Failed verification: no longer in flight, and another peer
+            // may still send us a valid copy
+            [](const IngestItem& item)
+            {
+                settle(GossipVerdict::Rejected, Codec::InventoryType::Tx, item.tx.id, item.size, item.peer_id);
+                lock_guard<mutex> lock(gossip_mutex);
+                requested.erase(item.tx.id);
+            },
+            []()
+            {
+                for (const auto& loop : loops)
+                {
+                    wakeLoop(loop);
+                }
+            },
+            verify_thread_count, ingest_capacity);
+    });
+}
+
+// ---Setting up the server part of the P2P node---
+
+void P2P::startServer(int port, const Handlers& on)
+{
+    handlers = on;
 
     SOCKET listen_socket = socket(AF_INET, SOCK_STREAM, 0);
-    sockaddr_in server_addr; 
+    int one = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in server_addr{};
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(port);
     server_addr.sin_addr.s_addr = INADDR_ANY;
 
-    bind(listen_socket, (sockaddr*)&server_addr, sizeof(server_addr));
-    listen(listen_socket, SOMAXCONN);
+    if (bind(listen_socket, (sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR
+        || listen(listen_socket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        cerr << "[P2P] Failed to listen on port " << port << ": " << strerror(errno) << endl;
+        closesocket(listen_socket);
+        return;
+    }
+    fcntl(listen_socket, F_SETFL, fcntl(listen_socket, F_GETFL, 0) | O_NONBLOCK);
     cout << "[P2P] Listening on port " << port << "..." << endl;
 
-    thread listener_thread([listen_socket](){
-        while(true)
-        {
-            SOCKET client_socket = accept (listen_socket, nullptr, nullptr);
-            // for each connection, use create another thread to handle it
-            thread(handle_peer_connection, client_socket, "unknown", 0).detach();
-        }
-    });
-    listener_thread.detach();
+    startLoops();
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTENER_TAG;
+    listen_fd = listen_socket;
+    epoll_ctl(loops[0].epoll_fd, EPOLL_CTL_ADD, listen_socket, &ev);
 }
 
 
 
 // Connecting this node to another peer
-void P2P::connectToPeer(const string& ip, int port)
+int P2P::connectToPeer(const string& ip, int port)
 {
     SOCKET peer_socket = socket(AF_INET, SOCK_STREAM, 0);
-    sockaddr_in peer_addr;
+    sockaddr_in peer_addr{};
     peer_addr.sin_family = AF_INET;
     peer_addr.sin_port = htons(port);
     inet_pton(AF_INET, ip.c_str(), &peer_addr.sin_addr);
@@ -164,34 +1186,172 @@ void P2P::connectToPeer(const string& ip, int port)
     {
         cerr << "[P2P] Failed to connect to " << ip << ":" << port << endl;
         closesocket(peer_socket);
-        return;
+        return -1;
     }
 
-    thread(handle_peer_connection, peer_socket, ip, port).detach();
+    startLoops();
+    return addPeer(peer_socket, ip, port);
 }
 
 
-// Sending a message to each peer connected
-void P2P::broadcast(const string& message)
+// Sending a message to each peer connected. The peer list is only held
+// long enough to copy it; the sends themselves never block.
+void P2P::broadcast(MessageType type, const string& payload)
 {
-    lock_guard<mutex> lock(peers_mutex);
-    for(const auto& peer: peers)
+    string framed = Protocol::frame(type, payload);
+    vector<PeerPtr> targets;
     {
-        send(peer.socket, message.c_str(), message.length(), 0);
+        lock_guard<mutex> lock(peers_mutex);
+        for (const auto& entry : peers)
+        {
+            targets.push_back(entry.second);
+        }
+    }
+    for (const auto& peer : targets)
+    {
+        queueFrame(peer, framed);
     }
 }
 
-void P2P::sendToPeer(int peer_id, const string& message)
+void P2P::sendToPeer(int peer_id, MessageType type, const string& payload)
 {
-    lock_guard<mutex> lock(peers_mutex);
-    for (const auto& peer : peers)
+    sendFrame(peer_id, Protocol::frame(type, payload));
+}
+
+static void sendFrame(int peer_id, const string& framed)
+{
+    PeerPtr peer = findPeer(peer_id);
+    if (peer)
+    {
+        queueFrame(peer, framed);
+    }
+}
+
+void P2P::announce(Codec::InventoryType type, const Hash256& hash, size_t size, int except_peer)
+{
+    {
+        lock_guard<mutex> lock(gossip_mutex);
+        seen.insert(hash);
+    }
+    string payload;
+    Codec::encodeInventory({ Codec::InventoryItem{type, hash, size} }, payload);
+    string framed = Protocol::frame(MessageType::Inv, payload);
+
+    vector<PeerPtr> targets;
     {
-        if (peer.id == peer_id)
+        lock_guard<mutex> lock(peers_mutex);
+        for (const auto& entry : peers)
         {
-            send(peer.socket, message.c_str(), message.length(), 0);
-            return;
+            if (entry.first != except_peer)
+            {
+                targets.push_back(entry.second);
+            }
         }
     }
+    for (const auto& peer : targets)
+    {
+        queueFrame(peer, framed);
+    }
+    inv_sent += targets.size();
+}
+
+GossipStats P2P::gossipStats()
+{
+    GossipStats stats;
+    stats.inv_sent = inv_sent;
+    stats.inv_received = inv_received;
+    stats.requested = items_requested;
+    stats.served = items_served;
+    stats.already_known = already_known;
+    stats.bytes_avoided = bytes_avoided;
+    stats.duplicates_dropped = duplicates_dropped;
+    stats.duplicate_bytes = duplicate_bytes;
+    stats.compact_received = compact_received;
+    stats.compact_from_pool = compact_from_pool;
+    stats.compact_txs_fetched = compact_txs_fetched;
+    stats.compact_fallbacks = compact_fallbacks;
+    stats.compact_bytes = compact_bytes;
+    stats.compact_block_bytes = compact_block_bytes;
+    lock_guard<mutex> lock(gossip_mutex);
+    stats.seen = seen.size();
+    return stats;
+}
+
+void P2P::setMaxMessageSize(size_t bytes)
+{
+    max_message_size = bytes;
+}
+
+void P2P::setIoThreads(unsigned threads)
+{
+    io_thread_count = threads;
+}
+
+void P2P::setSendQueueLimit(size_t bytes)
+{
+    send_queue_limit = bytes;
+}
+
+void P2P::setStallTimeout(int seconds)
+{
+    stall_timeout = chrono::seconds(seconds);
+}
+
+void P2P::setVerifyThreads(unsigned threads)
+{
+    verify_thread_count = threads;
+}
+
+void P2P::setIngestCapacity(size_t transactions)
+{
+    ingest_capacity = transactions;
+}
+
+IngestStats P2P::ingestStats()
+{
+    return ingest.stats();
+}
+
+TrafficStats P2P::trafficStats()
+{
+    TrafficStats stats;
+    for (size_t type = 0; type < MESSAGE_TYPE_SLOTS; type++)
+    {
+        const TypeTraffic& traffic = traffic_by_type[type];
+        TrafficCounts counts;
+        counts.messages_in = traffic.messages_in.get();
+        counts.bytes_in = traffic.bytes_in.get();
+        counts.messages_out = traffic.messages_out.get();
+        counts.bytes_out = traffic.bytes_out.get();
+        stats.by_type.push_back({ (MessageType)type, counts });
+    }
+
+    vector<PeerPtr> connected;
+    {
+        lock_guard<mutex> lock(peers_mutex);
+        for (const auto& entry : peers)
+        {
+            connected.push_back(entry.second);
+        }
+    }
+    for (const auto& peer : connected)
+    {
+        PeerTraffic traffic;
+        traffic.id = peer->id;
+        traffic.address = peer->ip + ":" + to_string(peer->port);
+        traffic.traffic.messages_in = peer->messages_in.get();
+        traffic.traffic.bytes_in = peer->bytes_in.get();
+        traffic.traffic.messages_out = peer->messages_out.get();
+        traffic.traffic.bytes_out = peer->bytes_out.get();
+        {
+            lock_guard<mutex> lock(peer->write_mutex);
+            traffic.queued_bytes = peer->queued_bytes;
+        }
+        stats.by_peer.push_back(move(traffic));
+    }
+    sort(stats.by_peer.begin(), stats.by_peer.end(),
+         [](const PeerTraffic& a, const PeerTraffic& b) { return a.id < b.id; });
+    return stats;
 }
 
 void P2P::listPeers()
@@ -203,15 +1363,49 @@ void P2P::listPeers()
     }
     else {
         cout << "Connected Peers:" << endl;
-        for (const auto& peer : peers)
+        for (const auto& entry : peers)
         {
+            const Peer& peer = *entry.second;
             cout << " ID: " << peer.id << " -> " << peer.ip << ":" << peer.port << endl;
         }
     }
 }
 
+// Stopping the I/O threads and closing every socket. Callbacks can be
+// running on those threads, so this has to happen before the objects they
+// use are torn down.
+void P2P::stop()
+{
+    if (!running.exchange(false))
+    {
+        return;
+    }
+    for (const auto& loop : loops)
+    {
+        wakeLoop(loop);
+    }
+    for (auto& t : loop_threads)
+    {
+        t.join();
+    }
+    loop_threads.clear();
+    ingest.stop();
+
+    lock_guard<mutex> lock(peers_mutex);
+    for (const auto& entry : peers)
+    {
+        closesocket(entry.second->socket);
+    }
+    peers.clear();
+    if (listen_fd != INVALID_SOCKET)
+    {
+        closesocket(listen_fd);
+        listen_fd = INVALID_SOCKET;
+    }
+}
+
 int P2P::getPeerCount()
 {
     lock_guard<mutex> lock(peers_mutex);
     return peers.size();
-}
\ No newline at end of file
+}
@@ -5,6 +5,10 @@
 #include <vector>
 #include <functional>
 #include "blockchain.h"
+#include "protocol.h"
+#include "codec.h"
+#include "compact.h"
+#include "ingest.h"
 using namespace std;
 
 // Block          - chunk of code
@@ -12,22 +16,122 @@ using namespace std;
 // Block callback - you pass a block as the callback.
 
 /*  Call back functions*/
-using BlockCallback = function<void(const Block&, int)>;
-using TxCallback = function<void(const Transaction&)>;
-using ChainCallback = function<void(const string&)>;
+
+// What the node made of a block or transaction a peer sent:
+//   Relay    - it's new and good; announce it to our other peers
+//   Known    - we already have it (or it's on a side branch); don't relay
+//   Rejected - invalid or unusable for now; a later copy may still be taken
+enum class GossipVerdict { Relay, Known, Rejected };
+
+using BlockCallback = function<GossipVerdict(const Block&, int)>;
+// Transactions go through the ingest pipeline (see ingest.h): the check
+// runs on the verifier threads, and only what passes reaches the
+// TxCallback, on the single applier thread
+using TxCheckCallback = function<bool(const Transaction&)>;
+using TxCallback = function<GossipVerdict(const Transaction&)>;
+// Range sync: a peer asking for the blocks after its locator, and a page of
+// blocks coming back. Both get the id of the peer to answer/ask again.
+using GetBlocksCallback = function<void(const Codec::GetBlocksView&, int)>;
+using BlocksCallback = function<void(const Codec::BlocksPageView&, int)>;
+// Inventory: whether we already have an announced item, and the encoded
+// item to send a peer that asks for it (empty if we don't have it)
+using HaveCallback = function<bool(const Codec::InventoryItem&)>;
+using LookupCallback = function<string(const Codec::InventoryItem&)>;
+// Compact blocks: offering our pending transactions to a block being rebuilt
+using PoolCallback = function<void(Compact::PartialBlock&)>;
+
+// Counters for the announce/request gossip
+struct GossipStats
+{
+    uint64_t inv_sent = 0;            // items announced to peers
+    uint64_t inv_received = 0;        // items peers announced to us
+    uint64_t requested = 0;           // items we asked for with a getdata
+    uint64_t served = 0;              // items we sent in answer to a getdata
+    uint64_t already_known = 0;       // announced items we didn't need
+    uint64_t bytes_avoided = 0;       // their announced sizes: what a full push would have cost
+    uint64_t duplicates_dropped = 0;  // full messages dropped by the seen filter
+    uint64_t duplicate_bytes = 0;
+    size_t seen = 0;                  // hashes in the seen filter
+
+    uint64_t compact_received = 0;    // compact blocks taken in
+    uint64_t compact_from_pool = 0;   // ...rebuilt entirely from our mempool
+    uint64_t compact_txs_fetched = 0; // transactions asked for with a getblocktxn
+    uint64_t compact_fallbacks = 0;   // full blocks asked for instead
+    uint64_t compact_bytes = 0;       // compact + blocktxn bytes of the blocks rebuilt
+    uint64_t compact_block_bytes = 0; // full encoded size of those same blocks
+};
+
+// Messages and bytes (frame headers included) each way
+struct TrafficCounts
+{
+    uint64_t messages_in = 0;
+    uint64_t bytes_in = 0;
+    uint64_t messages_out = 0;   // queued to send
+    uint64_t bytes_out = 0;
+};
+
+struct PeerTraffic
+{
+    int id;
+    string address;
+    TrafficCounts traffic;
+    size_t queued_bytes = 0;     // not sent yet
+};
+
+struct TrafficStats
+{
+    vector<pair<Protocol::MessageType, TrafficCounts>> by_type; // every type since startup, 0 for unknown ones
+    vector<PeerTraffic> by_peer;                                 // peers connected now
+};
 
 /*Namespaces - a namspace in C++ is a way to group related functions, classes, variables, under a scope.
                it helps avoid name conflicts.*/
 
 namespace P2P 
 {
-    void startServer(int port, BlockCallback on_block, TxCallback on_tx, ChainCallback chain);
-    void connectToPeer(const string& ip, int port);
-    void broadcast(const string& message);
-    void sendToPeer(int peer_id, const string& message);
+    using Protocol::MessageType;
+
+    struct Handlers
+    {
+        BlockCallback on_block;
+        TxCheckCallback check_tx;
+        TxCallback on_tx;
+        GetBlocksCallback on_get_blocks;
+        BlocksCallback on_blocks;
+        HaveCallback have;
+        LookupCallback lookup;
+        // Without it announced blocks are fetched in full
+        PoolCallback fill_from_pool;
+    };
+
+    void startServer(int port, const Handlers& handlers);
+    // Returns the new peer's id, or -1 if the connection failed
+    int connectToPeer(const string& ip, int port);
+    void broadcast(MessageType type, const string& payload);
+    void sendToPeer(int peer_id, MessageType type, const string& payload);
+    // Telling every peer but [except_peer] that we have an item. Peers ask
+    // for it with a getdata if they don't have it yet. [size] is its
+    // encoded size.
+    void announce(Codec::InventoryType type, const Hash256& hash, size_t size, int except_peer = -1);
+    GossipStats gossipStats();
+    IngestStats ingestStats();
+    TrafficStats trafficStats();
+    // Frames larger than this are refused and the sender is disconnected
+    void setMaxMessageSize(size_t bytes);
+    // Number of epoll I/O threads; takes effect if set before startServer
+    void setIoThreads(unsigned threads);
+    // Peers with more than this many unsent bytes queued are disconnected
+    void setSendQueueLimit(size_t bytes);
+    // Peers that take none of their queued data for this long are disconnected
+    void setStallTimeout(int seconds);
+    // Transaction verifier threads (0: one per hardware thread) and the
+    // ingest queue bound; both take effect if set before startServer
+    void setVerifyThreads(unsigned threads);
+    void setIngestCapacity(size_t transactions);
     void sendFile(int peer_id, const string& filepath, const string& recipient_pub_key);
     void listPeers();
     int getPeerCount();
+    void stop();
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,528 @@
+#ifndef PERSISTENT_H
+#define PERSISTENT_H
+
+#include <memory>
+#include <vector>
+#include <array>
+#include <string>
+#include <utility>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+/* Persistent containers
+
+   Containers the chain's writer and its snapshots share. A copy taken
+   with share() costs one pointer; after that the writer changes its own
+   copy by copying only the nodes on the path to what it changes, and
+   everything else stays shared with the snapshots, which never see a
+   change.
+
+   Nodes the writer created since its last share() can't be in any
+   snapshot, so those are changed in place: each container has an edit id,
+   every node remembers the id it was created under, and share() gives the
+   writer a new one. Applying a whole block copies each touched path once.
+
+   Not thread safe; a copy returned by share() can be read from any number
+   of threads as long as nobody changes it.
+*/
+
+// Edit ids are never reused, so a node belongs to one container at most
+inline uint64_t nextEditId()
+{
+    static atomic<uint64_t> next(1);
+    return next.fetch_add(1, memory_order_relaxed);
+}
+
+/* Vector as a radix tree of FANOUT wide nodes. Elements are only added
+   and removed at the back, and dropped from the front, which is all a
+   chain ever does: push_back, pop_back and dropFront copy one path each.
+*/
+template <typename T>
+class PersistentVector
+{
+    static const unsigned BITS = 5;
+    static const size_t FANOUT = (size_t)1 << BITS;
+    static const size_t MASK = FANOUT - 1;
+
+    struct Node
+    {
+        explicit Node(uint64_t edit) : edit(edit) {}
+        uint64_t edit;
+        vector<shared_ptr<Node>> children; // inner nodes
+        vector<T> values;                  // leaves
+    };
+
+public:
+    PersistentVector() : edit(nextEditId()) {}
+
+    template <typename It>
+    PersistentVector(It first, It last) : edit(nextEditId())
+    {
+        for (; first != last; ++first)
+        {
+            push_back(*first);
+        }
+    }
+
+    // Only share() copies, so the writer never changes a node a copy holds
+    PersistentVector(const PersistentVector&) = delete;
+    PersistentVector& operator=(const PersistentVector&) = delete;
+    PersistentVector(PersistentVector&& other) noexcept { take(other); }
+    PersistentVector& operator=(PersistentVector&& other) noexcept
+    {
+        if (this != &other)
+        {
+            take(other);
+        }
+        return *this;
+    }
+
+    PersistentVector share()
+    {
+        PersistentVector copy;
+        copy.root = root;
+        copy.shift = shift;
+        copy.first = first;
+        copy.last = last;
+        edit = nextEditId();
+        return copy;
+    }
+
+    size_t size() const { return last - first; }
+    bool empty() const { return last == first; }
+    const T& operator[](size_t i) const { return leaf(first + i)->values[(first + i) & MASK]; }
+    const T& front() const { return (*this)[0]; }
+    const T& back() const { return (*this)[size() - 1]; }
+
+    void push_back(T value)
+    {
+        if (root && last == capacity())
+        {
+            auto grown = make_shared<Node>(edit);
+            grown->children.push_back(move(root));
+            root = move(grown);
+            shift += BITS;
+        }
+        shared_ptr<Node>* slot = &root;
+        for (unsigned s = shift;; s -= BITS)
+        {
+            Node* node = editable(*slot);
+            if (s == 0)
+            {
+                node->values.push_back(move(value));
+                break;
+            }
+            size_t c = (last >> s) & MASK;
+            if (node->children.size() <= c)
+            {
+                node->children.resize(c + 1);
+            }
+            slot = &node->children[c];
+        }
+        last++;
+    }
+
+    void pop_back()
+    {
+        popFrom(root, shift);
+        last--;
+        if (last == first)
+        {
+            clear();
+        }
+    }
+
+    // Releasing the first [count] elements
+    void dropFront(size_t count)
+    {
+        if (count >= size())
+        {
+            clear();
+            return;
+        }
+        clearBelow(root, shift, 0, first + count);
+        first += count;
+    }
+
+    void clear()
+    {
+        root.reset();
+        shift = 0;
+        first = last = 0;
+    }
+
+    class const_iterator
+    {
+    public:
+        using iterator_category = forward_iterator_tag;
+        using value_type = T;
+        using difference_type = ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        const_iterator(const PersistentVector* owner, size_t position)
+        : owner(owner), position(position), node(position < owner->last ? owner->leaf(position) : nullptr) {}
+
+        const T& operator*() const { return node->values[position & MASK]; }
+        const T* operator->() const { return &**this; }
+        const_iterator& operator++()
+        {
+            position++;
+            if ((position & MASK) == 0)
+            {
+                node = position < owner->last ? owner->leaf(position) : nullptr;
+            }
+            return *this;
+        }
+        bool operator==(const const_iterator& other) const { return position == other.position; }
+        bool operator!=(const const_iterator& other) const { return position != other.position; }
+
+    private:
+        const PersistentVector* owner;
+        size_t position;
+        const Node* node; // the leaf holding [position]
+    };
+
+    const_iterator begin() const { return const_iterator(this, first); }
+    const_iterator end() const { return const_iterator(this, last); }
+
+private:
+    shared_ptr<Node> root;
+    unsigned shift = 0;   // bits of the index below the root's own digit
+    size_t first = 0;     // positions [first, last) are in use
+    size_t last = 0;
+    uint64_t edit;
+
+    void take(PersistentVector& other)
+    {
+        root = move(other.root);
+        shift = other.shift;
+        first = other.first;
+        last = other.last;
+        edit = other.edit;
+        other.clear();
+        other.edit = nextEditId();
+    }
+
+    size_t capacity() const { return (size_t)1 << (shift + BITS); }
+
+    const Node* leaf(size_t position) const
+    {
+        const Node* node = root.get();
+        for (unsigned s = shift; s > 0; s -= BITS)
+        {
+            node = node->children[(position >> s) & MASK].get();
+        }
+        return node;
+    }
+
+    Node* editable(shared_ptr<Node>& slot) const
+    {
+        if (!slot)
+        {
+            slot = make_shared<Node>(edit);
+        }
+        else if (slot->edit != edit)
+        {
+            auto copy = make_shared<Node>(*slot);
+            copy->edit = edit;
+            slot = move(copy);
+        }
+        return slot.get();
+    }
+
+    // Removing the last element under [slot], and the nodes it leaves empty
+    void popFrom(shared_ptr<Node>& slot, unsigned s)
+    {
+        Node* node = editable(slot);
+        if (s == 0)
+        {
+            node->values.pop_back();
+        }
+        else
+        {
+            popFrom(node->children.back(), s - BITS);
+            while (!node->children.empty() && !node->children.back())
+            {
+                node->children.pop_back();
+            }
+        }
+        if (node->values.empty() && node->children.empty())
+        {
+            slot.reset();
+        }
+    }
+
+    // Releasing every position below [limit] under [slot], which starts at [start]
+    void clearBelow(shared_ptr<Node>& slot, unsigned s, size_t start, size_t limit)
+    {
+        if (!slot || start >= limit)
+        {
+            return;
+        }
+        if (start + ((size_t)1 << (s + BITS)) <= limit)
+        {
+            slot.reset();
+            return;
+        }
+        Node* node = editable(slot);
+        if (s == 0)
+        {
+            for (size_t i = 0; i < node->values.size() && start + i < limit; i++)
+            {
+                node->values[i] = T();
+            }
+            return;
+        }
+        for (size_t c = 0; c < node->children.size(); c++)
+        {
+            clearBelow(node->children[c], s - BITS, start + (c << s), limit);
+        }
+    }
+};
+
+/* Hash map as a trie on the key's hash, FANOUT ways per level. Entries
+   sit in leaves of up to LEAF_SIZE, which split once they fill up, so a
+   change copies a handful of small nodes whatever the map's size.
+*/
+template <typename K, typename V, typename Hash = hash<K>>
+class PersistentMap
+{
+    static const unsigned BITS = 4;
+    static const size_t FANOUT = (size_t)1 << BITS;
+    static const size_t MASK = FANOUT - 1;
+    static const size_t LEAF_SIZE = 8;
+    static const unsigned HASH_BITS = 64;
+
+    struct Entry
+    {
+        uint64_t hash;
+        pair<K, V> item;
+    };
+
+    struct Node
+    {
+        explicit Node(uint64_t edit) : edit(edit) {}
+        uint64_t edit;
+        vector<shared_ptr<Node>> children; // FANOUT of them in inner nodes, none in leaves
+        vector<Entry> entries;
+    };
+
+public:
+    PersistentMap() : edit(nextEditId()) {}
+
+    PersistentMap(const PersistentMap&) = delete;
+    PersistentMap& operator=(const PersistentMap&) = delete;
+    PersistentMap(PersistentMap&& other) noexcept { take(other); }
+    PersistentMap& operator=(PersistentMap&& other) noexcept
+    {
+        if (this != &other)
+        {
+            take(other);
+        }
+        return *this;
+    }
+
+    PersistentMap share()
+    {
+        PersistentMap copy;
+        copy.root = root;
+        copy.count = count;
+        edit = nextEditId();
+        return copy;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    // nullptr when [key] isn't in the map
+    const V* find(const K& key) const
+    {
+        uint64_t h = Hash()(key);
+        const Node* node = root.get();
+        for (unsigned s = 0; node; s += BITS)
+        {
+            if (node->children.empty())
+            {
+                for (const auto& entry : node->entries)
+                {
+                    if (entry.hash == h && entry.item.first == key)
+                    {
+                        return &entry.item.second;
+                    }
+                }
+                return nullptr;
+            }
+            node = node->children[(h >> s) & MASK].get();
+        }
+        return nullptr;
+    }
+
+    // The value for [key], added as V() if it isn't there yet
+    V& operator[](const K& key)
+    {
+        uint64_t h = Hash()(key);
+        shared_ptr<Node>* slot = &root;
+        for (unsigned s = 0;; s += BITS)
+        {
+            Node* node = editable(*slot);
+            if (node->children.empty())
+            {
+                for (auto& entry : node->entries)
+                {
+                    if (entry.hash == h && entry.item.first == key)
+                    {
+                        return entry.item.second;
+                    }
+                }
+                // Keys whose whole hash collides share the deepest leaf
+                if (node->entries.size() < LEAF_SIZE || s >= HASH_BITS)
+                {
+                    count++;
+                    node->entries.push_back(Entry{h, {key, V()}});
+                    return node->entries.back().item.second;
+                }
+                split(*node, s);
+            }
+            slot = &node->children[(h >> s) & MASK];
+        }
+    }
+
+    void clear()
+    {
+        root.reset();
+        count = 0;
+    }
+
+    // Walking the trie depth first; the path is kept in place, so
+    // iterating never allocates
+    class const_iterator
+    {
+    public:
+        using iterator_category = forward_iterator_tag;
+        using value_type = pair<K, V>;
+        using difference_type = ptrdiff_t;
+        using pointer = const pair<K, V>*;
+        using reference = const pair<K, V>&;
+
+        const_iterator() {}
+        explicit const_iterator(const Node* root)
+        {
+            if (root)
+            {
+                path[0] = {root, 0};
+                depth = 0;
+                settle();
+            }
+        }
+
+        const pair<K, V>& operator*() const { return path[depth].node->entries[path[depth].next].item; }
+        const pair<K, V>* operator->() const { return &**this; }
+        const_iterator& operator++()
+        {
+            path[depth].next++;
+            settle();
+            return *this;
+        }
+        bool operator==(const const_iterator& other) const
+        {
+            return depth == other.depth
+                   && (depth < 0 || (path[depth].node == other.path[depth].node
+                                     && path[depth].next == other.path[depth].next));
+        }
+        bool operator!=(const const_iterator& other) const { return !(*this == other); }
+
+    private:
+        struct Frame
+        {
+            const Node* node;
+            size_t next; // child, or entry in a leaf
+        };
+        array<Frame, HASH_BITS / BITS + 2> path;
+        int depth = -1; // -1 at the end
+
+        // Moving on to the first entry at or after the current position
+        void settle()
+        {
+            while (depth >= 0)
+            {
+                Frame& top = path[depth];
+                bool leaf = top.node->children.empty();
+                size_t limit = leaf ? top.node->entries.size() : top.node->children.size();
+                if (top.next >= limit)
+                {
+                    if (--depth >= 0)
+                    {
+                        path[depth].next++;
+                    }
+                    continue;
+                }
+                if (leaf)
+                {
+                    return;
+                }
+                const Node* child = top.node->children[top.next].get();
+                if (child)
+                {
+                    path[++depth] = {child, 0};
+                }
+                else
+                {
+                    top.next++;
+                }
+            }
+        }
+    };
+
+    const_iterator begin() const { return const_iterator(root.get()); }
+    const_iterator end() const { return const_iterator(); }
+
+private:
+    shared_ptr<Node> root;
+    size_t count = 0;
+    uint64_t edit;
+
+    void take(PersistentMap& other)
+    {
+        root = move(other.root);
+        count = other.count;
+        edit = other.edit;
+        other.clear();
+        other.edit = nextEditId();
+    }
+
+    Node* editable(shared_ptr<Node>& slot) const
+    {
+        if (!slot)
+        {
+            slot = make_shared<Node>(edit);
+        }
+        else if (slot->edit != edit)
+        {
+            auto copy = make_shared<Node>(*slot);
+            copy->edit = edit;
+            slot = move(copy);
+        }
+        return slot.get();
+    }
+
+    // Turning a full leaf at depth [s] into an inner node
+    void split(Node& node, unsigned s) const
+    {
+        node.children.resize(FANOUT);
+        for (auto& entry : node.entries)
+        {
+            Node* child = editable(node.children[(entry.hash >> s) & MASK]);
+            child->entries.push_back(move(entry));
+        }
+        node.entries.clear();
+        node.entries.shrink_to_fit();
+    }
+};
+
+#endif
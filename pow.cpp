@@ -0,0 +1,110 @@
+#include "pow.h"
+#include <cstring>
+
+/* SHA256_Init / SHA256_Transform are deprecated since OpenSSL 3, but the
+   EVP interface has no way to resume from a midstate, and these are the
+   calls that reach the SHA-NI / AVX2 compression code (a portable C
+   version measured 2x slower in p2p_bench pow.kernel_hash). The warning is
+   silenced for this file only; nothing else here is deprecated.
+*/
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+
+namespace PoW
+{
+    void Header::setNonce(uint64_t nonce)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            bytes[NONCE_OFFSET + i] = (unsigned char)(nonce >> (8 * i));
+        }
+    }
+
+    bool meetsTarget(const unsigned char digest[32], int difficulty)
+    {
+        int full_bytes = difficulty / 2;
+        for (int i = 0; i < full_bytes; i++)
+        {
+            if (digest[i] != 0)
+            {
+                return false;
+            }
+        }
+        // An odd difficulty only needs the high nibble of the next byte
+        return (difficulty % 2 == 0) || (digest[full_bytes] >> 4) == 0;
+    }
+
+    Kernel::Kernel(const Header& header)
+    {
+        SHA256_Init(&midstate);
+        SHA256_Transform(&midstate, header.bytes);
+
+        // The final block never changes shape: 24 header bytes, the 0x80
+        // terminator, zeros and the 64 bit big endian message length.
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, header.bytes + 64, HEADER_SIZE - 64);
+        tail[HEADER_SIZE - 64] = 0x80;
+        uint64_t bit_length = HEADER_SIZE * 8;
+        for (int i = 0; i < 8; i++)
+        {
+            tail[63 - i] = (unsigned char)(bit_length >> (8 * i));
+        }
+    }
+
+    static inline void finish(const SHA256_CTX& mid, const unsigned char block[64], unsigned char out[32])
+    {
+        SHA256_CTX ctx = mid;
+        SHA256_Transform(&ctx, block);
+        for (int i = 0; i < 8; i++)
+        {
+            out[4 * i] = (unsigned char)(ctx.h[i] >> 24);
+            out[4 * i + 1] = (unsigned char)(ctx.h[i] >> 16);
+            out[4 * i + 2] = (unsigned char)(ctx.h[i] >> 8);
+            out[4 * i + 3] = (unsigned char)ctx.h[i];
+        }
+    }
+
+    void Kernel::hash(uint64_t nonce, unsigned char out[32]) const
+    {
+        unsigned char block[64];
+        memcpy(block, tail, sizeof(block));
+        for (int i = 0; i < 8; i++)
+        {
+            block[NONCE_OFFSET - 64 + i] = (unsigned char)(nonce >> (8 * i));
+        }
+        finish(midstate, block, out);
+    }
+
+    bool Kernel::search(uint64_t start, uint64_t count, int difficulty, const atomic<bool>& stop,
+                        uint64_t& found_nonce, unsigned char found_hash[32], uint64_t& tried) const
+    {
+        unsigned char block[64];
+        unsigned char digest[32];
+        memcpy(block, tail, sizeof(block));
+        tried = 0;
+
+        for (uint64_t n = start; n < start + count; n++)
+        {
+            for (int i = 0; i < 8; i++)
+            {
+                block[NONCE_OFFSET - 64 + i] = (unsigned char)(n >> (8 * i));
+            }
+            finish(midstate, block, digest);
+            tried++;
+
+            if (meetsTarget(digest, difficulty))
+            {
+                found_nonce = n;
+                memcpy(found_hash, digest, 32);
+                return true;
+            }
+            if ((tried & 1023) == 0 && stop.load(memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        return false;
+    }
+}
+
+#pragma GCC diagnostic pop
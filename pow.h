@@ -0,0 +1,58 @@
+#ifndef POW_H
+#define POW_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <openssl/sha.h>
+
+using namespace std;
+
+/* Proof of Work kernel
+
+   A block header is hashed as a fixed 88 byte binary layout:
+
+     [0..8)    index           int64, little endian
+     [8..16)   timestamp       int64, little endian
+     [16..48)  previous hash   32 raw bytes
+     [48..80)  merkle root     32 raw bytes (see merkle.h)
+     [80..88)  nonce           uint64, little endian
+
+   Only the last 8 bytes change while mining, so the first 64 byte SHA-256
+   block is compressed once into a midstate and every attempt only runs the
+   compression function over the final (already padded) block.
+*/
+namespace PoW
+{
+    const size_t HEADER_SIZE = 88;
+    const size_t NONCE_OFFSET = 80;
+
+    struct Header
+    {
+        unsigned char bytes[HEADER_SIZE];
+        void setNonce(uint64_t nonce);
+    };
+
+    // True when the digest starts with [difficulty] zero hex digits.
+    bool meetsTarget(const unsigned char digest[32], int difficulty);
+
+    class Kernel
+    {
+    public:
+        explicit Kernel(const Header& header);
+
+        void hash(uint64_t nonce, unsigned char out[32]) const;
+
+        // Tries [count] nonces starting at [start]. Stops early when a hash
+        // meets the target (returns true and sets found_nonce/found_hash) or
+        // when [stop] is raised. [tried] is how many nonces were hashed.
+        bool search(uint64_t start, uint64_t count, int difficulty, const atomic<bool>& stop,
+                    uint64_t& found_nonce, unsigned char found_hash[32], uint64_t& tried) const;
+
+    private:
+        SHA256_CTX midstate;
+        unsigned char tail[64]; // final block: header[64..88) + padding + bit length
+    };
+}
+
+#endif
@@ -0,0 +1,115 @@
+#include "protocol.h"
+#include "crypto.h"
+#include <cstring>
+
+namespace Protocol
+{
+    static const char MAGIC[4] = { 'P', '2', 'P', 'W' };
+
+    const char* typeName(MessageType type)
+    {
+        switch (type)
+        {
+            case MessageType::Block: return "block";
+            case MessageType::Tx: return "tx";
+            case MessageType::GetBlocks: return "get_blocks";
+            case MessageType::Blocks: return "blocks";
+            case MessageType::Inv: return "inv";
+            case MessageType::GetData: return "getdata";
+            case MessageType::CmpctBlock: return "cmpctblock";
+            case MessageType::GetBlockTxn: return "getblocktxn";
+            case MessageType::BlockTxn: return "blocktxn";
+        }
+        return "unknown";
+    }
+
+    static void checksum(string_view payload, unsigned char out[4])
+    {
+        unsigned char digest[Crypto::HASH_SIZE];
+        Crypto::sha256Raw(payload.data(), payload.size(), digest);
+        memcpy(out, digest, 4);
+    }
+
+    string frame(MessageType type, string_view payload)
+    {
+        string out;
+        out.reserve(HEADER_SIZE + payload.size());
+        out.append(MAGIC, 4);
+        out.push_back((char)type);
+        uint32_t length = (uint32_t)payload.size();
+        for (int i = 0; i < 4; i++)
+        {
+            out.push_back((char)(length >> (8 * i)));
+        }
+        unsigned char sum[4];
+        checksum(payload, sum);
+        out.append((const char*)sum, 4);
+        out.append(payload);
+        return out;
+    }
+
+    FrameReader::FrameReader(size_t max_message_size) 
+    : read_pos(0), max_message_size(max_message_size)
+    {
+    }
+
+    void FrameReader::append(const char* data, size_t length)
+    {
+        // Dropping already consumed bytes once they're most of the buffer,
+        // so a long lived connection doesn't keep growing it
+        if (read_pos > 0 && read_pos >= buffer.size() / 2)
+        {
+            buffer.erase(0, read_pos);
+            read_pos = 0;
+        }
+        buffer.append(data, length);
+    }
+
+    FrameReader::Status FrameReader::next(Message& out)
+    {
+        if (!last_error.empty())
+        {
+            return Status::Error;
+        }
+        if (buffered() < HEADER_SIZE)
+        {
+            return Status::NeedMore;
+        }
+
+        const unsigned char* header = (const unsigned char*)buffer.data() + read_pos;
+        if (memcmp(header, MAGIC, 4) != 0)
+        {
+            last_error = "bad magic";
+            return Status::Error;
+        }
+        uint32_t length = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            length |= (uint32_t)header[5 + i] << (8 * i);
+        }
+        if (length > max_message_size)
+        {
+            last_error = "message of " + to_string(length) + " bytes exceeds the " 
+                + to_string(max_message_size) + " byte limit";
+            return Status::Error;
+        }
+        if (buffered() < HEADER_SIZE + length)
+        {
+            return Status::NeedMore;
+        }
+
+        string_view payload(buffer.data() + read_pos + HEADER_SIZE, length);
+        unsigned char sum[4];
+        checksum(payload, sum);
+        if (memcmp(sum, header + 9, 4) != 0)
+        {
+            last_error = "checksum mismatch";
+            return Status::Error;
+        }
+
+        out.type = (MessageType)header[4];
+        out.payload.assign(payload.data(), payload.size());
+        read_pos += HEADER_SIZE + length;
+        return Status::Message;
+    }
+}
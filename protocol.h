@@ -0,0 +1,76 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+using namespace std;
+
+/* Wire framing for peer messages
+
+   Every message on a peer connection is one frame:
+
+     magic     4 bytes  "P2PW"
+     type      1 byte   MessageType
+     length    4 bytes  payload length, little endian
+     checksum  4 bytes  first 4 bytes of SHA-256(payload)
+     payload   [length] bytes
+
+   TCP hands us a byte stream, so a single recv can hold part of a frame
+   or several frames. FrameReader keeps the leftovers per connection and
+   hands back whole messages as they complete.
+*/
+namespace Protocol
+{
+    enum class MessageType : uint8_t
+    {
+        Block = 1,
+        Tx = 2,
+        GetBlocks = 3, // locator, answered with a Blocks page
+        Blocks = 4,
+        Inv = 5,       // hashes of blocks/transactions we have, see Codec::InventoryItem
+        GetData = 6,   // asking for announced items, answered with Block/Tx/CmpctBlock messages
+        CmpctBlock = 7,  // header + short transaction ids, see compact.h
+        GetBlockTxn = 8, // the transactions a compact block's receiver is missing
+        BlockTxn = 9,
+    };
+
+    const char* typeName(MessageType type);
+
+    const size_t HEADER_SIZE = 13;
+    const size_t DEFAULT_MAX_MESSAGE_SIZE = 32 * 1024 * 1024;
+
+    struct Message
+    {
+        MessageType type;
+        string payload;
+    };
+
+    // Building the complete frame (header + payload) for a message
+    string frame(MessageType type, string_view payload);
+
+    class FrameReader
+    {
+    public:
+        enum class Status { Message, NeedMore, Error };
+
+        explicit FrameReader(size_t max_message_size = DEFAULT_MAX_MESSAGE_SIZE);
+
+        void append(const char* data, size_t length);
+        // Message: [out] holds the next complete message.
+        // NeedMore: wait for more bytes.
+        // Error: the stream is corrupt (see error()); drop the connection.
+        Status next(Message& out);
+        const string& error() const { return last_error; }
+        size_t buffered() const { return buffer.size() - read_pos; }
+
+    private:
+        string buffer;
+        size_t read_pos;
+        size_t max_message_size;
+        string last_error;
+    };
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef ROLLINGSET_H
+#define ROLLINGSET_H
+
+#include <unordered_set>
+#include <cstddef>
+#include "crypto.h"
+
+using namespace std;
+
+/* Bounded set of the most recent hashes
+
+   Kept as two generations: once the current one holds [generation_size]
+   hashes it replaces the previous one and a fresh one is started, so the
+   last generation_size..2*generation_size hashes inserted are always
+   remembered, at no cost beyond two hash sets. Used for the p2p seen
+   filter and the signature cache.
+
+   Not thread safe; every user keeps it under its own lock.
+*/
+class RollingHashSet
+{
+public:
+    // generation_size 0 keeps nothing
+    explicit RollingHashSet(size_t generation_size) : generation_size(generation_size) {}
+
+    bool contains(const Hash256& hash) const
+    {
+        return current.count(hash) || previous.count(hash);
+    }
+
+    // Adding [hash] to the current generation. One only found in the
+    // previous generation is moved up, so it survives the next swap.
+    void insert(const Hash256& hash)
+    {
+        if (generation_size == 0 || current.count(hash))
+        {
+            return;
+        }
+        if (current.size() >= generation_size)
+        {
+            previous.swap(current);
+            current.clear();
+        }
+        current.insert(hash);
+    }
+
+    // Emptying the set, with [size] per generation from now on
+    void reset(size_t size)
+    {
+        generation_size = size;
+        current.clear();
+        previous.clear();
+    }
+
+    size_t size() const { return current.size() + previous.size(); }
+
+private:
+    size_t generation_size;
+    unordered_set<Hash256> current;
+    unordered_set<Hash256> previous;
+};
+
+#endif
@@ -0,0 +1,402 @@
+#include "blockchain.h"
+#include "codec.h"
+#include "crypto.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+/* p2p_stress - concurrency stress test for Blockchain
+
+   Runs everything that changes the chain at the same time, for a few
+   seconds:
+
+     submitters  sign transfers between funded wallets and hand them to
+                 addTransaction, like the CLI and the ingest pipeline do
+     miner       keeps mining blocks from the mempool
+     rival       a second chain that copies ours, mines its own blocks on
+                 top and offers them back through acceptBlock, so blocks
+                 arrive while we mine and short forks turn into reorgs
+     readers     check every snapshot they get (heights, links between
+                 blocks, balances against the coins mined so far) and
+                 run the sync queries next to the writers
+
+   Build it with -DP2P_TSAN=ON to have ThreadSanitizer report any data
+   race the run hits. It exits non-zero if a reader sees an inconsistent
+   snapshot or the chain doesn't validate at the end.
+
+     p2p_stress [--seconds N] [--submitters N] [--readers N] [--wallets N]
+*/
+
+struct Options
+{
+    double seconds = 5;
+    unsigned submitters = 2;
+    unsigned readers = 2;
+    size_t wallets = 8;
+};
+
+static Options options;
+
+static atomic<bool> stop(false);
+static atomic<bool> failed(false);
+static mutex report_mutex;
+
+static void fail(const string& reason)
+{
+    lock_guard<mutex> lock(report_mutex);
+    if (!failed.exchange(true))
+    {
+        cerr << "[STRESS] " << reason << endl;
+    }
+    stop = true;
+}
+
+static Transaction makeTransfer(Wallet& from, Wallet& to, double amount, time_t timestamp)
+{
+    Transaction tx;
+    tx.sending_address = from.getPublicKey();
+    tx.receiving_address = to.getAddress();
+    tx.amount = amount;
+    tx.timestamp = timestamp;
+    tx.id = tx.calculate_Hash();
+    tx.signature = from.sign(tx.id.view());
+    return tx;
+}
+
+/*Readers*/
+
+// Everything a snapshot promises: consecutive blocks that link up, and
+// balances that add up to exactly the rewards paid by those blocks
+static bool checkSnapshot(const ChainSnapshot& snap, string& reason)
+{
+    if (snap.blocks.empty())
+    {
+        reason = "empty snapshot";
+        return false;
+    }
+    double rewards = 0;
+    for (size_t i = 0; i < snap.blocks.size(); i++)
+    {
+        const Block& block = *snap.blocks[i];
+        if ((size_t)block.getIndex() != snap.base + i)
+        {
+            reason = "block " + to_string(block.getIndex()) + " at height " + to_string(snap.base + i);
+            return false;
+        }
+        if (i > 0 && block.getPreviousHash() != snap.blocks[i - 1]->getHash())
+        {
+            reason = "block " + to_string(block.getIndex()) + " doesn't link to its parent";
+            return false;
+        }
+        for (const auto& tx : block.getTransactions())
+        {
+            if (tx.sending_address == "0")
+            {
+                rewards += tx.amount;
+            }
+        }
+    }
+    double total = 0;
+    size_t addresses = 0;
+    for (const auto& balance : snap.balances)
+    {
+        if (snap.balance(balance.first) != balance.second)
+        {
+            reason = "balance of " + balance.first.substr(0, 16) + " differs between lookup and walk";
+            return false;
+        }
+        total += balance.second;
+        addresses++;
+    }
+    if (addresses != snap.balances.size())
+    {
+        reason = to_string(addresses) + " balances walked, " + to_string(snap.balances.size()) + " held";
+        return false;
+    }
+    if (fabs(total - rewards) > 1e-6 * max(1.0, rewards))
+    {
+        reason = "balances add up to " + to_string(total) + " at height " + to_string(snap.height())
+                 + ", rewards to " + to_string(rewards);
+        return false;
+    }
+    return true;
+}
+
+static void reader(Blockchain& chain, const vector<string>& addresses, atomic<uint64_t>& reads)
+{
+    uint64_t local = 0;
+    while (!stop.load(memory_order_relaxed))
+    {
+        auto snap = chain.snapshot();
+        string reason;
+        if (!checkSnapshot(*snap, reason))
+        {
+            fail("Inconsistent snapshot: " + reason);
+            break;
+        }
+        for (const auto& address : addresses)
+        {
+            chain.getBalance(address);
+            chain.getPendingSpends(address);
+        }
+        chain.hasBlock(snap->tip().getHash());
+        vector<Hash256> locator = chain.getLocator();
+        if (locator.empty())
+        {
+            fail("Empty locator");
+            break;
+        }
+
+        // A page after our parent's parent has to decode, whatever the
+        // writers did to the chain in between
+        size_t from = snap->blocks.size() > 2 ? snap->blocks.size() - 3 : 0;
+        string page = chain.encodeBlocksAfter({snap->blocks[from]->getHash()}, 16, 1 << 20);
+        Codec::BlocksPageView view;
+        if (!page.empty() && !Codec::decodeBlocksPage(page, view))
+        {
+            fail("Undecodable sync page");
+            break;
+        }
+        local++;
+    }
+    reads += local;
+}
+
+/*Writers*/
+
+// Each submitter owns its own wallets, so no Wallet is used by two threads
+static void submitter(Blockchain& chain, vector<Wallet>& wallets, size_t first, size_t step,
+                      atomic<uint64_t>& accepted, atomic<uint64_t>& refused)
+{
+    time_t stamp = time(nullptr) + (time_t)first * 1000000;
+    size_t n = wallets.size();
+    for (size_t k = first; !stop.load(memory_order_relaxed); k += step)
+    {
+        Wallet& from = wallets[k % n];
+        Wallet& to = wallets[(k + 1 + k / n) % n];
+        try
+        {
+            chain.addTransaction(makeTransfer(from, to, 0.25, stamp++));
+            accepted++;
+        }
+        catch (const runtime_error&)
+        {
+            // Out of funds or a full mempool
+            refused++;
+        }
+    }
+}
+
+// What became of the blocks one writer mined
+struct BlockCounts
+{
+    uint64_t mined = 0;
+    uint64_t extended = 0;
+    uint64_t side = 0;
+    uint64_t reorgs = 0;
+    uint64_t refused = 0;
+
+    void count(Blockchain::AcceptResult result)
+    {
+        mined++;
+        switch (result)
+        {
+        case Blockchain::AcceptResult::Extended:    extended++; break;
+        case Blockchain::AcceptResult::SideBranch:  side++; break;
+        case Blockchain::AcceptResult::Reorganized: reorgs++; break;
+        default:                                    break;
+        }
+    }
+};
+
+// Copying whatever we have that the rival doesn't, then mining a run of
+// RIVAL_RUN blocks on the rival's own tip, each offered to us as soon as
+// it is found. Whenever our miner got a block in first, the run starts
+// out as a side branch and has to overtake our chain with a reorg.
+static const unsigned RIVAL_RUN = 3;
+
+static void rival(Blockchain& chain, const string& address, BlockCounts& counts)
+{
+    Blockchain other;
+    other.setMiningThreads(1);
+    for (uint64_t round = 0; !stop.load(memory_order_relaxed); round++)
+    {
+        auto snap = chain.snapshot();
+        for (size_t i = 1; i < snap->blocks.size() && round % RIVAL_RUN == 0; i++)
+        {
+            if (!other.hasBlock(snap->blocks[i]->getHash()))
+            {
+                try
+                {
+                    other.acceptBlock(*snap->blocks[i]);
+                }
+                catch (const runtime_error& e)
+                {
+                    fail(string("Rival refused one of our blocks: ") + e.what());
+                    return;
+                }
+            }
+        }
+
+        other.minePendingTransaction(address);
+        try
+        {
+            counts.count(chain.acceptBlock(*other.getLatestBlock()));
+        }
+        catch (const runtime_error& e)
+        {
+            fail(string("Refused a rival block: ") + e.what());
+            return;
+        }
+    }
+}
+
+static string describe(const BlockCounts& counts)
+{
+    return to_string(counts.mined) + " blocks (" + to_string(counts.extended) + " extended, "
+           + to_string(counts.side) + " side branch, " + to_string(counts.reorgs) + " reorgs), "
+           + to_string(counts.refused) + " refused";
+}
+
+static bool parseArgs(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            cerr << "Missing value for " << arg << endl;
+            return false;
+        }
+        string value = argv[++i];
+        try
+        {
+            if (arg == "--seconds") options.seconds = stod(value);
+            else if (arg == "--submitters") options.submitters = max(1ul, stoul(value));
+            else if (arg == "--readers") options.readers = max(1ul, stoul(value));
+            else if (arg == "--wallets") options.wallets = max(2ul, stoul(value));
+            else
+            {
+                cerr << "Unknown option: " << arg << endl;
+                return false;
+            }
+        }
+        catch (const exception&)
+        {
+            cerr << "Invalid value for " << arg << ": " << value << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (!parseArgs(argc, argv))
+    {
+        cerr << "Usage: " << argv[0] << " [--seconds N] [--submitters N] [--readers N] [--wallets N]" << endl;
+        return 2;
+    }
+
+    // The chain reports every block it mines and every reorg on stdout.
+    // Sending the descriptor to /dev/null keeps cout itself untouched, so
+    // the threads still write through the (thread-safe) stdio buffer.
+    cout.flush();
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    Blockchain chain;
+    chain.setMiningThreads(1);
+    vector<Wallet> wallets(options.wallets);
+    vector<string> addresses;
+    for (auto& wallet : wallets)
+    {
+        wallet.generateKeys();
+        addresses.push_back(wallet.getAddress());
+        chain.minePendingTransaction(wallet.getAddress());
+    }
+    Wallet miner_wallet, rival_wallet;
+    miner_wallet.generateKeys();
+    rival_wallet.generateKeys();
+    addresses.push_back(miner_wallet.getAddress());
+    addresses.push_back(rival_wallet.getAddress());
+    size_t start_height = chain.height();
+
+    atomic<uint64_t> accepted(0), refused(0), reads(0);
+    BlockCounts miner_counts, rival_counts;
+    vector<thread> threads;
+    for (unsigned s = 0; s < options.submitters; s++)
+    {
+        threads.emplace_back(submitter, ref(chain), ref(wallets), s, options.submitters,
+                             ref(accepted), ref(refused));
+    }
+    for (unsigned r = 0; r < options.readers; r++)
+    {
+        threads.emplace_back(reader, ref(chain), cref(addresses), ref(reads));
+    }
+    threads.emplace_back(rival, ref(chain), rival_wallet.getAddress(), ref(rival_counts));
+    threads.emplace_back([&]()
+    {
+        while (!stop.load(memory_order_relaxed))
+        {
+            try
+            {
+                miner_counts.count(chain.minePendingTransaction(miner_wallet.getAddress()));
+            }
+            catch (const runtime_error&)
+            {
+                // Only possible if the tip moved and a transaction we
+                // picked no longer checks out against it
+                miner_counts.refused++;
+            }
+        }
+    });
+
+    auto deadline = chrono::steady_clock::now() + chrono::duration<double>(options.seconds);
+    while (!stop.load() && chrono::steady_clock::now() < deadline)
+    {
+        this_thread::sleep_for(chrono::milliseconds(50));
+    }
+    stop = true;
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    ValidationResult result = chain.validateChain();
+    if (!result.valid)
+    {
+        fail("Chain invalid at block " + to_string(result.first_invalid_block) + ": " + result.reason);
+    }
+    string reason;
+    if (!checkSnapshot(*chain.snapshot(), reason))
+    {
+        fail("Inconsistent final chain: " + reason);
+    }
+
+    cout.flush();
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    cout << "[STRESS] " << options.seconds << "s, " << options.submitters << " submitters, "
+         << options.readers << " readers" << endl
+         << "  transactions: " << accepted << " accepted, " << refused << " refused" << endl
+         << "  miner: " << describe(miner_counts) << endl
+         << "  rival: " << describe(rival_counts) << endl
+         << "  snapshot reads: " << reads << endl
+         << "  height: " << start_height << " -> " << chain.height()
+         << ", side blocks: " << chain.sideBlockCount() << endl
+         << (failed ? "FAILED" : "OK") << endl;
+    return failed ? 1 : 0;
+}